@@ -10,6 +10,13 @@
 #include <iomanip>
 #include <cctype>
 
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#endif
+
 #define TRUE 1
 #define FALSE 0
 
@@ -104,3 +111,42 @@ size_t core_fsize(core_file* fc)
    }
    return 0;
 }
+
+u8* core_fmap(core_file* fc, size_t* size)
+{
+   CORE_FILE* f = (CORE_FILE*)fc;
+   size_t len = core_fsize(fc);
+
+   if (!f->f || len == 0)
+      return 0;
+
+#ifdef _WIN32
+   HANDLE mapping = CreateFileMapping((HANDLE)_get_osfhandle(_fileno(f->f)), 0, PAGE_READONLY, 0, 0, 0);
+
+   if (!mapping)
+      return 0;
+
+   //the view keeps the mapping alive
+   u8* rv = (u8*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, len);
+   CloseHandle(mapping);
+#else
+   u8* rv = (u8*)mmap(0, len, PROT_READ, MAP_SHARED, fileno(f->f), 0);
+
+   if (rv == MAP_FAILED)
+      return 0;
+#endif
+
+   if (rv)
+      *size = len;
+
+   return rv;
+}
+
+void core_funmap(u8* ptr, size_t size)
+{
+#ifdef _WIN32
+   UnmapViewOfFile(ptr);
+#else
+   munmap(ptr, size);
+#endif
+}
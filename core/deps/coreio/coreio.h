@@ -10,4 +10,8 @@ size_t core_fseek(core_file* fc, size_t offs, size_t origin);
 int core_fread(core_file* fc, void* buff, size_t len);
 int core_fclose(core_file* fc);
 size_t core_fsize(core_file* fc);
-size_t core_ftell(core_file* fc);
\ No newline at end of file
+size_t core_ftell(core_file* fc);
+
+//maps the whole file read only, returns 0 if that isn't possible
+u8* core_fmap(core_file* fc, size_t* size);
+void core_funmap(u8* ptr, size_t size);
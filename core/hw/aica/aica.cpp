@@ -8,6 +8,7 @@
 #include "hw/sh4/sh4_mem.h"
 #include "hw/holly/holly.h"
 #include "hw/arm7/arm7.h"
+#include "serialize.h"
 
 #include "../libretro/libretro.h"
 
@@ -842,6 +843,7 @@ void (* AEG_STEP_LUT[4])(ChannelEx* ch);
 void (* FEG_STEP_LUT[4])(ChannelEx* ch);
 void (* ALFOWS_CALC[4])(ChannelEx* ch);
 void (* PLFOWS_CALC[4])(ChannelEx* ch);
+void (* STREAM_BATCH_LUT[5][2][2])(ChannelEx* ch);
 
 struct ChannelEx
 {
@@ -891,6 +893,7 @@ struct ChannelEx
 	void (* StepFEG)(ChannelEx* ch);
 	void (* StepStream)(ChannelEx* ch);
 	void (* StepStreamInitial)(ChannelEx* ch);
+	void (* StepBatch)(ChannelEx* ch);
 	
 	struct
 	{
@@ -1065,6 +1068,7 @@ struct ChannelEx
 
 		StepStream=STREAM_STEP_LUT[fmt][ccd->LPCTL][ccd->LPSLNK];
 		StepStreamInitial=STREAM_INITAL_STEP_LUT[fmt];
+		StepBatch=STREAM_BATCH_LUT[fmt][ccd->LPCTL][ccd->LPSLNK];
 	}
 	//SA,PCMS
 	void UpdateSA()
@@ -1377,7 +1381,7 @@ static void StepDecodeSampleInitial(ChannelEx* ch)
 }
 
 template<s32 PCMS,u32 LPCTL,u32 LPSLNK>
-static void StreamStep(ChannelEx* ch)
+static __forceinline void StreamStep(ChannelEx* ch)
 {
    ch->step.full+=ch->update_rate;
    fp_22_10 sp=ch->step;
@@ -1476,7 +1480,7 @@ static void CalcPlfo(ChannelEx* ch)
 }
 
 template<u32 state>
-static void AegStep(ChannelEx* ch)
+static __forceinline void AegStep(ChannelEx* ch)
 {
 	switch(state)
    {
@@ -1537,6 +1541,156 @@ AicaChannel AicaChannel::Chans[AICA_NUM_CHANNELS];
 
 #define Chans AicaChannel::Chans 
 
+/*
+	Batched channel mixing, for AICA_Sample32
+
+	A channel is advanced MIX_BATCH samples at a time by a loop specialised on
+	its stream mode, so the aeg/stream/lfo steps get inlined instead of going
+	through the LUTs every sample. The loop only records what the output of
+	each sample depends on: the two samples being interpolated, the fraction
+	and the three volumes the aeg and alfo give. Interpolation, volume, pan and
+	mixing then run over those arrays, 4 samples per vector, with the same
+	integer math as ChannelEx::Step.
+*/
+#define MIX_BATCH 32
+
+struct MixBatch
+{
+	DECL_ALIGN(16) s32 s0[MIX_BATCH];
+	DECL_ALIGN(16) s32 s1[MIX_BATCH];
+	DECL_ALIGN(16) s32 fp[MIX_BATCH];
+	DECL_ALIGN(16) s32 voll[MIX_BATCH];
+	DECL_ALIGN(16) s32 volr[MIX_BATCH];
+	DECL_ALIGN(16) s32 vold[MIX_BATCH];
+};
+
+DECL_ALIGN(16) static s32 mix_l[MIX_BATCH];
+DECL_ALIGN(16) static s32 mix_r[MIX_BATCH];
+
+#if !defined(MSB_FIRST) && (defined(__ARM_NEON__) || defined(__aarch64__))
+#include <arm_neon.h>
+#define MIX_NEON
+#elif !defined(MSB_FIRST) && (defined(__SSE2__) || defined(_M_X64))
+#include <emmintrin.h>
+#define MIX_SSE2
+
+//low 32 bits of the products, sse2 has no pmulld
+static __forceinline __m128i mix_mullo(__m128i a,__m128i b)
+{
+	__m128i even=_mm_mul_epu32(a,b);
+	__m128i odd=_mm_mul_epu32(_mm_srli_epi64(a,32),_mm_srli_epi64(b,32));
+
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even,_MM_SHUFFLE(0,0,2,0)),_mm_shuffle_epi32(odd,_MM_SHUFFLE(0,0,2,0)));
+}
+#endif
+
+static __forceinline void MixBatchChannel(const MixBatch& b,u32 count)
+{
+	u32 i=0;
+
+#if defined(MIX_NEON)
+	const int32x4_t one=vdupq_n_s32(1024);
+
+	for (;i+4<=count;i+=4)
+	{
+		int32x4_t fp=vld1q_s32(&b.fp[i]);
+		int32x4_t sample=vaddq_s32(vshrq_n_s32(vmulq_s32(vld1q_s32(&b.s0[i]),vsubq_s32(one,fp)),10),
+			vshrq_n_s32(vmulq_s32(vld1q_s32(&b.s1[i]),fp),10));
+
+		int32x4_t l=vshrq_n_s32(vmulq_s32(sample,vld1q_s32(&b.voll[i])),15);
+		int32x4_t r=vshrq_n_s32(vmulq_s32(sample,vld1q_s32(&b.volr[i])),15);
+		int32x4_t d=vshrq_n_s32(vmulq_s32(sample,vld1q_s32(&b.vold[i])),15);
+
+		//if both sides are silent, the dsp send is used for both
+		uint32x4_t z=vceqq_s32(vaddq_s32(l,r),vdupq_n_s32(0));
+		l=vbslq_s32(z,d,l);
+		r=vbslq_s32(z,d,r);
+
+		vst1q_s32(&mix_l[i],vaddq_s32(vld1q_s32(&mix_l[i]),l));
+		vst1q_s32(&mix_r[i],vaddq_s32(vld1q_s32(&mix_r[i]),r));
+	}
+#elif defined(MIX_SSE2)
+	const __m128i one=_mm_set1_epi32(1024);
+
+	for (;i+4<=count;i+=4)
+	{
+		__m128i fp=_mm_load_si128((__m128i*)&b.fp[i]);
+		__m128i sample=_mm_add_epi32(_mm_srai_epi32(mix_mullo(_mm_load_si128((__m128i*)&b.s0[i]),_mm_sub_epi32(one,fp)),10),
+			_mm_srai_epi32(mix_mullo(_mm_load_si128((__m128i*)&b.s1[i]),fp),10));
+
+		__m128i l=_mm_srai_epi32(mix_mullo(sample,_mm_load_si128((__m128i*)&b.voll[i])),15);
+		__m128i r=_mm_srai_epi32(mix_mullo(sample,_mm_load_si128((__m128i*)&b.volr[i])),15);
+		__m128i d=_mm_srai_epi32(mix_mullo(sample,_mm_load_si128((__m128i*)&b.vold[i])),15);
+
+		//if both sides are silent, the dsp send is used for both
+		__m128i z=_mm_cmpeq_epi32(_mm_add_epi32(l,r),_mm_setzero_si128());
+		d=_mm_and_si128(z,d);
+		l=_mm_or_si128(_mm_andnot_si128(z,l),d);
+		r=_mm_or_si128(_mm_andnot_si128(z,r),d);
+
+		_mm_store_si128((__m128i*)&mix_l[i],_mm_add_epi32(_mm_load_si128((__m128i*)&mix_l[i]),l));
+		_mm_store_si128((__m128i*)&mix_r[i],_mm_add_epi32(_mm_load_si128((__m128i*)&mix_r[i]),r));
+	}
+#endif
+
+	for (;i<count;i++)
+	{
+		s32 fp=b.fp[i];
+		s32 sample=FPMul(b.s0[i],(1024-fp),10);
+		sample+=FPMul(b.s1[i],fp,10);
+
+		s32 l=FPMul(sample,b.voll[i],15);
+		s32 r=FPMul(sample,b.volr[i],15);
+
+		//if both sides are silent, the dsp send is used for both
+		if (0==(l+r))
+			l=r=FPMul(sample,b.vold[i],15);
+
+		mix_l[i]+=l;
+		mix_r[i]+=r;
+	}
+}
+
+//stops working on the channel once its turned off
+template<s32 PCMS,u32 LPCTL,u32 LPSLNK>
+static void StreamBatch(ChannelEx* ch)
+{
+	//on the stack, so the stores can't alias the channel state
+	MixBatch b;
+	u32 i;
+
+	for (i=0;i<MIX_BATCH;i++)
+	{
+		if (!ch->enabled)
+			break;
+
+		b.s0[i]=ch->s0;
+		b.s1[i]=ch->s1;
+		b.fp[i]=ch->step.fp;
+
+		u32 ofsatt=ch->lfo.alfo+(ch->AEG.GetValue()>>2);
+		s32* logtable=ofsatt+tl_lut;
+
+		b.voll[i]=logtable[ch->VolMix.DLAtt];
+		b.volr[i]=logtable[ch->VolMix.DRAtt];
+		b.vold[i]=logtable[ch->VolMix.DSPAtt];
+
+		//Same order as ChannelEx::Step. StepAEG always matches AEG.state, FEG steps are empty
+		switch(ch->AEG.state)
+		{
+			case EG_Attack:  AegStep<EG_Attack>(ch);  break;
+			case EG_Decay1:  AegStep<EG_Decay1>(ch);  break;
+			case EG_Decay2:  AegStep<EG_Decay2>(ch);  break;
+			case EG_Release: AegStep<EG_Release>(ch); break;
+		}
+		StreamStep<PCMS,LPCTL,LPSLNK>(ch);
+		ch->lfo.Step(ch);
+	}
+
+	if (i)
+		MixBatchChannel(b,i);
+}
+
 static u32 CalcAegSteps(float t)
 {
 	const double aeg_allsteps=1024*(1<<AEG_STEP_BITS)-1;
@@ -1578,6 +1732,30 @@ void sgc_Init()
 	STREAM_STEP_LUT[3][1][1]=&StreamStep<3,1,1>;
 	STREAM_STEP_LUT[4][1][1]=&StreamStep<-1,1,1>;
 
+	STREAM_BATCH_LUT[0][0][0]=&StreamBatch<0,0,0>;
+	STREAM_BATCH_LUT[1][0][0]=&StreamBatch<1,0,0>;
+	STREAM_BATCH_LUT[2][0][0]=&StreamBatch<2,0,0>;
+	STREAM_BATCH_LUT[3][0][0]=&StreamBatch<3,0,0>;
+	STREAM_BATCH_LUT[4][0][0]=&StreamBatch<-1,0,0>;
+
+	STREAM_BATCH_LUT[0][0][1]=&StreamBatch<0,0,1>;
+	STREAM_BATCH_LUT[1][0][1]=&StreamBatch<1,0,1>;
+	STREAM_BATCH_LUT[2][0][1]=&StreamBatch<2,0,1>;
+	STREAM_BATCH_LUT[3][0][1]=&StreamBatch<3,0,1>;
+	STREAM_BATCH_LUT[4][0][1]=&StreamBatch<-1,0,1>;
+
+	STREAM_BATCH_LUT[0][1][0]=&StreamBatch<0,1,0>;
+	STREAM_BATCH_LUT[1][1][0]=&StreamBatch<1,1,0>;
+	STREAM_BATCH_LUT[2][1][0]=&StreamBatch<2,1,0>;
+	STREAM_BATCH_LUT[3][1][0]=&StreamBatch<3,1,0>;
+	STREAM_BATCH_LUT[4][1][0]=&StreamBatch<-1,1,0>;
+
+	STREAM_BATCH_LUT[0][1][1]=&StreamBatch<0,1,1>;
+	STREAM_BATCH_LUT[1][1][1]=&StreamBatch<1,1,1>;
+	STREAM_BATCH_LUT[2][1][1]=&StreamBatch<2,1,1>;
+	STREAM_BATCH_LUT[3][1][1]=&StreamBatch<3,1,1>;
+	STREAM_BATCH_LUT[4][1][1]=&StreamBatch<-1,1,1>;
+
 	STREAM_INITAL_STEP_LUT[0]=&StepDecodeSampleInitial<0>;
 	STREAM_INITAL_STEP_LUT[1]=&StepDecodeSampleInitial<1>;
 	STREAM_INITAL_STEP_LUT[2]=&StepDecodeSampleInitial<2>;
@@ -1687,8 +1865,6 @@ static void ReadCommonReg(u32 reg,bool byte)
 static s16 cdda_sector[CDDA_SIZE] = {0};
 static u32 cdda_index             = CDDA_SIZE<<1;
 
-static int32_t mxlr[64];
-
 struct SoundFrame
 {
    s16 l;
@@ -1719,31 +1895,13 @@ void AICA_Sample32(void)
 	if (settings.aica.NoBatch)
 		return;
 
-	memset(mxlr,0,sizeof(mxlr));
+	memset(mix_l,0,sizeof(mix_l));
+	memset(mix_r,0,sizeof(mix_r));
 
 	//Generate 32 samples for each channel, before moving to next channel
 	//much more cache efficient !
-	u32 sg=0;
 	for (int ch = 0; ch < AICA_NUM_CHANNELS; ch++)
-	{
-		for (int i=0;i<32;i++)
-		{
-			int32_t oLeft,oRight,oDsp;
-			//stop working on this channel if its turned off ...
-			if (!Chans[ch].Step(oLeft, oRight, oDsp))
-				break;
-
-			sg++;
-
-			if (0==(oLeft+oRight))
-			{
-				oLeft=oRight=oDsp;
-			}
-
-			mxlr[i*2+0] += oLeft;
-			mxlr[i*2+1] += oRight;
-		}
-	}
+		Chans[ch].StepBatch(&Chans[ch]);
 
 	//OK , generated all Channels  , now DSP/ect + final mix ;p
 	//CDDA EXTS input
@@ -1752,8 +1910,8 @@ void AICA_Sample32(void)
 	{
 		int32_t mixl,mixr;
 
-		mixl=mxlr[i*2+0];
-		mixr=mxlr[i*2+1];
+		mixl=mix_l[i];
+		mixr=mix_r[i];
 
 		if (cdda_index>=CDDA_SIZE)
 		{
@@ -2079,3 +2237,70 @@ void term_mem(void)
 
 }
 
+
+void aica_Serialize(ser_Stream& s)
+{
+	SER(s,aica_reg);
+	SER(s,VREG);
+	SER(s,ARMRST);
+	SER(s,rtc_EN);
+	SER(s,settings.dreamcast.RTC);
+
+	for (u32 i=0;i<3;i++)
+	{
+		SER(s,timers[i].m_step);
+		SER(s,timers[i].c_step);
+	}
+
+	SER(s,aica_pending_dma);
+	SER(s,cdda_sector);
+	SER(s,cdda_index);
+
+	for (u32 i=0;i<AICA_NUM_CHANNELS;i++)
+	{
+		ChannelEx* ch=&Chans[i];
+
+		//the derived values come from the registers, RegWrite would key on
+		if (s.load())
+		{
+			ch->UpdateStreamStep();
+			ch->UpdateSA();
+			ch->UpdateLoop();
+			ch->UpdateAEG();
+			ch->UpdatePitch();
+			ch->UpdateLFO();
+			ch->UpdateDSPMIX();
+			ch->UpdateAtts();
+		}
+
+		SER(s,ch->CA);
+		SER(s,ch->step);
+		SER(s,ch->s0);
+		SER(s,ch->s1);
+		SER(s,ch->loop);
+		SER(s,ch->adpcm.last_quant);
+		SER(s,ch->noise_state);
+		SER(s,ch->AEG.val);
+		SER(s,ch->AEG.state);
+		SER(s,ch->FEG.value);
+		SER(s,ch->FEG.state);
+		SER(s,ch->lfo.counter);
+		SER(s,ch->lfo.state);
+		SER(s,ch->lfo.alfo);
+		SER(s,ch->lfo.plfo);
+		SER(s,ch->enabled);
+
+		if (s.load())
+		{
+			ch->AEG.state=(_EG_state)(ch->AEG.state&3);
+			ch->FEG.state=(_EG_state)(ch->FEG.state&3);
+			ch->StepAEG=AEG_STEP_LUT[ch->AEG.state];
+			ch->StepFEG=FEG_STEP_LUT[ch->FEG.state];
+		}
+	}
+
+	ser_Data(s,&dsp.TEMP,offsetof(dsp_t,dyndirty)-offsetof(dsp_t,TEMP));
+
+	if (s.load())
+		dsp.dyndirty=true;
+}
@@ -1,4 +1,11 @@
-﻿#include "dsp.h"
+﻿#include "build.h"
+
+//xbyak has to come before types.h, verify clashes with it
+#if HOST_CPU == CPU_X64 && FEAT_DSPREC == DYNAREC_JIT
+#include "deps/xbyak/xbyak.h"
+#endif
+
+#include "dsp.h"
 #include "aica.h"
 
 /*
@@ -20,15 +27,16 @@
 
 DECL_ALIGN(4096) dsp_t dsp;
 
-#if HOST_CPU == CPU_X86 && FEAT_DSPREC == DYNAREC_JIT
+#if FEAT_DSPREC == DYNAREC_JIT && (HOST_CPU == CPU_X86 || HOST_CPU == CPU_X64)
+#if HOST_CPU == CPU_X86
 #include "emitter/x86_emitter.h"
 
-const bool SUPPORT_NOFL=false;
-
-
 #define assert verify
 
 #pragma warning(disable:4311)
+#endif
+
+const bool SUPPORT_NOFL=false;
 
 struct _INST
 {
@@ -158,7 +166,7 @@ void DecodeInst(u32 *IPtr,_INST *i)
 	i->NXADR=(IPtr[3]>>7)&0x1;
 }
 
-
+#if HOST_CPU == CPU_X86
 void* dyna_realloc(void*ptr,u32 oldsize,u32 newsize)
 {
 	return dsp.DynCode;
@@ -746,6 +754,363 @@ void dsp_recompile()
 	x86e.Generate();
 }
 
+#else
+
+/*
+	x64 backend, built on xbyak.
+
+	Same model as the x86 one: dsp regs stay in memory, the wires of a step
+	live in host regs.
+	rbx: dsp, rbp: DSPData, r12: aica ram
+	r8d: INPUTS, r9d: MAD_OUT_NV, r10d: MEM_RD_DATA_NV
+
+	COEF, RBL and RBP are baked into the code, writing them marks it dirty.
+*/
+
+class DSPAssembler : public Xbyak::CodeGenerator
+{
+	static int dsp_ofs(const void* p) { return (int)((u8*)p-(u8*)&dsp); }
+	static int data_ofs(const void* p) { return (int)((u8*)p-(u8*)DSPData); }
+
+	Xbyak::Address dsp_reg(const void* p) { return dword[rbx+dsp_ofs(p)]; }
+	Xbyak::Address data_reg(const void* p) { return dword[rbp+data_ofs(p)]; }
+
+	//sign extend to 32 bits
+	void SignExtend(const Xbyak::Reg32& reg,u32 src_sz,u32 dst_sz=0xFF)
+	{
+		if (dst_sz==0xFF)
+			dst_sz=src_sz;
+		shl(reg,32-src_sz);
+		sar(reg,32-dst_sz);
+	}
+
+	//TEMP[(MDEC_CT+num)&127], uses ecx
+	Xbyak::Address TempAddr(u32 num)
+	{
+		mov(ecx,dsp_reg(&dsp.regs.MDEC_CT));
+		add(ecx,num);
+		and_(ecx,127);
+		return dword[rbx+rcx*4+dsp_ofs(dsp.TEMP)];
+	}
+
+	//Reads : MWT_1,MRD_1,MEM_ADDR
+	//Writes : MEM_RD_DATA_NV (r10d)
+	void DRAM_CI(const _INST& prev_op,u32 step)
+	{
+		//the request was made on the previous (odd) step
+		if ((step&1) || (!prev_op.MRD && !prev_op.MWT))
+			return;
+
+		mov(eax,dsp_reg(&dsp.regs.MEM_ADDR));
+		and_(eax,AICA_RAM_MASK);
+
+		if (prev_op.MRD)
+			movsx(r10d,word[r12+rax]);
+
+		if (prev_op.MWT)
+		{
+			mov(edx,dsp_reg(&dsp.regs.MEM_WT_DATA));
+			mov(word[r12+rax],dx);
+		}
+	}
+
+	//Reads : ADRS_REG,MADRS,MDEC_CT
+	//Writes : MEM_ADDR
+	void MEM_AGU(const _INST& op,u32 step)
+	{
+		//only valid on odd steps
+		if (!(step&1))
+			return;
+
+		mov(eax,data_reg(&DSPData->MADRS[op.MASA]));
+
+		if (op.ADREB)
+			add(eax,dsp_reg(&dsp.regs.ADRS_REG));
+
+		if (op.NXADR)
+			add(eax,1);
+
+		if (!op.TABLE)
+		{
+			add(eax,dsp_reg(&dsp.regs.MDEC_CT));
+			and_(eax,dsp.RBL);
+		}
+		else
+			and_(eax,0xFFFF);
+
+		//16:1 address, in samples
+		lea(eax,ptr[rax*2+dsp.RBP]);
+		mov(dsp_reg(&dsp.regs.MEM_ADDR),eax);
+	}
+
+	//Reads : MEMS,MIXS,EXTS
+	//Writes : INPUTS (r8d)
+	void INPUTS(const _INST& op)
+	{
+		//only the multiplier and Y_REG look at it
+		if (!op.XSEL && !op.YRL)
+			return;
+
+		if (op.IRA<0x20)
+		{
+			mov(r8d,dsp_reg(&dsp.MEMS[op.IRA]));
+			SignExtend(r8d,24);
+		}
+		else if (op.IRA<0x30)
+		{
+			mov(r8d,dsp_reg(&dsp.MIXS[op.IRA-0x20]));
+			SignExtend(r8d,20,24);
+		}
+		else if (op.IRA<0x32)
+		{
+			mov(r8d,data_reg(&DSPData->EXTS[op.IRA-0x30]));
+			SignExtend(r8d,16,24);
+		}
+		else
+			xor_(r8d,r8d);
+	}
+
+	//Reads : MEM_RD_DATA
+	//Writes : MEMS
+	void MEMS_WRITE(const _INST& op)
+	{
+		if (!op.IWT)
+			return;
+
+		movsx(eax,word[rbx+dsp_ofs(&dsp.regs.MEM_RD_DATA)]);
+		shl(eax,8);
+		mov(dsp_reg(&dsp.MEMS[op.IWA]),eax);
+	}
+
+	//Reads : MEM_RD_DATA_NV (r10d)
+	//Writes : MEM_RD_DATA
+	void MEM_RD_DATA_WRITE(const _INST& prev_op,u32 step)
+	{
+		if (!(step&1) && prev_op.MRD)
+			mov(dsp_reg(&dsp.regs.MEM_RD_DATA),r10d);
+	}
+
+	//Reads : INPUTS,TEMP,FRC_REG,COEF,Y_REG
+	//Writes : MAD_OUT_NV (r9d)
+	void MAD(const _INST& op,u32 step)
+	{
+		bool use_TEMP=op.XSEL==0 || (op.BSEL==0 && op.ZERO==0);
+
+		//TEMPS on ecx
+		if (use_TEMP)
+		{
+			mov(ecx,TempAddr(op.TRA));
+			SignExtend(ecx,24);
+		}
+
+		//X : 24 bits
+		movsxd(rdx,op.XSEL ? r8d : ecx);
+
+		//Y : 13 bits
+		if (op.YSEL==1)
+		{
+			//COEF[15:3], constant for the program
+			s32 coef=(s32)(DSPData->COEF[step]<<16)>>19;
+			imul(rax,rdx,coef);
+		}
+		else
+		{
+			if (op.YSEL==0)
+			{
+				//FRC_REG[12:0]
+				mov(eax,dsp_reg(&dsp.regs.FRC_REG));
+				SignExtend(eax,13);
+			}
+			else if (op.YSEL==2)
+			{
+				//Y_REG[23:11]
+				mov(eax,dsp_reg(&dsp.regs.Y_REG));
+				SignExtend(eax,19,13);
+			}
+			else
+			{
+				//0'Y_REG[15:4]
+				mov(eax,dsp_reg(&dsp.regs.Y_REG));
+				and_(eax,0xFFF);
+			}
+			movsxd(rax,eax);
+			imul(rax,rdx);
+		}
+		sar(rax,10);
+
+		//the adder wraps at 26 bits, so the product is only cut once, after it
+		if (!op.ZERO)
+		{
+			if (op.BSEL)
+				mov(edx,dsp_reg(&dsp.regs.MAD_OUT));
+			else
+				lea(edx,ptr[rcx*4]);
+
+			//(~B)+1 = -B, and the gate makes it 0 anyway
+			if (op.NEGB)
+				sub(eax,edx);
+			else
+				add(eax,edx);
+		}
+
+		SignExtend(eax,26);
+		mov(r9d,eax);
+	}
+
+	//Reads  : INPUTS,MAD_OUT
+	//Writes : EFREG,TEMP,FRC_REG,ADRS_REG,MEM_WT_DATA
+	void EFO_FB(const _INST& op)
+	{
+		mov(eax,dsp_reg(&dsp.regs.MAD_OUT));
+
+		switch(op.SHIFT)
+		{
+		case 0:
+			//x1 Protected
+			sar(eax,2);
+			mov(edx,-524288);
+			cmp(eax,edx);
+			cmovl(eax,edx);
+			neg(edx);
+			cmp(eax,edx);
+			cmovg(eax,edx);
+			break;
+
+		case 1:
+			//x2 Protected
+			sar(eax,1);
+			mov(edx,-524288);
+			cmp(eax,edx);
+			cmovl(eax,edx);
+			not_(edx);
+			cmp(eax,edx);
+			cmovg(eax,edx);
+			break;
+
+		case 2:
+			//x2 Not protected
+			sar(eax,1);
+			SignExtend(eax,24);
+			break;
+
+		case 3:
+			//x1 Not protected
+			sar(eax,1);
+			shl(eax,2);
+			SignExtend(eax,24);
+			break;
+		}
+
+		if (op.EWT)
+		{
+			mov(edx,eax);
+			sar(edx,4);
+			mov(word[rbp+data_ofs(&DSPData->EFREG[op.EWA])],dx);
+		}
+
+		if (op.TWT)
+			mov(TempAddr(op.TWA),eax);
+
+		if (op.FRCL)
+		{
+			mov(ecx,eax);
+			if (op.SHIFT==3)
+				sar(ecx,11);			//Shift[23:11]
+			else
+				and_(ecx,(1<<12)-1);	//0'Shift[11:0]
+			mov(dsp_reg(&dsp.regs.FRC_REG),ecx);
+		}
+
+		if (op.ADRL)
+		{
+			mov(ecx,eax);
+			if (op.SHIFT==3)
+			{
+				//Shift[23,23,23,23,23,22:16]
+				shl(ecx,8);
+				sar(ecx,24);
+			}
+			else
+			{
+				//0'Shift[23:12]
+				sar(ecx,12);
+				and_(ecx,(1<<12)-1);
+			}
+			mov(dsp_reg(&dsp.regs.ADRS_REG),ecx);
+		}
+
+		//no float packing, same as the x86 rec
+		sar(eax,8);
+		mov(dsp_reg(&dsp.regs.MEM_WT_DATA),eax);
+	}
+
+public:
+	DSPAssembler() : Xbyak::CodeGenerator(sizeof(dsp.DynCode),dsp.DynCode) { }
+
+	void Compile()
+	{
+		push(rbx);
+		push(rbp);
+		push(r12);
+
+		mov(rbx,(size_t)&dsp);
+		mov(rbp,(size_t)DSPData);
+		mov(r12,(size_t)aica_ram.data);
+
+		_INST op;
+		_INST prev_op;
+
+		for (int step=0;step<128;++step)
+		{
+			DecodeInst(DSPData->MPRO+step*4,&op);
+			DecodeInst(DSPData->MPRO+((step-1)&127)*4,&prev_op);
+
+			DRAM_CI(prev_op,step);
+			MEM_AGU(op,step);
+			INPUTS(op);
+			MEMS_WRITE(op);
+			MEM_RD_DATA_WRITE(prev_op,step);
+			MAD(op,step);
+			EFO_FB(op);
+
+			mov(dsp_reg(&dsp.regs.MAD_OUT),r9d);
+
+			if (op.YRL)
+			{
+				//INPUTS[23:4]
+				sar(r8d,4);
+				mov(dsp_reg(&dsp.regs.Y_REG),r8d);
+			}
+		}
+
+		//The delayed MRQ bits are never read back by the generated code, so they
+		//are only stored once, as the last two steps leave them
+		_INST last_op;
+		DecodeInst(DSPData->MPRO+126*4,&last_op);
+
+		mov(dsp_reg(&dsp.regs.NOFL_2),last_op.NOFL);
+		mov(dsp_reg(&dsp.regs.NOFL_1),op.NOFL);
+		mov(dsp_reg(&dsp.regs.MWT_1),op.MWT);
+		mov(dsp_reg(&dsp.regs.MRD_1),op.MRD);
+
+		pop(r12);
+		pop(rbp);
+		pop(rbx);
+		ret();
+
+		ready();
+	}
+};
+
+void dsp_recompile()
+{
+	dsp.dyndirty=false;
+
+	DSPAssembler assembler;
+	assembler.Compile();
+}
+#endif
+
 void dsp_print_mame();
 void dsp_step_mame();
 void dsp_emu_grandia();
@@ -779,7 +1144,8 @@ void dsp_writenmem(u32 addr)
 	//COEF : native
 	//MEMS : native
 	//MPRO : native
-	if (addr>=0x400 && addr<0xC00)
+	//COEF is baked into the x64 code
+	if ((addr>=0x400 && addr<0xC00) || (HOST_CPU == CPU_X64 && addr<0x200))
 	{
 		dsp.dyndirty=true;
 	}
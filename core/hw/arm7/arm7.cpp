@@ -17,10 +17,20 @@
 // along with this program; if not, write to the Free Software Foundation,
 // Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 
+#include "build.h"
+
+//the recompiler only has an x64 backend
+#if FEAT_AREC == DYNAREC_JIT && HOST_CPU == CPU_X64
+#define ARM7_REC
+//xbyak has to come before types.h, verify clashes with it
+#include "deps/xbyak/xbyak.h"
+#endif
+
 #include "arm7.h"
 #include "types.h"
 
 #include "hw/sh4/sh4_core.h"
+#include "serialize.h"
 
 #define update_armintc() arm_Reg[INTR_PEND].I=e68k_out && armFiqEnable
 
@@ -1414,12 +1424,26 @@ static void arm_WriteReg(u32 addr,T data)
    return libAICA_WriteReg(addr, data, sz);
 }
 
+#ifdef ARM7_REC
+//ARM_PAGE_SHIFT sized pages of aram that hold compiled code
+#define ARM_PAGE_SHIFT 10
+extern u8 arm_code_pages[ARAM_SIZE>>ARM_PAGE_SHIFT];
+static void armj_InvalidatePage(u32 addr);
+
+#define arm_CheckCodeWrite(addr) \
+	if (unlikely(arm_code_pages[((addr)&ARAM_MASK)>>ARM_PAGE_SHIFT])) \
+		armj_InvalidatePage(addr);
+#else
+#define arm_CheckCodeWrite(addr)
+#endif
+
 static INLINE void DYNACALL WriteMemArm1(u32 addr,u8 data)
 {
 	addr&=0x00FFFFFF;
 	if (addr<0x800000)
    {
 		*(u8*)&aica_ram.data[addr&(ARAM_MASK)]=data;
+		arm_CheckCodeWrite(addr);
       return;
    }
 
@@ -1432,6 +1456,7 @@ static INLINE void DYNACALL WriteMemArm2(u32 addr,u16 data)
 	if (addr<0x800000)
    {
 		*(u16*)&aica_ram.data[addr&(ARAM_MASK-(1))]=data;
+		arm_CheckCodeWrite(addr);
       return;
    }
 
@@ -1444,6 +1469,7 @@ static INLINE void DYNACALL WriteMemArm4(u32 addr,u32 data)
 	if (addr<0x800000)
    {
 		*(u32*)&aica_ram.data[addr&(ARAM_MASK-(3))]=data;
+		arm_CheckCodeWrite(addr);
       return;
    }
 
@@ -1707,7 +1733,8 @@ static void CPUUndefinedException(void)
 }
 
 
-void arm_Run_(u32 CycleCount)
+//Returns the cycles used, which can overshoot CycleCount by the last opcode
+u32 arm_Run_(u32 CycleCount)
 {
 	u32 clockTicks=0;
 
@@ -2792,7 +2819,7 @@ void arm_Run_(u32 CycleCount)
          reg[15].I -= 4;
          armNextPC -= 4;
          dbgSignal(5, (opcode & 0x0f)|((opcode>>4) & 0xfff0));
-         return;
+         return clockTicks;
 #endif
             case 0x320:
             case 0x321:
@@ -6785,12 +6812,17 @@ void arm_Run_(u32 CycleCount)
          }
       }
    }
+
+   return clockTicks;
 }
 
 void armt_init(void);
 
 void arm_Init(void)
 {
+#ifdef ARM7_REC
+	armt_init();
+#endif
 	arm_Reset();
 
 	for (int i = 0; i < 256; i++)
@@ -6833,6 +6865,11 @@ void arm_Reset(void)
 
 	armNextPC = reg[15].I;
 	reg[15].I += 4;
+
+#ifdef ARM7_REC
+	//the sh4 loads new drivers with the arm held in reset
+	FlushCache();
+#endif
 }
 
 /*
@@ -6891,13 +6928,61 @@ void arm_SetEnabled(bool enabled)
 	Arm7Enabled=enabled;
 }
 
+void arm_Serialize(ser_Stream& s)
+{
+	SER(s,arm_Reg);
+	SER(s,armIrqEnable);
+	SER(s,armFiqEnable);
+	SER(s,armMode);
+	SER(s,Arm7Enabled);
+	SER(s,intState);
+	SER(s,stopState);
+	SER(s,holdState);
+
+	SER(s,aica_interr);
+	SER(s,aica_reg_L);
+	SER(s,e68k_out);
+	SER(s,e68k_reg_L);
+	SER(s,e68k_reg_M);
+
+#ifdef ARM7_REC
+	//aram was replaced behind the code page checks
+	if (s.load())
+		FlushCache();
+#endif
+}
+
 void libAICA_TimeStep();
 
+#ifdef ARM7_REC
+static void armj_Run(u32 CycleCount);
+//blocks compiled before the interpreter took over may be stale
+static bool armj_active;
+#endif
+
 void arm_Run(u32 CycleCount)
 {
    unsigned i;
    if (Arm7Enabled)
    {
+#ifdef ARM7_REC
+      //only arm writes invalidate blocks, sh4 and dma writes to aram don't,
+      //so the recompiler is opt in
+      if (settings.aica.ArmRec)
+      {
+         if (!armj_active)
+            FlushCache();
+         armj_active=true;
+
+         for (i=0;i<32;i++)
+         {
+            armj_Run(CycleCount/32);
+            libAICA_TimeStep();
+         }
+         return;
+      }
+      armj_active=false;
+#endif
       for (i=0;i<32;i++)
       {
          arm_Run_(CycleCount/32);
@@ -6952,4 +7037,849 @@ template void arm_WriteReg<1>(u32 adr,u8 data);
 template void arm_WriteReg<2>(u32 adr,u16 data);
 template void arm_WriteReg<4>(u32 adr,u32 data);
 
-void* EntryPoints[ARAM_SIZE/4];
+#ifdef ARM7_REC
+/*
+	ARM7 recompiler, x64 backend
+
+	Blocks run from a pc up to the first branch, the first write to pc or
+	ARM_BLOCK_OPS opcodes. Guest regs stay in arm_Reg, host regs only hold
+	temporaries for the duration of an opcode.
+	rbx: arm_Reg, rbp: arm_code_pages, r12: aica ram, r13: ldm/stm address
+
+	Data processing with immediate shifts, mul/mla, ldr/str(b), ldm/stm and
+	b/bl are compiled. Anything else (psr transfers, register shifts, swi,
+	writes to pc ...) runs on the interpreter through arm_Run_(1) and ends
+	the block. Cycles are charged as the interpreter does, mul at a fixed cost.
+
+	Like the sh4 block manager, blocks are listed per aram page. An arm write
+	to a page holding code (WriteMemArm*) drops its blocks, and the running
+	block returns after the opcode. The code buffer is cleared when full and
+	on arm_Reset.
+*/
+
+#define ARM_CODE_SIZE (1024*1024)
+#define ARM_CODE_RESERVE (64*1024)
+#define ARM_BLOCK_OPS 32
+#define ARM_PAGE_COUNT (ARAM_SIZE>>ARM_PAGE_SHIFT)
+
+typedef u32 (*ArmDynCode)();
+
+DECL_ALIGN(4096) static u8 ARM7_TCB[ARM_CODE_SIZE];
+static u32 arm_code_used;
+
+static ArmDynCode EntryPoints[ARAM_SIZE/4];
+static vector<u32> arm_page_blocks[ARM_PAGE_COUNT];
+u8 arm_code_pages[ARM_PAGE_COUNT];
+
+//set when the running block has to return to the dispatcher after the current opcode
+static u8 armj_exit;
+
+static void FlushCache(void)
+{
+	memset(EntryPoints,0,sizeof(EntryPoints));
+	memset(arm_code_pages,0,sizeof(arm_code_pages));
+
+	for (u32 i=0;i<ARM_PAGE_COUNT;i++)
+		arm_page_blocks[i].clear();
+
+	arm_code_used=0;
+}
+
+static void armj_InvalidatePage(u32 addr)
+{
+	u32 page=(addr&ARAM_MASK)>>ARM_PAGE_SHIFT;
+	vector<u32>& blocks=arm_page_blocks[page];
+
+	//blocks are keyed by their start pc, which can be on an earlier page
+	for (size_t i=0;i<blocks.size();i++)
+		EntryPoints[blocks[i]>>2]=0;
+
+	blocks.clear();
+	arm_code_pages[page]=0;
+	armj_exit=1;
+}
+
+enum ArmOpKind
+{
+	AK_INTERP,
+	AK_DATA,
+	AK_MUL,
+	AK_MEM,
+	AK_BLOCK,
+	AK_BRANCH,
+};
+
+static ArmOpKind armj_Decode(u32 opcode)
+{
+	u32 rn=(opcode>>16)&15;
+	u32 rd=(opcode>>12)&15;
+
+	if ((opcode>>28)==0xF)
+		return AK_INTERP;
+
+	switch((opcode>>25)&7)
+	{
+	case 0:
+		//MUL/MLA
+		if ((opcode&0x0FC000F0)==0x00000090)
+		{
+			if (rn==15 || (opcode&15)==15 || ((opcode>>8)&15)==15 || ((opcode&(1<<21)) && rd==15))
+				return AK_INTERP;
+			return AK_MUL;
+		}
+		//register shifts, halfword transfers, SWP
+		if (opcode&0x10)
+			return AK_INTERP;
+		//fall through
+	case 1:
+		//MRS/MSR
+		if (((opcode>>21)&15)>=8 && ((opcode>>21)&15)<=11 && !(opcode&(1<<20)))
+			return AK_INTERP;
+		if (rd==15)
+			return AK_INTERP;
+		return AK_DATA;
+
+	case 3:
+		//undefined
+		if (opcode&0x10)
+			return AK_INTERP;
+		//fall through
+	case 2:
+		{
+			bool writeback=!(opcode&(1<<24)) || (opcode&(1<<21));
+			if (rd==15 || (writeback && (rn==15 || rn==rd)))
+				return AK_INTERP;
+			return AK_MEM;
+		}
+
+	case 4:
+		{
+			u32 list=opcode&0xFFFF;
+			if ((opcode&(1<<22)) || rn==15 || !list || (list&(1<<rn)))
+				return AK_INTERP;
+			if (!(opcode&(1<<20)) && (list&0x8000))
+				return AK_INTERP;
+			return AK_BLOCK;
+		}
+
+	case 5:
+		return AK_BRANCH;
+
+	default:
+		return AK_INTERP;
+	}
+}
+
+//same costs as arm_Run_, a failed condition costs 6
+static u32 armj_Cycles(u32 opcode,ArmOpKind kind)
+{
+	switch(kind)
+	{
+	case AK_MUL:
+		return 6+3+((opcode>>21)&1);
+	case AK_MEM:
+		return (opcode&(1<<20)) ? 6+4 : 6+3;
+	case AK_BLOCK:
+		return 6+2+2*(cpuBitsSet[opcode&255]+cpuBitsSet[(opcode>>8)&255])+((opcode>>15)&1);
+	case AK_BRANCH:
+		return 6+3;
+	default:
+		return 6;
+	}
+}
+
+//where the shifter carry out is
+enum
+{
+	C_KEEP,
+	C_REG,	//r10b
+	C_ZERO,
+	C_ONE,
+};
+
+class ArmBlockCompiler : public Xbyak::CodeGenerator
+{
+	u32 cycles;
+
+	Xbyak::Address ArmReg(u32 index) { return dword[rbx+index*sizeof(reg_pair)]; }
+
+	void LoadReg(const Xbyak::Reg32& dst,u32 index,u32 pc)
+	{
+		if (index==15)
+			mov(dst,pc+8);
+		else
+			mov(dst,ArmReg(index));
+	}
+
+	//cycles not taken by skipped conditional opcodes, negative
+	Xbyak::Address SkippedCycles() { return dword[rsp+32]; }
+
+	void Prologue()
+	{
+		push(rbx);
+		push(rbp);
+		push(r12);
+		push(r13);
+		//shadow space and SkippedCycles, keeps rsp aligned for the calls
+		sub(rsp,40);
+		mov(SkippedCycles(),0);
+
+		mov(rbx,(size_t)arm_Reg);
+		mov(rbp,(size_t)arm_code_pages);
+		mov(r12,(size_t)aica_ram.data);
+	}
+
+	void Epilogue()
+	{
+		add(rsp,40);
+		pop(r13);
+		pop(r12);
+		pop(rbp);
+		pop(rbx);
+		ret();
+	}
+
+	//returns the cycles used, armNextPC must be set
+	void Exit(u32 cycles)
+	{
+		mov(eax,cycles);
+		add(eax,SkippedCycles());
+		Epilogue();
+	}
+
+	void ExitTo(u32 pc,u32 cycles)
+	{
+		mov(ArmReg(R15_ARM_NEXT),pc);
+		Exit(cycles);
+	}
+
+	//jumps to skip if the condition fails
+	void CondCheck(u32 cond,Xbyak::Label& skip)
+	{
+		mov(eax,ArmReg(RN_PSR_FLAGS));
+
+		switch(cond)
+		{
+		case 0x0: bt(eax,30); jnc(skip,T_NEAR); break;	//EQ
+		case 0x1: bt(eax,30); jc(skip,T_NEAR); break;	//NE
+		case 0x2: bt(eax,29); jnc(skip,T_NEAR); break;	//CS
+		case 0x3: bt(eax,29); jc(skip,T_NEAR); break;	//CC
+		case 0x4: bt(eax,31); jnc(skip,T_NEAR); break;	//MI
+		case 0x5: bt(eax,31); jc(skip,T_NEAR); break;	//PL
+		case 0x6: bt(eax,28); jnc(skip,T_NEAR); break;	//VS
+		case 0x7: bt(eax,28); jc(skip,T_NEAR); break;	//VC
+
+		case 0x8:	//HI, C && !Z
+		case 0x9:	//LS
+			and_(eax,0x60000000);
+			cmp(eax,0x20000000);
+			if (cond==0x8)
+				jne(skip,T_NEAR);
+			else
+				je(skip,T_NEAR);
+			break;
+
+		case 0xA:	//GE, N == V
+		case 0xB:	//LT
+			mov(ecx,eax);
+			shr(ecx,3);
+			xor_(eax,ecx);
+			bt(eax,28);
+			if (cond==0xA)
+				jc(skip,T_NEAR);
+			else
+				jnc(skip,T_NEAR);
+			break;
+
+		case 0xC:	//GT, !Z && N == V
+		case 0xD:	//LE
+			mov(ecx,eax);
+			shr(ecx,3);
+			xor_(ecx,eax);
+			and_(ecx,0x10000000);
+			and_(eax,0x40000000);
+			or_(eax,ecx);
+			if (cond==0xC)
+				jnz(skip,T_NEAR);
+			else
+				jz(skip,T_NEAR);
+			break;
+		}
+	}
+
+	//merges r8d into the flags, for the bits in mask
+	void SetFlags(u32 mask)
+	{
+		mov(r9d,ArmReg(RN_PSR_FLAGS));
+		and_(r9d,~mask);
+		or_(r9d,r8d);
+		mov(ArmReg(RN_PSR_FLAGS),r9d);
+	}
+
+	//NZCV from the host flags of an add/sub, ARM's C is !borrow for subtractions
+	void FlagsArith(bool sub)
+	{
+		sets(r8b);
+		setz(r9b);
+		if (sub)
+			setnc(r10b);
+		else
+			setc(r10b);
+		seto(r11b);
+
+		movzx(r8d,r8b);
+		movzx(r9d,r9b);
+		movzx(r10d,r10b);
+		movzx(r11d,r11b);
+		lea(r8d,ptr[r9+r8*2]);
+		lea(r8d,ptr[r10+r8*2]);
+		lea(r8d,ptr[r11+r8*2]);
+		shl(r8d,28);
+
+		SetFlags(0xF0000000);
+	}
+
+	//NZ from eax, C from the shifter, V is kept
+	void FlagsLogical(int carry)
+	{
+		u32 mask=0xC0000000;
+
+		test(eax,eax);
+		sets(r8b);
+		setz(r9b);
+		movzx(r8d,r8b);
+		movzx(r9d,r9b);
+		lea(r8d,ptr[r9+r8*2]);
+		shl(r8d,30);
+
+		if (carry==C_REG)
+		{
+			movzx(r10d,r10b);
+			shl(r10d,29);
+			or_(r8d,r10d);
+		}
+		else if (carry==C_ONE)
+			or_(r8d,0x20000000);
+
+		if (carry!=C_KEEP)
+			mask|=0x20000000;
+
+		SetFlags(mask);
+	}
+
+	//Rm shifted by an immediate, on eax. Also the register offset of LDR/STR.
+	int ShiftImm(u32 opcode,u32 pc,bool carry)
+	{
+		u32 shift=(opcode>>7)&31;
+
+		LoadReg(eax,opcode&15,pc);
+
+		switch((opcode>>5)&3)
+		{
+		case 0:	//LSL
+			if (!shift)
+				return C_KEEP;
+			shl(eax,shift);
+			break;
+
+		case 1:	//LSR, #0 is #32
+			if (shift)
+				shr(eax,shift);
+			else
+			{
+				bt(eax,31);
+				if (carry)
+					setc(r10b);
+				xor_(eax,eax);
+				return carry ? C_REG : C_KEEP;
+			}
+			break;
+
+		case 2:	//ASR, #0 is #32
+			if (shift)
+				sar(eax,shift);
+			else
+			{
+				sar(eax,31);
+				bt(eax,0);
+			}
+			break;
+
+		case 3:	//ROR, #0 is RRX
+			if (shift)
+				ror(eax,shift);
+			else
+			{
+				bt(ArmReg(RN_PSR_FLAGS),29);
+				rcr(eax,1);
+			}
+			break;
+		}
+
+		if (!carry)
+			return C_KEEP;
+
+		setc(r10b);
+		return C_REG;
+	}
+
+	int Operand2(u32 opcode,u32 pc,bool carry)
+	{
+		if (!(opcode&(1<<25)))
+			return ShiftImm(opcode,pc,carry);
+
+		u32 imm=opcode&0xFF;
+		u32 rot=((opcode>>8)&15)*2;
+		u32 value=rot ? (imm>>rot) | (imm<<(32-rot)) : imm;
+
+		mov(eax,value);
+
+		if (!rot)
+			return C_KEEP;
+		return (value>>31) ? C_ONE : C_ZERO;
+	}
+
+	void DataProcessing(u32 opcode,u32 pc)
+	{
+		u32 op=(opcode>>21)&15;
+		bool S=(opcode>>20)&1;
+		bool logical=op<2 || op==8 || op==9 || op>=12;
+		bool result_ecx=op==0x2 || op==0x6 || op==0xA;
+
+		int carry=Operand2(opcode,pc,S && logical);
+
+		if (op!=0xD && op!=0xF)
+			LoadReg(ecx,(opcode>>16)&15,pc);
+
+		switch(op)
+		{
+		case 0x0: case 0x8: and_(eax,ecx); break;	//AND, TST
+		case 0x1: case 0x9: xor_(eax,ecx); break;	//EOR, TEQ
+		case 0xC: or_(eax,ecx); break;				//ORR
+		case 0xD: break;							//MOV
+		case 0xE: not_(eax); and_(eax,ecx); break;	//BIC
+		case 0xF: not_(eax); break;					//MVN
+
+		case 0x2: case 0xA: sub(ecx,eax); break;	//SUB, CMP
+		case 0x3: sub(eax,ecx); break;				//RSB
+		case 0x4: case 0xB: add(eax,ecx); break;	//ADD, CMN
+
+		case 0x5:	//ADC
+			bt(ArmReg(RN_PSR_FLAGS),29);
+			adc(eax,ecx);
+			break;
+
+		case 0x6:	//SBC, borrow is !C
+			bt(ArmReg(RN_PSR_FLAGS),29);
+			cmc();
+			sbb(ecx,eax);
+			break;
+
+		case 0x7:	//RSC
+			bt(ArmReg(RN_PSR_FLAGS),29);
+			cmc();
+			sbb(eax,ecx);
+			break;
+		}
+
+		if (S && !logical)
+			FlagsArith(op!=0x4 && op!=0x5 && op!=0xB);
+
+		if (result_ecx)
+			mov(eax,ecx);
+
+		if (S && logical)
+			FlagsLogical(carry);
+
+		//TST, TEQ, CMP and CMN only set the flags
+		if (op<8 || op>11)
+			mov(ArmReg((opcode>>12)&15),eax);
+	}
+
+	void Multiply(u32 opcode)
+	{
+		mov(eax,ArmReg(opcode&15));
+		imul(eax,ArmReg((opcode>>8)&15));
+
+		//MLA
+		if (opcode&(1<<21))
+			add(eax,ArmReg((opcode>>12)&15));
+
+		mov(ArmReg((opcode>>16)&15),eax);
+
+		//C and V are kept
+		if (opcode&(1<<20))
+			FlagsLogical(C_KEEP);
+	}
+
+	//eax = [ecx], ram is read directly, the rest goes through ReadMemArm*
+	void Read(bool is_byte)
+	{
+		Xbyak::Label slow,done;
+
+		mov(eax,ecx);
+		and_(eax,0x00FFFFFF);
+		cmp(eax,0x800000);
+		jae(slow,T_NEAR);
+
+		if (is_byte)
+		{
+			and_(eax,ARAM_MASK);
+			movzx(eax,byte[r12+rax]);
+		}
+		else
+		{
+			//misaligned reads rotate
+			and_(eax,ARAM_MASK-3);
+			mov(eax,dword[r12+rax]);
+			and_(ecx,3);
+			shl(ecx,3);
+			ror(eax,cl);
+		}
+		jmp(done,T_NEAR);
+
+		L(slow);
+#ifndef _WIN32
+		mov(edi,ecx);
+#endif
+		if (is_byte)
+		{
+			call((void*)ReadMemArm1);
+			movzx(eax,al);
+		}
+		else
+			call((void*)ReadMemArm4);
+
+		L(done);
+	}
+
+	//[ecx] = edx, ram pages without code are written directly
+	void Write(bool is_byte)
+	{
+		Xbyak::Label slow,done;
+
+		mov(eax,ecx);
+		and_(eax,0x00FFFFFF);
+		cmp(eax,0x800000);
+		jae(slow,T_NEAR);
+
+		mov(r8d,eax);
+		and_(r8d,ARAM_MASK);
+		shr(r8d,ARM_PAGE_SHIFT);
+		cmp(byte[rbp+r8],0);
+		jne(slow,T_NEAR);
+
+		if (is_byte)
+		{
+			and_(eax,ARAM_MASK);
+			mov(byte[r12+rax],dl);
+		}
+		else
+		{
+			and_(eax,ARAM_MASK-3);
+			mov(dword[r12+rax],edx);
+		}
+		jmp(done,T_NEAR);
+
+		L(slow);
+#ifndef _WIN32
+		mov(edi,ecx);
+		mov(esi,edx);
+#endif
+		call(is_byte ? (void*)WriteMemArm1 : (void*)WriteMemArm4);
+
+		L(done);
+	}
+
+	//after a write, leave if it hit code or raised the fiq
+	void CheckExit(u32 exit_pc)
+	{
+		Xbyak::Label resume;
+
+		mov(rax,(size_t)&armj_exit);
+		movzx(eax,byte[rax]);
+		or_(eax,ArmReg(INTR_PEND));
+		jz(resume,T_NEAR);
+		ExitTo(exit_pc,cycles);
+		L(resume);
+	}
+
+	//LDR/STR/LDRB/STRB. Writeback is done first, Rn != Rd when there is one.
+	void SingleTransfer(u32 opcode,u32 pc)
+	{
+		u32 rn=(opcode>>16)&15;
+		u32 rd=(opcode>>12)&15;
+		bool is_byte=(opcode>>22)&1;
+
+		if (opcode&(1<<25))
+			ShiftImm(opcode,pc,false);
+		else
+			mov(eax,opcode&0xFFF);
+
+		LoadReg(ecx,rn,pc);
+		mov(r8d,ecx);
+		if (opcode&(1<<23))
+			add(r8d,eax);
+		else
+			sub(r8d,eax);
+
+		if (opcode&(1<<24))
+		{
+			//pre indexed
+			mov(ecx,r8d);
+			if (opcode&(1<<21))
+				mov(ArmReg(rn),ecx);
+		}
+		else
+			mov(ArmReg(rn),r8d);
+
+		if (opcode&(1<<20))
+		{
+			Read(is_byte);
+			mov(ArmReg(rd),eax);
+		}
+		else
+		{
+			LoadReg(edx,rd,pc);
+			Write(is_byte);
+			CheckExit(pc+4);
+		}
+	}
+
+	//LDM/STM without the S bit, Rn isn't in the list
+	void BlockTransfer(u32 opcode,u32 pc)
+	{
+		u32 rn=(opcode>>16)&15;
+		u32 list=opcode&0xFFFF;
+		u32 size=4*(cpuBitsSet[list&255]+cpuBitsSet[list>>8]);
+		bool up=(opcode>>23)&1;
+		bool pre=(opcode>>24)&1;
+
+		mov(r13d,ArmReg(rn));
+
+		if (opcode&(1<<21))
+		{
+			mov(eax,r13d);
+			if (up)
+				add(eax,size);
+			else
+				sub(eax,size);
+			mov(ArmReg(rn),eax);
+		}
+
+		//lowest address, the transfers always go up
+		if (up)
+		{
+			if (pre)
+				add(r13d,4);
+		}
+		else
+		{
+			sub(r13d,size);
+			if (!pre)
+				add(r13d,4);
+		}
+		and_(r13d,~3);
+
+		for (u32 i=0;i<16;i++)
+		{
+			if (!(list&(1<<i)))
+				continue;
+
+			mov(ecx,r13d);
+			if (opcode&(1<<20))
+			{
+				Read(false);
+				mov(ArmReg(i==15 ? (u32)R15_ARM_NEXT : i),eax);
+			}
+			else
+			{
+				mov(edx,ArmReg(i));
+				Write(false);
+			}
+			add(r13d,4);
+		}
+
+		if (!(opcode&(1<<20)))
+			CheckExit(pc+4);
+	}
+
+	//runs the opcode on the interpreter and leaves
+	void Interpret(u32 pc)
+	{
+		mov(ArmReg(R15_ARM_NEXT),pc);
+#ifdef _WIN32
+		mov(ecx,1);
+#else
+		mov(edi,1);
+#endif
+		call((void*)arm_Run_);
+		add(eax,cycles);
+		add(eax,SkippedCycles());
+		Epilogue();
+	}
+
+public:
+	ArmBlockCompiler(u8* code) : Xbyak::CodeGenerator(ARM_CODE_RESERVE,code) { }
+
+	//returns the pc after the last opcode of the block
+	u32 Compile(u32 pc)
+	{
+		Prologue();
+		cycles=0;
+
+		for (u32 i=0;;i++)
+		{
+			u32 opcode=*(u32*)&aica_ram.data[pc];
+			u32 cond=opcode>>28;
+			ArmOpKind kind=armj_Decode(opcode);
+
+			if (kind==AK_INTERP)
+			{
+				Interpret(pc);
+				return pc+4;
+			}
+
+			u32 skipped_cycles=cycles+6;
+			u32 op_cycles=armj_Cycles(opcode,kind);
+			cycles+=op_cycles;
+
+			Xbyak::Label skip;
+			if (cond!=0xE)
+				CondCheck(cond,skip);
+
+			bool end=false;
+
+			switch(kind)
+			{
+			case AK_DATA:
+				DataProcessing(opcode,pc);
+				break;
+
+			case AK_MUL:
+				Multiply(opcode);
+				break;
+
+			case AK_MEM:
+				SingleTransfer(opcode,pc);
+				break;
+
+			case AK_BLOCK:
+				BlockTransfer(opcode,pc);
+				//LDM with pc
+				if (opcode&0x8000)
+				{
+					Exit(cycles);
+					end=true;
+				}
+				break;
+
+			case AK_BRANCH:
+				{
+					s32 offset=((s32)(opcode<<8))>>6;
+
+					//BL
+					if (opcode&(1<<24))
+						mov(ArmReg(14),pc+4);
+
+					ExitTo(pc+8+offset,cycles);
+					end=true;
+				}
+				break;
+
+			default:
+				die("armj: bad opcode kind");
+			}
+
+			pc+=4;
+
+			if (end)
+			{
+				if (cond!=0xE)
+				{
+					L(skip);
+					ExitTo(pc,skipped_cycles);
+				}
+				return pc;
+			}
+
+			if (cond!=0xE)
+			{
+				if (op_cycles!=6)
+				{
+					Xbyak::Label done;
+					jmp(done);
+					L(skip);
+					sub(SkippedCycles(),op_cycles-6);
+					L(done);
+				}
+				else
+					L(skip);
+			}
+
+			if (i+1==ARM_BLOCK_OPS || pc>=ARAM_SIZE)
+			{
+				ExitTo(pc,cycles);
+				return pc;
+			}
+		}
+	}
+};
+
+static ArmDynCode armj_Compile(u32 pc)
+{
+	if (ARM_CODE_SIZE-arm_code_used<ARM_CODE_RESERVE)
+		FlushCache();
+
+	ArmBlockCompiler compiler(&ARM7_TCB[arm_code_used]);
+	u32 end=compiler.Compile(pc);
+	compiler.ready();
+
+	ArmDynCode code=(ArmDynCode)compiler.getCode();
+	arm_code_used+=(compiler.getSize()+15)&~15;
+
+	for (u32 page=pc>>ARM_PAGE_SHIFT;page<=((end-1)>>ARM_PAGE_SHIFT);page++)
+	{
+		arm_page_blocks[page].push_back(pc);
+		arm_code_pages[page]=1;
+	}
+
+	EntryPoints[pc>>2]=code;
+
+	return code;
+}
+
+static void armj_Run(u32 CycleCount)
+{
+	u32 clockTicks=0;
+
+	while (clockTicks<CycleCount)
+	{
+		if (reg[INTR_PEND].I)
+			CPUFiq();
+
+		u32 pc=armNextPC;
+
+		//code past the first aram mirror, or misaligned, is left to the interpreter
+		if (pc>=ARAM_SIZE || (pc&3))
+		{
+			clockTicks+=arm_Run_(1);
+			continue;
+		}
+
+		ArmDynCode code=EntryPoints[pc>>2];
+
+		if (!code)
+			code=armj_Compile(pc);
+
+		armj_exit=0;
+		clockTicks+=code();
+	}
+}
+
+void armt_init(void)
+{
+	os_MakeExecutable(ARM7_TCB,sizeof(ARM7_TCB));
+	FlushCache();
+}
+#endif
@@ -14,6 +14,11 @@
 
 #include "hw/sh4/sh4_mmr.h"
 #include "hw/sh4/sh4_sched.h"
+#include "serialize.h"
+
+#ifndef TARGET_NO_THREADS
+#include <rthreads/rthreads.h>
+#endif
 
 int gdrom_sched;
 
@@ -102,7 +107,7 @@ static struct
 {
 	u32 cache_index;
 	u32 cache_size;
-	u8 cache[8192 * 2352];	//up to 32 sectors
+	u8 cache[8192 * 2352];	//up to READ_CHUNK sectors
 } read_buff;
 
 //pio buffer
@@ -214,23 +219,204 @@ void gd_spi_pio_end(u8* buffer,u32 len,gd_states next_state=gds_pio_end);
 void gd_process_spi_cmd();
 void gd_process_ata_cmd();
 
+//dma reads are served in chunks of up to 128 sectors, each one a single ranged disc read
+#define READ_CHUNK 128
+
+#ifndef TARGET_NO_THREADS
+/*
+	While a dma read is streaming, a worker reads the next chunks ahead into a
+	small ring. FillReadBuffer takes the head chunk if it starts where the
+	read is, waiting for it if it is still being read. Anything else (a seek,
+	a new command) is read synchronously and restarts the stream after it.
+
+	The chunks are smaller than READ_CHUNK, so a wait for the one in flight
+	stays short and the ring stays small.
+*/
+#define PREFETCH_SLOTS 4
+#define PREFETCH_CHUNK 32
+
+struct prefetch_slot
+{
+	u32 start_sector;
+	u32 count;
+	u32 sector_type;
+	u8 data[PREFETCH_CHUNK*2352];
+};
+
+static struct
+{
+	slock_t* lock;
+	scond_t* wake;		//worker: the stream changed or a slot was freed
+	scond_t* done;		//emu: a read finished
+	sthread_t* thread;
+	bool quit;
+
+	//bumped whenever the stream restarts, reads from an older one are dropped
+	u32 generation;
+
+	//next chunk the worker reads
+	u32 start_sector;
+	u32 remaining_sectors;
+	u32 sector_type;
+
+	bool reading;
+	u32 reading_generation;
+
+	prefetch_slot slots[PREFETCH_SLOTS];
+	u32 head;
+	u32 filled;
+} prefetch;
+
+static void gd_prefetch_thread(void*)
+{
+	slock_lock(prefetch.lock);
+
+	for (;;)
+	{
+		while (!prefetch.quit && (prefetch.remaining_sectors==0 || prefetch.filled==PREFETCH_SLOTS))
+			scond_wait(prefetch.wake,prefetch.lock);
+
+		if (prefetch.quit)
+			break;
+
+		prefetch_slot* slot=&prefetch.slots[(prefetch.head+prefetch.filled)%PREFETCH_SLOTS];
+		slot->start_sector=prefetch.start_sector;
+		slot->count=min(prefetch.remaining_sectors,(u32)PREFETCH_CHUNK);
+		slot->sector_type=prefetch.sector_type;
+
+		prefetch.start_sector+=slot->count;
+		prefetch.remaining_sectors-=slot->count;
+		prefetch.reading=true;
+		prefetch.reading_generation=prefetch.generation;
+		slock_unlock(prefetch.lock);
+
+		libGDR_ReadSector(slot->data,slot->start_sector,slot->count,slot->sector_type);
+
+		slock_lock(prefetch.lock);
+		prefetch.reading=false;
+		if (prefetch.reading_generation==prefetch.generation)
+			prefetch.filled++;
+		scond_signal(prefetch.done);
+	}
+
+	slock_unlock(prefetch.lock);
+}
+
+//drop everything read ahead and continue the stream at start_sector
+static void gd_prefetch_restart(u32 start_sector,u32 remaining_sectors,u32 sector_type)
+{
+	if (!prefetch.thread)
+		return;
+
+	slock_lock(prefetch.lock);
+	prefetch.generation++;
+	prefetch.head=0;
+	prefetch.filled=0;
+	prefetch.start_sector=start_sector;
+	prefetch.remaining_sectors=remaining_sectors;
+	prefetch.sector_type=sector_type;
+	scond_signal(prefetch.wake);
+	slock_unlock(prefetch.lock);
+}
+
+//returns the sectors taken, 0 if the head chunk isn't the next one
+static u32 gd_prefetch_take(u8* dst)
+{
+	if (!prefetch.thread)
+		return 0;
+
+	u32 rv=0;
+
+	slock_lock(prefetch.lock);
+
+	for (;;)
+	{
+		if (!prefetch.filled && (!prefetch.reading || prefetch.reading_generation!=prefetch.generation))
+			break;
+
+		//the head slot is either ready or being read
+		prefetch_slot* slot=&prefetch.slots[prefetch.head];
+
+		if (slot->start_sector!=read_params.start_sector || slot->count>read_params.remaining_sectors || slot->sector_type!=read_params.sector_type)
+			break;
+
+		if (prefetch.filled)
+		{
+			memcpy(dst,slot->data,slot->count*slot->sector_type);
+			prefetch.head=(prefetch.head+1)%PREFETCH_SLOTS;
+			prefetch.filled--;
+			scond_signal(prefetch.wake);
+			rv=slot->count;
+			break;
+		}
+
+		//the chunk is in flight
+		scond_wait(prefetch.done,prefetch.lock);
+	}
+
+	slock_unlock(prefetch.lock);
+
+	return rv;
+}
+
+static void gd_prefetch_init(void)
+{
+	if (prefetch.thread)
+		return;
+
+	prefetch.lock=slock_new();
+	prefetch.wake=scond_new();
+	prefetch.done=scond_new();
+	prefetch.quit=false;
+	prefetch.remaining_sectors=0;
+	prefetch.thread=sthread_create(gd_prefetch_thread,0);
+}
+
+static void gd_prefetch_term(void)
+{
+	if (!prefetch.thread)
+		return;
+
+	slock_lock(prefetch.lock);
+	prefetch.quit=true;
+	scond_signal(prefetch.wake);
+	slock_unlock(prefetch.lock);
+
+	sthread_join(prefetch.thread);
+	prefetch.thread=0;
+
+	scond_free(prefetch.done);
+	scond_free(prefetch.wake);
+	slock_free(prefetch.lock);
+}
+#endif
+
 static void FillReadBuffer(void)
 {
 	read_buff.cache_index=0;
-	u32 count = read_params.remaining_sectors;
-	u32 hint=0;
 
-	if (count > 32)
+#ifndef TARGET_NO_THREADS
+	//read ahead chunks are served one at a time
+	if (u32 taken=gd_prefetch_take(read_buff.cache))
 	{
-		hint = max(count - 32, (u32)32);
-		count = 32;
+		read_buff.cache_size=taken*read_params.sector_type;
+		read_params.start_sector+=taken;
+		read_params.remaining_sectors-=taken;
+		return;
 	}
+#endif
+
+	u32 count=min(read_params.remaining_sectors,(u32)READ_CHUNK);
 
 	read_buff.cache_size=count*read_params.sector_type;
 
 	libGDR_ReadSector(read_buff.cache,read_params.start_sector,count,read_params.sector_type);
 	read_params.start_sector+=count;
 	read_params.remaining_sectors-=count;
+
+#ifndef TARGET_NO_THREADS
+	gd_prefetch_restart(read_params.start_sector,read_params.remaining_sectors,read_params.sector_type);
+#endif
 }
 
 void gd_set_state(gd_states state)
@@ -366,6 +552,10 @@ void gd_set_state(gd_states state)
 
 void gd_setdisc()
 {
+#ifndef TARGET_NO_THREADS
+	//whatever was read ahead came from the old disc
+	gd_prefetch_restart(0,0,0);
+#endif
 	DiscType newd = (DiscType)libGDR_GetDiscType();
 	
 	switch(newd)
@@ -1205,11 +1395,17 @@ void gdrom_reg_Init()
 	*/
 
 	gdrom_sched = sh4_sched_register(0, &GDRomschd);
+
+#ifndef TARGET_NO_THREADS
+	gd_prefetch_init();
+#endif
 }
 
 void gdrom_reg_Term(void)
 {
-	
+#ifndef TARGET_NO_THREADS
+	gd_prefetch_term();
+#endif
 }
 
 void gdrom_reg_Reset(bool Manual)
@@ -1217,3 +1413,56 @@ void gdrom_reg_Reset(bool Manual)
 	SB_GDST = 0;
 	SB_GDEN = 0;
 }
+
+void gdrom_Serialize(ser_Stream& s)
+{
+	SER(s,sns_asc);
+	SER(s,sns_ascq);
+	SER(s,sns_key);
+
+	SER(s,read_params);
+	SER(s,packet_cmd);
+
+	//only the part of the buffers that is still to be transferred
+	SER(s,read_buff.cache_index);
+	SER(s,read_buff.cache_size);
+	if (read_buff.cache_size>sizeof(read_buff.cache) || read_buff.cache_index>read_buff.cache_size)
+	{
+		read_buff.cache_index=read_buff.cache_size=0;
+		s.failed=true;
+		return;
+	}
+	ser_Data(s,&read_buff.cache[read_buff.cache_index],read_buff.cache_size-read_buff.cache_index);
+
+	SER(s,pio_buff.next_state);
+	SER(s,pio_buff.index);
+	SER(s,pio_buff.size);
+	if (pio_buff.index>pio_buff.size || pio_buff.size>sizeof(pio_buff.data)/2)
+	{
+		pio_buff.index=pio_buff.size=0;
+		s.failed=true;
+		return;
+	}
+	ser_Data(s,pio_buff.data,pio_buff.size*2);
+
+	SER(s,set_mode_offset);
+	SER(s,ata_cmd);
+	SER(s,cdda);
+	SER(s,gd_state);
+	SER(s,gd_disk_type);
+	SER(s,data_write_mode);
+
+	SER(s,DriveSel);
+	SER(s,Error);
+	SER(s,IntReason);
+	SER(s,Features);
+	SER(s,SecCount);
+	SER(s,SecNumber);
+	SER(s,GDStatus);
+	SER(s,ByteCount);
+
+#ifndef TARGET_NO_THREADS
+	if (s.load())
+		gd_prefetch_restart(read_params.start_sector,read_params.remaining_sectors,read_params.sector_type);
+#endif
+}
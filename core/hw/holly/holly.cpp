@@ -11,6 +11,7 @@
 #include "hw/flashrom/flashrom.h"
 #include "reios/reios.h"
 #include "hw/naomi/naomi.h"
+#include "serialize.h"
 
 /*
 	ASIC Interrupt controller
@@ -1366,3 +1367,21 @@ void map_area0(u32 base)
 	//0x0200 to 0x023F are unused
 	_vmem_mirror_mapping(0x02|base,0x00|base,0x02);
 }
+
+void holly_Serialize(ser_Stream& s)
+{
+	ser_Regs(s,sb_regs.data,sb_regs.Size);
+
+	SER(s,SB_ISTNRM);
+	SER(s,SB_FFST_rc);
+	SER(s,SB_FFST);
+
+	SER(s,dmatmp1);
+	SER(s,dmatmp2);
+	SER(s,OldDmaId);
+
+	ser_Data(s,sys_nvmem.data,sys_nvmem.size);
+#ifdef FLASH_SIZE
+	SER(s,sys_nvmem.state);
+#endif
+}
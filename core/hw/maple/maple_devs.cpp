@@ -3,6 +3,7 @@
 #include "maple_helper.h"
 #include "maple_devs.h"
 #include "maple_cfg.h"
+#include "serialize.h"
 #include <time.h>
 
 #include "deps/zlib/zlib.h"
@@ -316,6 +317,34 @@ struct maple_sega_vmu: maple_base
 	{
 		if (file) fclose(file);
 	}
+	virtual void Serialize(ser_Stream& s)
+	{
+		if (s.load())
+		{
+			//the save file follows the state, only written when it changed
+			vector<u8> data(sizeof(flash_data));
+			ser_Data(s,&data[0],data.size());
+
+			if (!s.failed && memcmp(&data[0],flash_data,sizeof(flash_data))!=0)
+			{
+				memcpy(flash_data,&data[0],sizeof(flash_data));
+
+				if (file)
+				{
+					fseek(file,0,SEEK_SET);
+					fwrite(flash_data,sizeof(flash_data),1,file);
+					fflush(file);
+				}
+			}
+		}
+		else
+		{
+			SER(s,flash_data);
+		}
+
+		SER(s,lcd_data);
+		SER(s,lcd_data_decoded);
+	}
 	virtual u32 dma(u32 cmd)
 	{
 		//printf("maple_sega_vmu::dma Called for port 0x%X, Command %d\n",device_instance->port,Command);
@@ -844,6 +873,13 @@ struct maple_sega_purupuru : maple_base
    u16 AST, AST_ms;
    u32 VIBSET;
 
+   virtual void Serialize(ser_Stream& s)
+   {
+      SER(s,AST);
+      SER(s,AST_ms);
+      SER(s,VIBSET);
+   }
+
    virtual u32 dma(u32 cmd)
    {
       switch (cmd)
@@ -1,6 +1,8 @@
 #pragma once
 #include "types.h"
 
+struct ser_Stream;
+
 enum MapleDeviceType
 {
 	MDT_SegaController,
@@ -29,6 +31,8 @@ struct maple_device
 	virtual void OnSetup(){};
 	virtual ~maple_device();
 	virtual u32 Dma(u32 Command,u32* buffer_in,u32 buffer_in_len,u32* buffer_out,u32& buffer_out_len)=0;
+	//save states, for the devices that have state of their own
+	virtual void Serialize(ser_Stream& s) { }
 };
 
 maple_device* maple_Create(MapleDeviceType type);
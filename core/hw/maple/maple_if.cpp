@@ -9,6 +9,7 @@
 #include "types.h"
 #include "hw/holly/holly.h"
 #include "hw/maple/maple_helper.h"
+#include "serialize.h"
 
 maple_device* MapleDevices[4][6];
 
@@ -216,3 +217,57 @@ void maple_Term()
 {
 	
 }
+
+//Each device is stored with its size, so a state made with different
+//devices plugged in still loads
+void maple_Serialize(ser_Stream& s)
+{
+	SER(s,dmacount);
+	SER(s,maple_ddt_pending_reset);
+
+	for (u32 bus=0;bus<4;bus++)
+	{
+		for (u32 port=0;port<6;port++)
+		{
+			maple_device* dev=MapleDevices[bus][port];
+
+			u32 size=0;
+			if (dev && !s.load())
+			{
+				ser_Stream sz={SER_SIZE,0,0,0,false};
+				dev->Serialize(sz);
+				size=sz.pos;
+			}
+
+			SER(s,size);
+
+			if (s.load())
+			{
+				if (s.failed || size>s.size-s.pos)
+				{
+					s.failed=true;
+					return;
+				}
+
+				u32 end=s.pos+size;
+				u32 expected=0;
+
+				if (dev)
+				{
+					ser_Stream sz={SER_SIZE,0,0,0,false};
+					dev->Serialize(sz);
+					expected=sz.pos;
+				}
+
+				if (dev && expected==size)
+					dev->Serialize(s);
+
+				s.pos=end;
+			}
+			else if (dev)
+			{
+				dev->Serialize(s);
+			}
+		}
+	}
+}
@@ -7,6 +7,9 @@ struct PixelBuffer
 	u16* p_current_pixel;
 
 	u32 pixels_per_line;
+
+	u32 palette_index;	//paletted textures
+	u8* vq_codebook;	//vq textures
 };
 
 __forceinline u32 YUV422(s32 Y,s32 Yu,s32 Yv)
@@ -172,7 +175,7 @@ pixelcvt_end;
 pixelcvt_start(convPAL4_TW,4,4)
 {
 	u8* p_in=(u8*)data;
-	u32* pal=&palette_ram[palette_index];
+	u32* pal=&palette_ram[pb->palette_index];
 
    pb->p_current_pixel[0]=pal[p_in[0]&0xF];
    pb->p_current_pixel[1*pb->pixels_per_line]=pal[(p_in[0]>>4)&0xF];
@@ -205,7 +208,7 @@ pixelcvt_start(convPAL4_TW,4,4)
 pixelcvt_next(convPAL8_TW,2,4)
 {
 	u8* p_in=(u8*)data;
-	u32* pal=&palette_ram[palette_index];
+	u32* pal=&palette_ram[pb->palette_index];
 
    pb->p_current_pixel[0]=pal[p_in[0]];
    p_in++;
@@ -305,7 +308,7 @@ void texture_VQ(PixelBuffer* pb,u8* p_in,u32 Width,u32 Height)
 #else
 			u8 p = p_in[(twop(x,y,bcx,bcy)/divider)];
 #endif
-			PixelConvertor::Convert(pb,&vq_codebook[p*8]);
+			PixelConvertor::Convert(pb,&pb->vq_codebook[p*8]);
 
          pb->p_current_pixel += PixelConvertor::xpp;
 		}
@@ -315,6 +318,267 @@ void texture_VQ(PixelBuffer* pb,u8* p_in,u32 Width,u32 Height)
 	}
 }
 
+/*
+	SIMD paths for the twiddled 16 bit, VQ and paletted formats.
+
+	They work on whole 4x4 tiles, which are 16 pixels in morton order (y in the
+	low bit) wherever the tile is. Pixels 0-7 are the left 2x4 half of the tile
+	and 8-15 the right one, so rows are picked out with a few shuffles. The 16
+	bit conversions are rotates: 565 is as is, 1555 rotates by 1 and 4444 by 4.
+*/
+#if !defined(MSB_FIRST) && (defined(__SSE2__) || defined(_M_X64) || defined(__aarch64__))
+#define TEX_SIMD
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+typedef uint16x8_t tex_vec;
+#else
+#include <emmintrin.h>
+#include <tmmintrin.h>
+typedef __m128i tex_vec;
+
+#if defined(__GNUC__)
+#define TEX_SSSE3 __attribute__((target("ssse3")))
+#else
+#define TEX_SSSE3
+#endif
+#endif
+
+//set from the frontend's cpu features
+static bool tex_ssse3;
+
+static void tex_DetectSimd(u64 cpu)
+{
+	tex_ssse3 = (cpu & RETRO_SIMD_SSSE3) != 0;
+}
+
+//a: pixels 0-7 of the tile, b: pixels 8-15
+__forceinline static void tex_StoreTile(u16* dst,u32 stride,tex_vec a,tex_vec b)
+{
+#if defined(__aarch64__)
+	uint32x4_t e=vreinterpretq_u32_u16(vuzp1q_u16(a,b));	//rows 0,2
+	uint32x4_t o=vreinterpretq_u32_u16(vuzp2q_u16(a,b));	//rows 1,3
+
+	vst1_u16(dst+0*stride,vreinterpret_u16_u32(vget_low_u32(vuzp1q_u32(e,e))));
+	vst1_u16(dst+1*stride,vreinterpret_u16_u32(vget_low_u32(vuzp1q_u32(o,o))));
+	vst1_u16(dst+2*stride,vreinterpret_u16_u32(vget_low_u32(vuzp2q_u32(e,e))));
+	vst1_u16(dst+3*stride,vreinterpret_u16_u32(vget_low_u32(vuzp2q_u32(o,o))));
+#else
+	a=_mm_shufflehi_epi16(_mm_shufflelo_epi16(a,_MM_SHUFFLE(3,1,2,0)),_MM_SHUFFLE(3,1,2,0));
+	b=_mm_shufflehi_epi16(_mm_shufflelo_epi16(b,_MM_SHUFFLE(3,1,2,0)),_MM_SHUFFLE(3,1,2,0));
+
+	__m128i r01=_mm_unpacklo_epi32(a,b);
+	__m128i r23=_mm_unpackhi_epi32(a,b);
+
+	_mm_storel_epi64((__m128i*)(dst+0*stride),r01);
+	_mm_storel_epi64((__m128i*)(dst+1*stride),_mm_unpackhi_epi64(r01,r01));
+	_mm_storel_epi64((__m128i*)(dst+2*stride),r23);
+	_mm_storel_epi64((__m128i*)(dst+3*stride),_mm_unpackhi_epi64(r23,r23));
+#endif
+}
+
+template<int rot>
+__forceinline static tex_vec tex_Rotate(tex_vec v)
+{
+	if (rot==0)
+		return v;
+#if defined(__aarch64__)
+	return vorrq_u16(vshlq_n_u16(v,rot),vshrq_n_u16(v,16-rot));
+#else
+	return _mm_or_si128(_mm_slli_epi16(v,rot),_mm_srli_epi16(v,16-rot));
+#endif
+}
+
+__forceinline static tex_vec tex_Load(const u16* p)
+{
+#if defined(__aarch64__)
+	return vld1q_u16(p);
+#else
+	return _mm_loadu_si128((const __m128i*)p);
+#endif
+}
+
+__forceinline static tex_vec tex_Load2(const u8* lo,const u8* hi)
+{
+#if defined(__aarch64__)
+	return vcombine_u16(vld1_u16((const u16*)lo),vld1_u16((const u16*)hi));
+#else
+	return _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)lo),_mm_loadl_epi64((const __m128i*)hi));
+#endif
+}
+
+//8 palette lookups, for the formats the tables below can't do
+__forceinline static tex_vec tex_Lookup(const u32* pal,const u8* i)
+{
+#if defined(__aarch64__)
+	u16 px[8]={(u16)pal[i[0]],(u16)pal[i[1]],(u16)pal[i[2]],(u16)pal[i[3]],(u16)pal[i[4]],(u16)pal[i[5]],(u16)pal[i[6]],(u16)pal[i[7]]};
+	return vld1q_u16(px);
+#else
+	return _mm_setr_epi16(pal[i[0]],pal[i[1]],pal[i[2]],pal[i[3]],pal[i[4]],pal[i[5]],pal[i[6]],pal[i[7]]);
+#endif
+}
+
+template<int rot>
+void texture_TW16(PixelBuffer* pb,u8* p_in,u32 Width,u32 Height)
+{
+	u32 bcx=bitscanrev(Width)-3;
+	u32 bcy=bitscanrev(Height)-3;
+	u32 stride=pb->pixels_per_line;
+
+	for (u32 y=0;y<Height;y+=4)
+	{
+		u16* dst=pb->p_buffer_start+y*stride;
+
+		for (u32 x=0;x<Width;x+=4)
+		{
+			u16* src=(u16*)&p_in[twop(x,y,bcx,bcy)*2];
+			tex_StoreTile(dst+x,stride,tex_Rotate<rot>(tex_Load(src)),tex_Rotate<rot>(tex_Load(src+8)));
+		}
+	}
+}
+
+//each index byte is a 2x2 codebook entry, so a tile is four of them in morton order too
+template<int rot>
+void texture_VQ16(PixelBuffer* pb,u8* p_in,u32 Width,u32 Height)
+{
+	u32 bcx=bitscanrev(Width)-3;
+	u32 bcy=bitscanrev(Height)-3;
+	u32 stride=pb->pixels_per_line;
+
+	p_in+=256*4*2;
+
+	for (u32 y=0;y<Height;y+=4)
+	{
+		u16* dst=pb->p_buffer_start+y*stride;
+
+		for (u32 x=0;x<Width;x+=4)
+		{
+			u8* i=&p_in[twop(x,y,bcx,bcy)/4];
+			tex_vec a=tex_Load2(&pb->vq_codebook[i[0]*8],&pb->vq_codebook[i[1]*8]);
+			tex_vec b=tex_Load2(&pb->vq_codebook[i[2]*8],&pb->vq_codebook[i[3]*8]);
+			tex_StoreTile(dst+x,stride,tex_Rotate<rot>(a),tex_Rotate<rot>(b));
+		}
+	}
+}
+
+//bpp 4: a tile is 8 bytes of nibbles, low nibble first. bpp 8: 16 bytes
+template<int bpp>
+void texture_PAL(PixelBuffer* pb,u8* p_in,u32 Width,u32 Height)
+{
+	u32 bcx=bitscanrev(Width)-3;
+	u32 bcy=bitscanrev(Height)-3;
+	u32 stride=pb->pixels_per_line;
+	u32* pal=&palette_ram[pb->palette_index];
+
+	for (u32 y=0;y<Height;y+=4)
+	{
+		u16* dst=pb->p_buffer_start+y*stride;
+
+		for (u32 x=0;x<Width;x+=4)
+		{
+			u8* src=&p_in[twop(x,y,bcx,bcy)*bpp/8];
+			u8 idx[16];
+
+			if (bpp==4)
+			{
+				for (int i=0;i<8;i++)
+				{
+					idx[i*2+0]=src[i]&0xF;
+					idx[i*2+1]=src[i]>>4;
+				}
+				src=idx;
+			}
+
+			tex_StoreTile(dst+x,stride,tex_Lookup(pal,src),tex_Lookup(pal,src+8));
+		}
+	}
+}
+
+//16 entry palettes fit a byte shuffle, one for the low and one for the high bytes
+#if defined(__aarch64__)
+static void texture_PAL4_tbl(PixelBuffer* pb,u8* p_in,u32 Width,u32 Height)
+#else
+TEX_SSSE3 static void texture_PAL4_tbl(PixelBuffer* pb,u8* p_in,u32 Width,u32 Height)
+#endif
+{
+	u32 bcx=bitscanrev(Width)-3;
+	u32 bcy=bitscanrev(Height)-3;
+	u32 stride=pb->pixels_per_line;
+	u32* pal=&palette_ram[pb->palette_index];
+
+	u8 pal_lo[16],pal_hi[16];
+	for (int i=0;i<16;i++)
+	{
+		pal_lo[i]=pal[i]&0xFF;
+		pal_hi[i]=(pal[i]>>8)&0xFF;
+	}
+
+#if defined(__aarch64__)
+	uint8x16_t tlo=vld1q_u8(pal_lo);
+	uint8x16_t thi=vld1q_u8(pal_hi);
+	uint8x8_t nib=vdup_n_u8(0xF);
+#else
+	__m128i tlo=_mm_loadu_si128((__m128i*)pal_lo);
+	__m128i thi=_mm_loadu_si128((__m128i*)pal_hi);
+	__m128i nib=_mm_set1_epi8(0xF);
+#endif
+
+	for (u32 y=0;y<Height;y+=4)
+	{
+		u16* dst=pb->p_buffer_start+y*stride;
+
+		for (u32 x=0;x<Width;x+=4)
+		{
+			u8* src=&p_in[twop(x,y,bcx,bcy)/2];
+#if defined(__aarch64__)
+			uint8x8_t v=vld1_u8(src);
+			uint8x8_t lo=vand_u8(v,nib);
+			uint8x8_t hi=vshr_n_u8(v,4);
+			uint8x16_t idx=vcombine_u8(vzip1_u8(lo,hi),vzip2_u8(lo,hi));
+
+			uint8x16_t pl=vqtbl1q_u8(tlo,idx);
+			uint8x16_t ph=vqtbl1q_u8(thi,idx);
+
+			tex_StoreTile(dst+x,stride,vreinterpretq_u16_u8(vzip1q_u8(pl,ph)),vreinterpretq_u16_u8(vzip2q_u8(pl,ph)));
+#else
+			__m128i v=_mm_loadl_epi64((__m128i*)src);
+			__m128i lo=_mm_and_si128(v,nib);
+			__m128i hi=_mm_and_si128(_mm_srli_epi16(v,4),nib);
+			__m128i idx=_mm_unpacklo_epi8(lo,hi);
+
+			__m128i pl=_mm_shuffle_epi8(tlo,idx);
+			__m128i ph=_mm_shuffle_epi8(thi,idx);
+
+			tex_StoreTile(dst+x,stride,_mm_unpacklo_epi8(pl,ph),_mm_unpackhi_epi8(pl,ph));
+#endif
+		}
+	}
+}
+
+template<> void texture_TW<conv565_TW >(PixelBuffer* pb,u8* p_in,u32 Width,u32 Height) { texture_TW16<0>(pb,p_in,Width,Height); }
+template<> void texture_TW<conv1555_TW >(PixelBuffer* pb,u8* p_in,u32 Width,u32 Height) { texture_TW16<1>(pb,p_in,Width,Height); }
+template<> void texture_TW<conv4444_TW >(PixelBuffer* pb,u8* p_in,u32 Width,u32 Height) { texture_TW16<4>(pb,p_in,Width,Height); }
+
+template<> void texture_VQ<conv565_TW >(PixelBuffer* pb,u8* p_in,u32 Width,u32 Height) { texture_VQ16<0>(pb,p_in,Width,Height); }
+template<> void texture_VQ<conv1555_TW >(PixelBuffer* pb,u8* p_in,u32 Width,u32 Height) { texture_VQ16<1>(pb,p_in,Width,Height); }
+template<> void texture_VQ<conv4444_TW >(PixelBuffer* pb,u8* p_in,u32 Width,u32 Height) { texture_VQ16<4>(pb,p_in,Width,Height); }
+
+template<> void texture_TW<convPAL4_TW >(PixelBuffer* pb,u8* p_in,u32 Width,u32 Height)
+{
+#if !defined(__aarch64__)
+	if (!tex_ssse3)
+	{
+		texture_PAL<4>(pb,p_in,Width,Height);
+		return;
+	}
+#endif
+	texture_PAL4_tbl(pb,p_in,Width,Height);
+}
+template<> void texture_TW<convPAL8_TW >(PixelBuffer* pb,u8* p_in,u32 Width,u32 Height) { texture_PAL<8>(pb,p_in,Width,Height); }
+#else
+static void tex_DetectSimd(u64 cpu) { }
+#endif
+
 //We ask the compiler to generate the templates here
 //;)
 //planar formats !
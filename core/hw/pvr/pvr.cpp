@@ -14,6 +14,7 @@
 #include "hw/sh4/modules/dmac.h"
 #include "hw/sh4/sh4_sched.h"
 #include "hw/sh4/sh4_mem.h"
+#include "serialize.h"
 
 #include <rthreads/rthreads.h>
 
@@ -250,6 +251,7 @@ void libPvr_Reset(bool Manual)
 s32 libPvr_Init(void)
 {
    ta_ctx_init();
+   ta_parse_init();
    
 	render_end_sched = sh4_sched_register(0,&rend_end_sch);
 	vblank_sched     = sh4_sched_register(0,&spg_line_sched);
@@ -268,9 +270,114 @@ s32 libPvr_Init(void)
 void libPvr_Term(void)
 {
 	rend_term();
+   ta_parse_term();
    ta_ctx_free();
 }
 
+//Page state
+//
+#define VRAM_PAGES (VRAM_SIZE/PAGE_SIZE)
+
+//Pages that are write protected
+static u32 vram_protected[VRAM_PAGES/32];
+//FrameCount of the last write caught on each page
+static u32 vram_written[VRAM_PAGES];
+//Live blocks on each page
+static u32 vram_locks[VRAM_PAGES];
+
+static inline bool page_test(const u32* bits,u32 page) { return (bits[page/32]>>(page&31))&1; }
+static inline void page_set(u32* bits,u32 page) { bits[page/32]|=1<<(page&31); }
+static inline void page_clear(u32* bits,u32 page) { bits[page/32]&=~(1<<(page&31)); }
+
+//With nvmem, vram is mapped at [0x04000000,0x05000000) and mirrored at
+//[0x06000000,0x07000000), wrapping every VRAM_SIZE in both
+#define VRAM_AREA_SIZE   0x01000000
+#define VRAM_MIRROR_OFFS 0x02000000
+
+static void vramlock_protect(u32 page,u32 count,bool protect)
+{
+	u32 offset=page*PAGE_SIZE;
+	u32 size=count*PAGE_SIZE;
+	u32 areas=_nvmem_enabled() ? 2 : 1;
+	u32 wraps=_nvmem_enabled() ? VRAM_AREA_SIZE/VRAM_SIZE : 1;
+
+	for (u32 area=0;area<areas;area++)
+	{
+		for (u32 wrap=0;wrap<wraps;wrap++)
+		{
+			u32 mirror=area*VRAM_MIRROR_OFFS + wrap*VRAM_SIZE;
+
+			if (protect)
+				VArray2_LockRegion(&vram,offset + mirror,size);
+			else
+				VArray2_UnLockRegion(&vram,offset + mirror,size);
+		}
+	}
+}
+
+//Protects the unprotected pages in [first,last], contiguous pages share one call
+static void vramlock_protect_range(u32 first,u32 last)
+{
+	u32 page=first;
+
+	while (page<=last)
+	{
+		if (page_test(vram_protected,page))
+		{
+			page++;
+			continue;
+		}
+
+		u32 start=page;
+
+		do
+			page_set(vram_protected,page++);
+		while (page<=last && !page_test(vram_protected,page));
+
+		vramlock_protect(start,page-start,true);
+	}
+}
+
+//Block pool
+//Blocks are recycled instead of malloc'd on every texture update
+//
+#define VRAM_POOL_CHUNK 256
+
+static vector<vram_block*> vram_pool;
+static vector<vram_block*> vram_pool_chunks;
+//set by libCore_vramlock_Free, the chunks go once the renderer returns every block
+static bool vram_pool_release;
+
+static void vramlock_pool_release(void)
+{
+	if (vram_pool.size()!=vram_pool_chunks.size()*VRAM_POOL_CHUNK)
+		return;
+
+	for (size_t i=0;i<vram_pool_chunks.size();i++)
+		delete[] vram_pool_chunks[i];
+
+	vram_pool_chunks.clear();
+	vram_pool.clear();
+	vram_pool_release=false;
+}
+
+static vram_block* vramlock_alloc(void)
+{
+	if (vram_pool.empty())
+	{
+		vram_block* chunk=new vram_block[VRAM_POOL_CHUNK];
+		vram_pool_chunks.push_back(chunk);
+
+		for (u32 i=0;i<VRAM_POOL_CHUNK;i++)
+			vram_pool.push_back(&chunk[VRAM_POOL_CHUNK-1-i]);
+	}
+
+	vram_block* block=vram_pool.back();
+	vram_pool.pop_back();
+
+	return block;
+}
+
 //List functions
 //
 static void vramlock_list_remove(vram_block* block)
@@ -284,7 +391,10 @@ static void vramlock_list_remove(vram_block* block)
 		for (size_t j=0;j<list->size();j++)
 		{
 			if ((*list)[j]==block)
+			{
 				(*list)[j]=0;
+				vram_locks[i]--;
+			}
 		}
 	}
 }
@@ -298,6 +408,9 @@ static void vramlock_list_add(vram_block* block)
 	for (u32 i=base;i<=end;i++)
 	{
 		vector<vram_block*>* list=&VramLocks[i];
+
+		vram_locks[i]++;
+
 		for (u32 j=0;j<list->size();j++)
 		{
 			if ((*list)[j]==0)
@@ -311,6 +424,8 @@ static void vramlock_list_add(vram_block* block)
 added_it:
 		i=i;
 	}
+
+	vramlock_protect_range(base,end);
 }
  
 #ifndef TARGET_NO_THREADS
@@ -324,10 +439,9 @@ static inline bool IsInRange(vram_block* block,u32 offset)
 }
 
 
+//Protects right away, writes from here on mark the block dirty
 vram_block* libCore_vramlock_Lock(u32 start_offset64,u32 end_offset64,void* userdata)
 {
-	vram_block* block=(vram_block* )malloc(sizeof(vram_block));
-
 	if (end_offset64>(VRAM_SIZE-1))
 	{
 		msgboxf("vramlock_Lock_64: end_offset64>(VRAM_SIZE-1) \n Tried to lock area out of vram , possibly bug on the pvr plugin",MBX_OK);
@@ -340,7 +454,11 @@ vram_block* libCore_vramlock_Lock(u32 start_offset64,u32 end_offset64,void* user
 		start_offset64=0;
 	}
 
-	
+#ifndef TARGET_NO_THREADS
+   slock_lock(vramlist_lock);
+#endif
+
+	vram_block* block=vramlock_alloc();
 
 	block->end=end_offset64;
 	block->start=start_offset64;
@@ -348,30 +466,63 @@ vram_block* libCore_vramlock_Lock(u32 start_offset64,u32 end_offset64,void* user
 	block->userdata=userdata;
 	block->type=64;
 
+   vramlock_list_add(block);
+
+#ifndef TARGET_NO_THREADS
+   slock_unlock(vramlist_lock);
+#endif
+
+	return block;
+}
+
+//Drops protection from pages no block needs anymore. It's left on until here so
+//pages that get locked again every frame aren't toggled. Contiguous pages share one call.
+void libCore_vramlock_Flush(void)
+{
 #ifndef TARGET_NO_THREADS
    slock_lock(vramlist_lock);
 #endif
 
-   VArray2_LockRegion(&vram, block->start,block->len);
+   u32 page=0;
+
+   while (page<VRAM_PAGES)
+   {
+      //skip 32 unprotected pages at a time
+      if ((page&31)==0 && vram_protected[page/32]==0)
+      {
+         page+=32;
+         continue;
+      }
 
-   //TODO: Fix this for 32M wrap as well
-   if (_nvmem_enabled() && VRAM_SIZE == 0x800000)
-      VArray2_LockRegion(&vram, block->start + VRAM_SIZE, block->len);
+      if (!page_test(vram_protected,page) || vram_locks[page]!=0)
+      {
+         page++;
+         continue;
+      }
 
-   vramlock_list_add(block);
+      u32 first=page;
+
+      do
+         page_clear(vram_protected,page++);
+      while (page<VRAM_PAGES && page_test(vram_protected,page) && vram_locks[page]==0);
+
+      vramlock_protect(first,page-first,false);
+   }
 
 #ifndef TARGET_NO_THREADS
    slock_unlock(vramlist_lock);
 #endif
-
-	return block;
 }
 
-
 bool VramLockedWrite(u8* address)
 {
    size_t offset=address-vram.data;
 
+   //writes through the nvmem mirrors land on the same pages
+   if (_nvmem_enabled() && offset<VRAM_MIRROR_OFFS+VRAM_AREA_SIZE &&
+         (offset<VRAM_AREA_SIZE || offset>=VRAM_MIRROR_OFFS))
+      offset&=VRAM_MASK;
+
    if (offset<VRAM_SIZE)
    {
 
@@ -398,11 +549,9 @@ bool VramLockedWrite(u8* address)
       }
       list->clear();
 
-      VArray2_UnLockRegion(&vram, (u32)offset&(~(PAGE_SIZE-1)),PAGE_SIZE);
-
-      //TODO: Fix this for 32M wrap as well
-      if (_nvmem_enabled() && VRAM_SIZE == 0x800000)
-         VArray2_UnLockRegion(&vram, (u32)offset&(~(PAGE_SIZE-1)) + VRAM_SIZE,PAGE_SIZE);
+      vram_written[addr_hash]=FrameCount;
+      vramlock_protect(addr_hash,1,false);
+      page_clear(vram_protected,addr_hash);
 
 #ifndef TARGET_NO_THREADS
       slock_unlock(vramlist_lock);
@@ -414,9 +563,83 @@ bool VramLockedWrite(u8* address)
    return false;
 }
 
+//Pages without protection can't tell, so they always count as written
+bool libCore_vramlock_DirtySince(u32 start_offset,u32 end_offset,u32 frame)
+{
+   bool rv=false;
+
+   if (end_offset>(VRAM_SIZE-1))
+      end_offset=VRAM_SIZE-1;
+
+#ifndef TARGET_NO_THREADS
+   slock_lock(vramlist_lock);
+#endif
+
+   for (u32 page=start_offset/PAGE_SIZE;page<=end_offset/PAGE_SIZE;page++)
+   {
+      if (!page_test(vram_protected,page) || vram_written[page]>=frame)
+      {
+         rv=true;
+         break;
+      }
+   }
+
+#ifndef TARGET_NO_THREADS
+   slock_unlock(vramlist_lock);
+#endif
+
+   return rv;
+}
+
+//vram was unprotected behind our back, protect what's still locked again
+static void vramlock_Unprotected(void)
+{
+#ifndef TARGET_NO_THREADS
+   //not up yet, nothing can be locked
+   if (!vramlist_lock)
+      return;
+
+   slock_lock(vramlist_lock);
+#endif
+
+   //the mirrors may still be protected
+   vramlock_protect(0,VRAM_PAGES,false);
+   memset(vram_protected,0,sizeof(vram_protected));
+
+   u32 page=0;
+
+   while (page<VRAM_PAGES)
+   {
+      if (!vram_locks[page])
+      {
+         page++;
+         continue;
+      }
+
+      u32 first=page;
+
+      while (page<VRAM_PAGES && vram_locks[page])
+         page++;
+
+      vramlock_protect_range(first,page-1);
+   }
+
+#ifndef TARGET_NO_THREADS
+   slock_unlock(vramlist_lock);
+#endif
+}
+
 #ifdef TARGET_NO_THREADS
-void libCore_vramlock_Free(void) { }
-void libCore_vramlock_Init(void) { }
+void libCore_vramlock_Free(void)
+{
+	vram_pool_release=true;
+	vramlock_pool_release();
+}
+
+void libCore_vramlock_Init(void)
+{
+	vram_pool_release=false;
+}
 
 //unlocks mem
 //also frees the handle
@@ -427,6 +650,11 @@ void libCore_vramlock_Unlock_block(vram_block* block)
 #else
 void libCore_vramlock_Free(void)
 {
+   slock_lock(vramlist_lock);
+   vram_pool_release=true;
+   vramlock_pool_release();
+   slock_unlock(vramlist_lock);
+
    slock_free(vramlist_lock);
    vramlist_lock = NULL;
 }
@@ -434,25 +662,36 @@ void libCore_vramlock_Free(void)
 void libCore_vramlock_Init(void)
 {
    vramlist_lock = slock_new();
+   vram_pool_release=false;
 }
 
 //unlocks mem
 //also frees the handle
 void libCore_vramlock_Unlock_block(vram_block* block)
 {
+	//the renderer is gone, nothing else touches the lists
+	if (!vramlist_lock)
+	{
+		libCore_vramlock_Unlock_block_wb(block);
+		return;
+	}
+
 	slock_lock(vramlist_lock);
 	libCore_vramlock_Unlock_block_wb(block);
 	slock_unlock(vramlist_lock);
 }
 #endif
 
+//Leaves the page protected, the next flush drops it if it's idle
 void libCore_vramlock_Unlock_block_wb(vram_block* block)
 {
 	if (block->end <= VRAM_SIZE)
 	{
 		vramlock_list_remove(block);
-		//more work needed
-		free(block);
+		vram_pool.push_back(block);
+
+		if (vram_pool_release)
+			vramlock_pool_release();
 	}
 }
 
@@ -690,7 +929,10 @@ extern "C" void DYNACALL TAWriteSQ(u32 address,u8* sqb)
 void pvr_Reset(bool Manual)
 {
    if (!Manual)
+   {
       VArray2_Zero(&vram);
+      vramlock_Unprotected();
+   }
 }
 
 u32 pvr_map32(u32 offset32)
@@ -902,6 +1144,40 @@ void pvr_WriteReg(u32 paddr,u32 data)
 	PvrReg(addr,u32)=data;
 }
 
+void pvr_Serialize(ser_Stream& s)
+{
+	SER(s,pvr_regs);
+
+	SER(s,in_vblank);
+	SER(s,clc_pvr_scanline);
+	SER(s,prv_cur_scanline);
+	SER(s,vblk_cnt);
+	SER(s,pend_rend);
+
+	SER(s,YUV_tempdata);
+	SER(s,YUV_dest);
+	SER(s,YUV_blockcount);
+	SER(s,YUV_x_curr);
+	SER(s,YUV_y_curr);
+	SER(s,YUV_x_size);
+	SER(s,YUV_y_size);
+
+	if (s.load())
+	{
+		//timings and fb scale come from the registers
+		u32 scanline=prv_cur_scanline;
+		pvr_reconfigure_spg();
+		prv_cur_scanline=scanline;
+
+		fog_needs_update=true;
+		pal_needs_update=true;
+		for (u32 i=0;i<4;i++)
+			_pal_rev_256[i]++;
+		for (u32 i=0;i<64;i++)
+			_pal_rev_16[i]++;
+	}
+}
+
 
 /*
 	PVR-SB handling
@@ -1145,6 +1421,11 @@ bool rend_init(void)
 #ifdef NO_REND
 	renderer	 = rend_norend();
 #else
+#if HOST_CPU == CPU_X86 || HOST_CPU == CPU_X64
+	if (settings.pvr.rend == 1)
+		renderer = rend_softrend();
+	else
+#endif
 	renderer = rend_GLES2();
 #endif
 
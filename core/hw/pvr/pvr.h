@@ -616,6 +616,11 @@ extern "C" void DYNACALL TAWriteSQ(u32 address,u8* sqb);
 
 void libCore_vramlock_Free(void);
 void libCore_vramlock_Init(void);
+//Drops the write protection of pages with no locks left, once per frame
+void libCore_vramlock_Flush(void);
+//true if [start_offset,end_offset] was written in frame or later, for renderers
+//that poll instead of waiting for the invalidation callback
+bool libCore_vramlock_DirtySince(u32 start_offset,u32 end_offset,u32 frame);
 
 #define pvr_RegSize (0x8000)
 #define pvr_RegMask (pvr_RegSize-1)
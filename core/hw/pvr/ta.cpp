@@ -1,6 +1,7 @@
 #include "pvr.h"
 
 #include "hw/sh4/sh4_sched.h"
+#include "serialize.h"
 
 extern u32 ta_type_lut[256];
 
@@ -228,6 +229,9 @@ void ta_vtx_ListInit(void)
 {
 	SetCurrentTARC(TA_ISP_BASE);
 
+   /* The data is about to be overwritten */
+   ta_parse_Release(ta_ctx);
+
    /* Clear partial */
    ta_tad.thd_old_data = ta_tad.thd_data;
    ta_tad.thd_data     = ta_tad.thd_root;
@@ -277,6 +281,7 @@ void ta_vtx_data(u32* data, u32 size)
                      ta_fsm_cl=dat->pcw.ListType;
                   //printf("List %d ended\n",ta_fsm_cl);
 
+                  ta_parse_ListEnd(ta_ctx,ta_tad.thd_root,ta_tad.thd_data);
                   asic_RaiseInterrupt( ListEndInterrupt[ta_fsm_cl]);
                   ta_fsm_cl=7;
                   trans=TAS_NS;
@@ -450,6 +455,8 @@ void ta_ctx_init(void) { }
 
 void tactx_Recycle(TA_context* poped_ctx)
 {
+   ta_parse_Release(poped_ctx);
+
    if (ctx_pool.size()>2)
    {
       poped_ctx->Free();
@@ -542,6 +549,8 @@ void ta_ctx_init(void)
 
 void tactx_Recycle(TA_context* poped_ctx)
 {
+   ta_parse_Release(poped_ctx);
+
    slock_lock(mtx_pool);
    if (ctx_pool.size()>2)
    {
@@ -576,3 +585,62 @@ TA_context* tactx_Pop(u32 addr)
    }
 	return 0;
 }
+
+//Only the contexts the TA is filling, the ones queued for rendering are
+//left to the renderer
+void ta_Serialize(ser_Stream& s)
+{
+	SER(s,ta_cur_state);
+	SER(s,ta_fsm_cl);
+
+	u32 cur=ta_ctx?ta_ctx->Address:TACTX_NONE;
+	SER(s,cur);
+
+	u32 count=ctx_list.size();
+	SER(s,count);
+
+	if (s.load())
+	{
+		if (ta_ctx)
+			SetCurrentTARC(TACTX_NONE);
+
+		for (size_t i=0;i<ctx_list.size();i++)
+			tactx_Recycle(ctx_list[i]);
+		ctx_list.clear();
+	}
+
+	for (u32 i=0;i<count && !s.failed;i++)
+	{
+		TA_context* ctx=s.load()?0:ctx_list[i];
+		tad_context* tad=(ctx && ctx==ta_ctx)?&ta_tad:ctx?&ctx->tad:0;
+
+		u32 addr=ctx?ctx->Address:0;
+		u32 size=tad?tad->thd_data-tad->thd_root:0;
+		u32 old=tad?tad->thd_old_data-tad->thd_root:0;
+
+		SER(s,addr);
+		SER(s,size);
+		SER(s,old);
+
+		if (s.load())
+		{
+			if (s.failed || size>TA_DATA_SIZE || old>TA_DATA_SIZE)
+			{
+				s.failed=true;
+				break;
+			}
+
+			ctx=tactx_Find(addr,true);
+			ctx->Reset();
+			tad=&ctx->tad;
+			tad->thd_data=tad->thd_root+size;
+			tad->thd_old_data=tad->thd_root+old;
+		}
+
+		//after a list init the old data is past the new end
+		ser_Data(s,tad->thd_root,max(size,old));
+	}
+
+	if (s.load() && cur!=TACTX_NONE)
+		SetCurrentTARC(cur);
+}
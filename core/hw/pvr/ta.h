@@ -828,6 +828,10 @@ void DYNACALL ta_vtx_data32(void* data);
 void ta_vtx_data(u32* data, u32 size);
 
 bool ta_parse_vdrc(TA_context* ctx);
+void ta_parse_ListEnd(TA_context* ctx,u8* start,u8* end);
+void ta_parse_Release(TA_context* ctx);
+void ta_parse_init(void);
+void ta_parse_term(void);
 
 #define STRIPS_AS_PPARAMS 1
 
@@ -870,6 +874,7 @@ struct ModTriangle
 	f32 x0,y0,z0,x1,y1,z1,x2,y2,z2;
 };
 
+#define TA_DATA_SIZE (2*1024*1024)
 #define TAD_END(tad) (tad.thd_data == tad.thd_root ? tad.thd_old_data : tad.thd_data)
 
 struct  tad_context
@@ -963,7 +968,7 @@ struct TA_context
       thd_inuse  = slock_new();
       rend_inuse = slock_new();
 #endif
-      u8 *ptr = (u8*)malloc(2*1024*1024);
+      u8 *ptr = (u8*)malloc(TA_DATA_SIZE);
       tad.thd_data = tad.thd_root = tad.thd_old_data = ptr;
 
 		rend.verts.InitBytes(1024*1024,&rend.Overrun); //up to 1 mb of vtx data/frame = ~ 38k vtx/frame
@@ -17,8 +17,6 @@ u8 f32_su8_tbl[65536];
 
 bool pal_needs_update=true;
 
-u8* vq_codebook;
-u32 palette_index;
 u32 _pal_rev_256[4]={0};
 u32 _pal_rev_16[64]={0};
 u32 pal_rev_256[4]={0};
@@ -48,6 +46,9 @@ static PolyParam nullPP;
 static PolyParam* CurrentPP=&nullPP;
 static List<PolyParam>* CurrentPPlist;
 
+//lists are decoded as they close, textures get resolved by ta_parse_vdrc
+static bool parse_incremental;
+
 //TA state vars	
 DECL_ALIGN(4) static u8 FaceBaseColor[4];
 DECL_ALIGN(4) static u8 FaceOffsColor[4];
@@ -893,7 +894,7 @@ public:
 
                      d_pp->texid = -1;
 
-                     if (d_pp->pcw.Texture)
+                     if (d_pp->pcw.Texture && !parse_incremental)
                         d_pp->texid = renderer->GetTexture(d_pp->tsp,d_pp->tcw);
                   }
 
@@ -1141,7 +1142,7 @@ public:
 
 		d_pp->texid = -1;
 		
-		if (d_pp->pcw.Texture) {
+		if (d_pp->pcw.Texture && !parse_incremental) {
 			d_pp->texid = renderer->GetTexture(d_pp->tsp,d_pp->tcw);
 		}
 
@@ -1280,11 +1281,289 @@ FifoSplitter<0> TAFifo0;
 
 int ta_parse_cnt = 0;
 
+/*
+	Incremental parsing
+
+	With settings.pvr.ta_incremental every list is decoded as soon as the TA
+	closes it, instead of the whole frame at once when it gets rendered. With
+	threads this runs on a worker, so by STARTRENDER the render thread only
+	has to wait for whatever is left. Textures are looked up afterwards, from
+	ta_parse_vdrc, as the backends need that on the render thread.
+
+	vd_rc only holds one context. Lists of another context restart the decode
+	from that context's root, the abandoned one is decoded from scratch when
+	it gets rendered.
+*/
+struct ParseJob
+{
+	TA_context* ctx;
+	u8* start;
+	u8* end;
+	bool finish;
+};
+
+static TA_context* inc_ctx;	//context vd_rc holds the partial decode of
+static Ta_Dma* inc_pos;		//next packet to decode
+
+//copies the decoded geometry, keeping the overrun flag local to dst
+static void vdec_lists(rend_context& dst,const rend_context& src)
+{
+	dst.verts=src.verts;
+	dst.idx=src.idx;
+	dst.modtrig=src.modtrig;
+	dst.global_param_mvo=src.global_param_mvo;
+	dst.global_param_op=src.global_param_op;
+	dst.global_param_pt=src.global_param_pt;
+	dst.global_param_tr=src.global_param_tr;
+
+	dst.fZ_min=src.fZ_min;
+	dst.fZ_max=src.fZ_max;
+	dst.Overrun=src.Overrun;
+
+	dst.verts.overrun=&dst.Overrun;
+	dst.idx.overrun=&dst.Overrun;
+	dst.modtrig.overrun=&dst.Overrun;
+	dst.global_param_mvo.overrun=&dst.Overrun;
+	dst.global_param_op.overrun=&dst.Overrun;
+	dst.global_param_pt.overrun=&dst.Overrun;
+	dst.global_param_tr.overrun=&dst.Overrun;
+}
+
+//claims vd_rc for the job, returns true if the decode has to start over
+static bool inc_Take(const ParseJob& job)
+{
+	bool restart=job.ctx!=inc_ctx;
+
+	inc_ctx=job.finish ? 0 : job.ctx;
+
+	return restart;
+}
+
+static void inc_Decode(const ParseJob& job,bool restart)
+{
+	Ta_Dma* ta_data_end=((Ta_Dma*)job.end)-1;
+
+	if (restart || inc_pos<(Ta_Dma*)job.start || inc_pos>ta_data_end+1)
+	{
+		vdec_lists(vd_rc,job.ctx->rend);
+		TAFifo0.vdec_init();
+		inc_pos=(Ta_Dma*)job.start;
+	}
+
+	while (inc_pos<=ta_data_end)
+		inc_pos=TaCmd(inc_pos,ta_data_end);
+
+	if (job.finish)
+		vdec_lists(job.ctx->rend,vd_rc);
+}
+
+//same (tsp,tcw) runs are common, sprites duplicate their param for every quad
+static void vdec_textures(List<PolyParam>& list,int first)
+{
+	PolyParam* pp=list.head();
+	PolyParam* last=0;
+
+	for (int i=first;i<list.used();i++)
+	{
+		if (!pp[i].pcw.Texture)
+			continue;
+
+		if (last && last->tsp.full==pp[i].tsp.full && last->tcw.full==pp[i].tcw.full)
+			pp[i].texid=last->texid;
+		else
+			pp[i].texid=renderer->GetTexture(pp[i].tsp,pp[i].tcw);
+
+		last=&pp[i];
+	}
+}
+
+#ifndef TARGET_NO_THREADS
+static sthread_t* parse_thread;
+static slock_t* parse_mtx;
+static scond_t* parse_cond;
+static vector<ParseJob> parse_jobs;
+static ParseJob parse_busy;	//job being decoded, ctx is 0 if none
+static bool parse_run;
+
+static void parse_worker(void*)
+{
+	slock_lock(parse_mtx);
+
+	for (;;)
+	{
+		while (parse_run && parse_jobs.empty())
+			scond_wait(parse_cond,parse_mtx);
+
+		if (!parse_run)
+			break;
+
+		ParseJob job=parse_jobs.front();
+		parse_jobs.erase(parse_jobs.begin());
+
+		bool restart=inc_Take(job);
+		parse_busy=job;
+		slock_unlock(parse_mtx);
+
+		inc_Decode(job,restart);
+
+		slock_lock(parse_mtx);
+		parse_busy.ctx=0;
+		scond_broadcast(parse_cond);
+	}
+
+	slock_unlock(parse_mtx);
+}
+
+//must hold parse_mtx. finish_only skips the list jobs
+static bool parse_pending(TA_context* ctx,bool finish_only)
+{
+	if (parse_busy.ctx==ctx && (parse_busy.finish || !finish_only))
+		return true;
+
+	for (size_t i=0;i<parse_jobs.size();i++)
+	{
+		if (parse_jobs[i].ctx==ctx && (parse_jobs[i].finish || !finish_only))
+			return true;
+	}
+
+	return false;
+}
+
+static void inc_Post(const ParseJob& job)
+{
+	slock_lock(parse_mtx);
+	parse_jobs.push_back(job);
+	scond_broadcast(parse_cond);
+
+	//lists queued after it don't matter to the render thread
+	if (job.finish)
+	{
+		while (parse_pending(job.ctx,true))
+			scond_wait(parse_cond,parse_mtx);
+	}
+	slock_unlock(parse_mtx);
+}
+
+void ta_parse_Release(TA_context* ctx)
+{
+	if (!parse_incremental)
+		return;
+
+	//the lists are stale, but the render thread waits on finish jobs, so
+	//those still run and are waited for
+	slock_lock(parse_mtx);
+	for (size_t i=parse_jobs.size();i-->0;)
+	{
+		if (parse_jobs[i].ctx==ctx && !parse_jobs[i].finish)
+			parse_jobs.erase(parse_jobs.begin()+i);
+	}
+	scond_broadcast(parse_cond);
+
+	while (parse_pending(ctx,false))
+		scond_wait(parse_cond,parse_mtx);
+
+	if (inc_ctx==ctx)
+		inc_ctx=0;
+	slock_unlock(parse_mtx);
+}
+
+void ta_parse_init(void)
+{
+	parse_incremental=settings.pvr.ta_incremental!=0;
+	inc_ctx=0;
+
+	if (!parse_incremental)
+		return;
+
+	parse_mtx=slock_new();
+	parse_cond=scond_new();
+	parse_run=true;
+	parse_thread=sthread_create(parse_worker,0);
+}
+
+void ta_parse_term(void)
+{
+	if (!parse_incremental)
+		return;
+
+	slock_lock(parse_mtx);
+	parse_run=false;
+	parse_jobs.clear();
+	scond_broadcast(parse_cond);
+	slock_unlock(parse_mtx);
+
+	sthread_join(parse_thread);
+	scond_free(parse_cond);
+	slock_free(parse_mtx);
+	parse_thread=0;
+	parse_cond=0;
+	parse_mtx=0;
+
+	parse_incremental=false;
+	inc_ctx=0;
+}
+#else
+static void inc_Post(const ParseJob& job)
+{
+	inc_Decode(job,inc_Take(job));
+}
+
+void ta_parse_Release(TA_context* ctx)
+{
+	if (inc_ctx==ctx)
+		inc_ctx=0;
+}
+
+void ta_parse_init(void)
+{
+	parse_incremental=settings.pvr.ta_incremental!=0;
+	inc_ctx=0;
+}
+
+void ta_parse_term(void)
+{
+	parse_incremental=false;
+	inc_ctx=0;
+}
+#endif
+
+void ta_parse_ListEnd(TA_context* ctx,u8* start,u8* end)
+{
+	if (!parse_incremental || !ctx)
+		return;
+
+	ParseJob job={ctx,start,end,false};
+	inc_Post(job);
+}
+
 /*
 	Also: gotta stage textures here
 */
 bool ta_parse_vdrc(TA_context* ctx)
 {
+	if (parse_incremental)
+	{
+		ta_parse_cnt++;
+
+		if ((ta_parse_cnt %  ( settings.pvr.ta_skip + 1)) == 0)
+		{
+			ParseJob job={ctx,ctx->rend.proc_start,ctx->rend.proc_end,true};
+			inc_Post(job);
+
+			//[0] is the bg poly, FillBGP has set it up already
+			vdec_textures(ctx->rend.global_param_op,1);
+			vdec_textures(ctx->rend.global_param_pt,0);
+			vdec_textures(ctx->rend.global_param_tr,0);
+		}
+		else
+			ta_parse_Release(ctx);
+
+#if !defined(TARGET_NO_THREADS)
+		slock_unlock(ctx->rend_inuse);
+#endif
+		return true;
+	}
+
 	vd_ctx = ctx;
 	vd_rc  = vd_ctx->rend;
 
@@ -1,7 +1,5 @@
 #pragma once
 
-extern u8* vq_codebook;
-extern u32 palette_index;
 extern u32 palette_ram[1024];
 extern bool pal_needs_update,fog_needs_update;
 extern u32 pal_rev_256[4];
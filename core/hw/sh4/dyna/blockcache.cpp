@@ -0,0 +1,251 @@
+/*
+	Persistent cache of decoded blocks.
+
+	Blocks are keyed by their start address and the fpu mode they were
+	decoded with. An entry is only reused if the sha1 of the guest code it
+	was decoded from still matches memory, so stale entries (overlays,
+	self modifying code, a different game build) are simply decoded again.
+
+	Host code is not stored. It embeds absolute pointers (code cache, block
+	links, context) that differ between runs; the backends compile the
+	restored shil as usual.
+*/
+
+#include <map>
+#include "blockcache.h"
+#include "ngen.h"
+#include "hw/sh4/sh4_mem.h"
+#include "deps/crypto/sha1.h"
+
+#if FEAT_SHREC != DYNAREC_NONE
+
+#define BC_MAGIC   0x43424352	//"RCBC"
+#define BC_VERSION 2
+
+struct bc_Header
+{
+	u32 magic;
+	u32 version;
+	u32 config;
+	u32 count;
+};
+
+struct bc_BlockHeader
+{
+	u32 addr;
+	u32 fpu_mode;
+	u32 digest[5];
+
+	u32 sh4_code_size;
+	u32 guest_opcodes;
+	u32 guest_cycles;
+	u32 NextBlock;
+	u32 BranchBlock;
+	u32 BlockType;
+	u32 has_jcond;
+
+	u32 op_count;
+};
+
+struct bc_Block
+{
+	bc_BlockHeader hdr;
+	vector<shil_opcode> oplist;
+};
+
+typedef std::map<u64,bc_Block> bc_Map;
+
+static bc_Map blocks;
+static string cache_file;
+static bool cache_enabled;
+static bool cache_dirty;
+
+//only PR/SZ change the way code is decoded
+static u32 bc_FpuMode(fpscr_t fpu_cfg)
+{
+	return fpu_cfg.PR | (fpu_cfg.SZ<<1);
+}
+
+static u64 bc_Key(u32 addr,u32 fpu_mode)
+{
+	return ((u64)fpu_mode<<32) | addr;
+}
+
+//Everything the decoded output depends on, besides the guest code itself
+static u32 bc_Config()
+{
+	ngen_features features;
+	ngen_GetFeatures(&features);
+
+	u32 rv=sizeof(shil_opcode);
+	rv|=features.OnlyDynamicEnds<<16;
+	rv|=features.InterpreterFallback<<17;
+	rv|=settings.dynarec.idleskip<<18;
+	rv|=settings.dynarec.unstable_opt<<19;
+	rv|=(settings.dynarec.Type&0xF)<<20;
+	rv|=features.Traces<<24;
+
+	return rv;
+}
+
+static bool bc_Digest(u32 addr,u32 size,u32* digest)
+{
+	u8* ptr=GetMemPtr(addr,size);
+
+	if (!ptr || size==0)
+		return false;
+
+	sha1_ctx ctx;
+	sha1_init(&ctx);
+	sha1_update(&ctx,size,ptr);
+	sha1_final(&ctx);
+
+	memcpy(digest,ctx.digest,sizeof(ctx.digest));
+
+	return true;
+}
+
+static void bc_Load()
+{
+	FILE* f=fopen(cache_file.c_str(),"rb");
+
+	if (!f)
+		return;
+
+	bc_Header hdr;
+
+	if (fread(&hdr,sizeof(hdr),1,f)!=1 || hdr.magic!=BC_MAGIC || hdr.version!=BC_VERSION || hdr.config!=bc_Config())
+	{
+		printf("Block cache: %s is stale, ignoring it\n",cache_file.c_str());
+		fclose(f);
+		return;
+	}
+
+	for (u32 i=0;i<hdr.count;i++)
+	{
+		bc_Block blk;
+
+		if (fread(&blk.hdr,sizeof(blk.hdr),1,f)!=1 || blk.hdr.op_count>BLOCK_MAX_SH_OPS_HARD)
+			break;
+
+		blk.oplist.resize(blk.hdr.op_count);
+
+		if (blk.hdr.op_count && fread(&blk.oplist[0],sizeof(shil_opcode),blk.hdr.op_count,f)!=blk.hdr.op_count)
+			break;
+
+		blocks[bc_Key(blk.hdr.addr,blk.hdr.fpu_mode)]=blk;
+	}
+
+	fclose(f);
+
+	printf("Block cache: loaded %d blocks from %s\n",(int)blocks.size(),cache_file.c_str());
+}
+
+static void bc_Save()
+{
+	FILE* f=fopen(cache_file.c_str(),"wb");
+
+	if (!f)
+	{
+		printf("Block cache: failed to write %s\n",cache_file.c_str());
+		return;
+	}
+
+	bc_Header hdr;
+	hdr.magic=BC_MAGIC;
+	hdr.version=BC_VERSION;
+	hdr.config=bc_Config();
+	hdr.count=blocks.size();
+
+	fwrite(&hdr,sizeof(hdr),1,f);
+
+	for (bc_Map::iterator it=blocks.begin();it!=blocks.end();it++)
+	{
+		bc_Block& blk=it->second;
+
+		fwrite(&blk.hdr,sizeof(blk.hdr),1,f);
+		if (blk.hdr.op_count)
+			fwrite(&blk.oplist[0],sizeof(shil_opcode),blk.hdr.op_count,f);
+	}
+
+	fclose(f);
+
+	printf("Block cache: saved %d blocks to %s\n",(int)blocks.size(),cache_file.c_str());
+}
+
+void bc_Init(const string& file)
+{
+	blocks.clear();
+	cache_file=file;
+	cache_enabled=true;
+	cache_dirty=false;
+
+	bc_Load();
+}
+
+void bc_Term()
+{
+	if (cache_enabled && cache_dirty)
+		bc_Save();
+
+	blocks.clear();
+	cache_enabled=false;
+}
+
+bool bc_Restore(RuntimeBlockInfo* blk)
+{
+	if (!cache_enabled)
+		return false;
+
+	bc_Map::iterator it=blocks.find(bc_Key(blk->addr,bc_FpuMode(blk->fpu_cfg)));
+
+	if (it==blocks.end())
+		return false;
+
+	bc_BlockHeader& hdr=it->second.hdr;
+	u32 digest[5];
+
+	if (!bc_Digest(blk->addr,hdr.sh4_code_size,digest) || memcmp(digest,hdr.digest,sizeof(digest))!=0)
+		return false;
+
+	blk->sh4_code_size=hdr.sh4_code_size;
+	blk->guest_opcodes=hdr.guest_opcodes;
+	blk->guest_cycles=hdr.guest_cycles;
+	blk->NextBlock=hdr.NextBlock;
+	blk->BranchBlock=hdr.BranchBlock;
+	blk->BlockType=(BlockEndType)hdr.BlockType;
+	blk->has_jcond=hdr.has_jcond!=0;
+	blk->oplist=it->second.oplist;
+
+	return true;
+}
+
+void bc_Record(RuntimeBlockInfo* blk)
+{
+	if (!cache_enabled)
+		return;
+
+	bc_Block entry;
+	bc_BlockHeader& hdr=entry.hdr;
+
+	//only blocks that live in ram/rom can be validated later
+	if (!bc_Digest(blk->addr,blk->sh4_code_size,hdr.digest))
+		return;
+
+	hdr.addr=blk->addr;
+	hdr.fpu_mode=bc_FpuMode(blk->fpu_cfg);
+	hdr.sh4_code_size=blk->sh4_code_size;
+	hdr.guest_opcodes=blk->guest_opcodes;
+	hdr.guest_cycles=blk->guest_cycles;
+	hdr.NextBlock=blk->NextBlock;
+	hdr.BranchBlock=blk->BranchBlock;
+	hdr.BlockType=blk->BlockType;
+	hdr.has_jcond=blk->has_jcond;
+	hdr.op_count=blk->oplist.size();
+	entry.oplist=blk->oplist;
+
+	blocks[bc_Key(hdr.addr,hdr.fpu_mode)]=entry;
+	cache_dirty=true;
+}
+
+#endif
@@ -0,0 +1,14 @@
+/*
+	Persistent cache of decoded blocks.
+	Keeps the decoded and analysed shil of every block compiled during a
+	session and writes it to disk, so the next session can skip the decoder.
+*/
+#pragma once
+#include "types.h"
+#include "blockmanager.h"
+
+void bc_Init(const string& file);
+void bc_Term();
+
+bool bc_Restore(RuntimeBlockInfo* blk);
+void bc_Record(RuntimeBlockInfo* blk);
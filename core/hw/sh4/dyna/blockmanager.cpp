@@ -22,7 +22,7 @@
 
 typedef vector<RuntimeBlockInfo*> bm_List;
 
-#define BLOCKS_IN_PAGE_LIST_COUNT (RAM_SIZE/4096)
+#define BLOCKS_IN_PAGE_LIST_COUNT (RAM_SIZE/PAGE_SIZE)
 bm_List blocks_page[BLOCKS_IN_PAGE_LIST_COUNT];
 
 bm_List all_blocks;
@@ -111,6 +111,8 @@ RuntimeBlockInfo* bm_GetStaleBlock(void* dynarec_code)
 	return 0;
 }
 
+static void bm_AddBlockPages(RuntimeBlockInfo* blk);
+
 void bm_AddBlock(RuntimeBlockInfo* blk)
 {
 	all_blocks.push_back(blk);
@@ -124,98 +126,271 @@ void bm_AddBlock(RuntimeBlockInfo* blk)
 
    verify((void*)(DynarecCodeEntryPtr)FPCA(blk->addr)==(void*)ngen_FailedToFindBlock);
 	FPCA(blk->addr)=blk->code;
+
+	bm_AddBlockPages(blk);
 }
 
-u32 PAGE_STATE[RAM_SIZE/32];
+//one bit per ram page, set while the page holds translated code and is write protected
+u32 PAGE_STATE[BLOCKS_IN_PAGE_LIST_COUNT/32];
+
+//Pages that keep getting written are left unprotected, and the blocks on them verify their
+//code on entry instead. Only used when the backend supports the checks.
+#define CHECKED_PAGE_WRITES 4
+
+u8 page_writes[BLOCKS_IN_PAGE_LIST_COUNT];
+u32 CHECKED_PAGES[BLOCKS_IN_PAGE_LIST_COUNT/32];
+
+static bool bm_IsCheckedPage(u32 page)
+{
+	return CHECKED_PAGES[page/32]&(1<<(page&31));
+}
 
 bool PageIsConst(u32 addr)
 {
 	if (IsOnRam(addr))
 	{
-		addr&=RAM_MASK;
-		if (addr>0x0010100)
-			return PAGE_STATE[addr/32]&(1<<addr);
+		u32 page=(addr&RAM_MASK)/PAGE_SIZE;
+		return PAGE_STATE[page/32]&(1<<(page&31));
 	}
 
 	return false;
 }
 
-bool UDgreaterX ( RuntimeBlockInfo* elem1, RuntimeBlockInfo* elem2 )
-{	
-	return elem1->runs > elem2->runs;
+//with nvmem ram is mapped 4 times (16mb) or 2 times (32mb) in area 3, all the views are protected
+static u32 bm_RamViews(void)
+{
+	return _nvmem_enabled() ? 0x04000000/RAM_SIZE : 1;
 }
 
-bool UDgreaterLOC ( RuntimeBlockInfo* elem1, RuntimeBlockInfo* elem2 )
-{	
-	return elem1->addr < elem2->addr;
+static void bm_ProtectPage(u32 page, bool lock)
+{
+#if !defined(TARGET_NO_EXCEPTIONS)
+	for (u32 i=0; i<bm_RamViews(); i++)
+		protect_pages(mem_b.data + i*RAM_SIZE + page*PAGE_SIZE, PAGE_SIZE, lock ? ACC_READONLY : ACC_READWRITE);
+#endif
 }
 
-static u32 FindPath(RuntimeBlockInfo* rbi, u32 sa,s32 mc,u32& plc)
+//the ram pages the guest code of the block spans, false if it isn't on ram
+static bool bm_GetBlockPages(RuntimeBlockInfo* blk, u32& start, u32& end)
 {
-   u32 ret = 0;
-	if (mc < 0 || rbi==0)
-		return 0;
+	if (!IsOnRam(blk->addr))
+		return false;
 
-   ret = rbi->guest_cycles;
-	plc++;
-
-   switch (rbi->BlockType)
-   {
-      case BET_Cond_0:
-      case BET_Cond_1:
-         {
-            u32 plc1=plc,plc2=plc,v1=0,v2=0;
-            if (rbi->BranchBlock>sa)
-               v1=FindPath(bm_GetBlock(rbi->BranchBlock),rbi->addr,mc-rbi->guest_cycles,plc1);
-            v2=FindPath(bm_GetBlock(rbi->NextBlock),rbi->addr,mc-rbi->guest_cycles,plc2);
-
-            if (plc1>plc2)
-            {
-               plc=plc1;
-               ret += v1;
-               break;
-            }
-
-            plc=plc2;
-            ret += v2;
-         }
-         break;
-      case BET_StaticJump:
-         if (rbi->BranchBlock>sa)
-            return rbi->guest_cycles+FindPath(bm_GetBlock(rbi->BranchBlock),rbi->addr,mc-rbi->guest_cycles,plc);
-         break;
-      default:
-#ifndef NDEBUG
-         if (plc!=1)
-            printf("Chain lost due to %d\n",rbi->BlockType);
-         else
-            printf("Chain fail due to %d\n",rbi->BlockType);
-#endif
-         break;
-   }
+	u32 size=blk->sh4_code_size ? blk->sh4_code_size : 2;
+
+	start=(blk->addr&RAM_MASK)/PAGE_SIZE;
+	end=std::min(((blk->addr&RAM_MASK) + size - 1)/PAGE_SIZE, (u32)BLOCKS_IN_PAGE_LIST_COUNT - 1);
+
+	return true;
+}
+
+static void bm_AddBlockPages(RuntimeBlockInfo* blk)
+{
+	u32 start,end;
+
+	if (!bm_GetBlockPages(blk,start,end))
+		return;
+
+	for (u32 page=start; page<=end; page++)
+	{
+		blocks_page[page].push_back(blk);
+
+		if (!bm_IsCheckedPage(page) && !(PAGE_STATE[page/32]&(1<<(page&31))))
+		{
+			PAGE_STATE[page/32]|=1<<(page&31);
+			bm_ProtectPage(page, true);
+		}
+	}
+}
 
-   return ret;
+//Unlinks the block from the graph and drops it from the lookup structures, except all_blocks
+static void bm_UnlinkBlock(RuntimeBlockInfo* blk)
+{
+	blk->Discard();
+
+	ngen_DiscardBlock(blk);
+
+	if (FPCA(blk->addr)==blk->code)
+		FPCA(blk->addr)=ngen_FailedToFindBlock;
+
+	blkmap.erase(blk);
+
+	u32 start,end;
+
+	if (bm_GetBlockPages(blk,start,end))
+	{
+		for (u32 page=start; page<=end; page++)
+		{
+			bm_List& list=blocks_page[page];
+			list.erase(std::remove(list.begin(),list.end(),blk),list.end());
+		}
+	}
+}
+
+//Unlinks the block and queues it for deletion. Its code stays in the cache, it may still be running.
+static void bm_DiscardBlock(RuntimeBlockInfo* blk)
+{
+	bm_UnlinkBlock(blk);
+
+	all_blocks.erase(find(all_blocks.begin(),all_blocks.end(),blk));
+	del_blocks.push_back(blk);
 }
 
-u32 total_saved;
+void bm_DiscardPage(u32 page)
+{
+	verify(page<BLOCKS_IN_PAGE_LIST_COUNT);
+
+	bm_List list=blocks_page[page];
 
-static void FindPath(u32 start)
+	for (size_t i=0; i<list.size(); i++)
+		bm_DiscardBlock(list[i]);
+
+	blocks_page[page].clear();
+
+	if (PAGE_STATE[page/32]&(1<<(page&31)))
+	{
+		PAGE_STATE[page/32]&=~(1<<(page&31));
+		bm_ProtectPage(page, false);
+	}
+}
+
+//discards the blocks on the ram pages covered by the block at addr
+void bm_DiscardAddress(u32 addr)
 {
-	RuntimeBlockInfo* rbi=bm_GetBlock(start);
+	RuntimeBlockInfo* blk=bm_GetBlock(addr);
+	u32 start,end;
 
-	if (!rbi || !rbi->runs)
+	if (!blk)
+	{
+		if (!IsOnRam(addr))
+			return;
+		start=end=(addr&RAM_MASK)/PAGE_SIZE;
+	}
+	else if (!bm_GetBlockPages(blk,start,end))
 		return;
 
-	u32 plen=0;
-	u32 pclc=FindPath(rbi,start,SH4_TIMESLICE,plen);
-#ifndef NDEBUG
-	if (plen>1)
+	for (u32 page=start; page<=end; page++)
+		bm_DiscardPage(page);
+}
+
+//Called from the fault handler, a write hit a ram page holding translated code
+bool bm_RamLockedWrite(u8* address)
+{
+	size_t offset=address-mem_b.data;
+
+	if (mem_b.data==0 || offset>=(size_t)RAM_SIZE*bm_RamViews())
+		return false;
+
+	u32 page=(offset&RAM_MASK)/PAGE_SIZE;
+
+	if (!(PAGE_STATE[page/32]&(1<<(page&31))))
+		return false;
+
+	bm_DiscardPage(page);
+
+	ngen_features ngen;
+	ngen_GetFeatures(&ngen);
+
+	if (ngen.CodeChecks && ++page_writes[page]>=CHECKED_PAGE_WRITES)
+		CHECKED_PAGES[page/32]|=1<<(page&31);
+
+	return true;
+}
+
+//true if the block has code on a page that relies on checks, it must be compiled with them
+bool bm_HasCheckedPages(RuntimeBlockInfo* blk)
+{
+	u32 start,end;
+
+	if (!bm_GetBlockPages(blk,start,end))
+		return false;
+
+	for (u32 page=start; page<=end; page++)
+		if (bm_IsCheckedPage(page))
+			return true;
+
+	return false;
+}
+
+//Swaps a block for a new compilation of it, the static links to the old one now go to the new one
+void bm_ReplaceBlock(RuntimeBlockInfo* old, RuntimeBlockInfo* blk)
+{
+	bm_List preds=old->pre_refs;
+
+	bm_DiscardBlock(old);
+	bm_AddBlock(blk);
+
+	for (size_t i=0; i<preds.size(); i++)
 	{
-		total_saved+=(plen-1)*2*rbi->runs;
-		printf("%08X: %d, %d, %.2f, %.2f\n",start,pclc,plen,pclc/(float)plen,plen*2*rbi->runs/1000.f);
+		RuntimeBlockInfo* pre=preds[i];
+
+		if (pre==old || BET_GET_CLS(pre->BlockType)==BET_CLS_Dynamic)
+			continue;
+
+		if (pre->BranchBlock==blk->addr)
+			pre->pBranchBlock=blk;
+		if (pre->NextBlock==blk->addr)
+			pre->pNextBlock=blk;
+
+		blk->AddRef(pre);
+		pre->Relink();
 	}
-#endif
-	rbi->runs=0;
+}
+
+static bool bm_CodeInRange(RuntimeBlockInfo* blk, u8* start, u8* end)
+{
+	return (u8*)blk->code>=start && (u8*)blk->code<end;
+}
+
+//Evicts all the blocks with code in [start,end), so that part of the cache can be reused.
+//The ones that ran at least hot_runs times are not deleted but returned in hot, unlinked,
+//for the caller to compile again and then delete.
+void bm_EvictBlocks(u8* start, u8* end, u32 hot_runs, vector<RuntimeBlockInfo*>& hot)
+{
+	bm_List evicted;
+	size_t kept=0;
+
+	for (size_t i=0; i<all_blocks.size(); i++)
+	{
+		if (bm_CodeInRange(all_blocks[i],start,end))
+			evicted.push_back(all_blocks[i]);
+		else
+			all_blocks[kept++]=all_blocks[i];
+	}
+	all_blocks.resize(kept);
+
+	for (size_t i=0; i<evicted.size(); i++)
+	{
+		RuntimeBlockInfo* blk=evicted[i];
+
+		bm_UnlinkBlock(blk);
+
+		if (blk->runs>=hot_runs)
+			hot.push_back(blk);
+		else
+			delete blk;
+	}
+
+	//stale blocks there can't be looked up anymore either, their code is about to be replaced
+	kept=0;
+	for (size_t i=0; i<del_blocks.size(); i++)
+	{
+		if (bm_CodeInRange(del_blocks[i],start,end))
+			delete del_blocks[i];
+		else
+			del_blocks[kept++]=del_blocks[i];
+	}
+	del_blocks.resize(kept);
+}
+
+bool UDgreaterX ( RuntimeBlockInfo* elem1, RuntimeBlockInfo* elem2 )
+{	
+	return elem1->runs > elem2->runs;
+}
+
+bool UDgreaterLOC ( RuntimeBlockInfo* elem1, RuntimeBlockInfo* elem2 )
+{	
+	return elem1->addr < elem2->addr;
 }
 
 #include <map>
@@ -278,8 +453,15 @@ void bm_Reset(void)
 {
 	ngen_ResetBlocks();
 	for (u32 i=0; i<BLOCKS_IN_PAGE_LIST_COUNT; i++)
+	{
 		blocks_page[i].clear();
 
+		if (PAGE_STATE[i/32]&(1<<(i&31)))
+			bm_ProtectPage(i, false);
+	}
+
+	memset(PAGE_STATE,0,sizeof(PAGE_STATE));
+
 	_vmem_bm_reset();
 
 	for (size_t i=0; i<all_blocks.size(); i++)
@@ -449,6 +631,39 @@ void RuntimeBlockInfo::RemRef(RuntimeBlockInfo* other)
 	pre_refs.erase(find(pre_refs.begin(),pre_refs.end(),other)); 
 }
 
+//unlinks the predecessors, they go back to their link stubs, and drops the references this
+//block holds on its successors
+void RuntimeBlockInfo::Discard()
+{
+	for (size_t i=0; i<pre_refs.size(); i++)
+	{
+		RuntimeBlockInfo* pre=pre_refs[i];
+
+		if (pre==this)
+			continue;
+
+		if (pre->pBranchBlock==this)
+			pre->pBranchBlock=0;
+		if (pre->pNextBlock==this)
+			pre->pNextBlock=0;
+
+		pre->relink_data=0;
+		pre->Relink();
+	}
+	pre_refs.clear();
+
+	RuntimeBlockInfo* succ[2]={pBranchBlock,pNextBlock};
+	for (int i=0; i<2; i++)
+	{
+		if (succ[i] && succ[i]!=this)
+			succ[i]->pre_refs.erase(std::remove(succ[i]->pre_refs.begin(),succ[i]->pre_refs.end(),this),succ[i]->pre_refs.end());
+	}
+
+	pBranchBlock=pNextBlock=0;
+	relink_data=0;
+	Relink();
+}
+
 bool print_stats;
 
 void fprint_hex(FILE* d,const char* init,u8* ptr, u32& ofs, u32 limit)
@@ -7,6 +7,9 @@
 
 typedef void (*DynarecCodeEntryPtr)();
 
+//runs of a staging block before it gets compiled again with all the optimisations
+#define STAGING_RUNS 100
+
 struct RuntimeBlockInfo_Core
 {
 	u32 addr;
@@ -16,7 +19,7 @@ struct RuntimeBlockInfo_Core
 
 struct RuntimeBlockInfo: RuntimeBlockInfo_Core
 {
-	void Setup(u32 pc,fpscr_t fpu_cfg);
+	void Setup(u32 pc,fpscr_t fpu_cfg,bool staging=false,bool trace=false);
 	const char* hash(bool full=true, bool reloc=false);
 
 	u32 host_code_size;	   /* in bytes */
@@ -24,6 +27,7 @@ struct RuntimeBlockInfo: RuntimeBlockInfo_Core
 
 	u32 runs;
 	s32 staging_runs;
+	u32 taken;	/* conditional ends taken while staging */
 
 	fpscr_t fpu_cfg;
 	u32 guest_cycles;
@@ -89,6 +93,12 @@ RuntimeBlockInfo* bm_GetStaleBlock(void* dynarec_code);
 RuntimeBlockInfo* DYNACALL bm_GetBlock(u32 addr);
 
 void bm_AddBlock(RuntimeBlockInfo* blk);
+void bm_DiscardPage(u32 page);
+void bm_DiscardAddress(u32 addr);
+void bm_ReplaceBlock(RuntimeBlockInfo* old, RuntimeBlockInfo* blk);
+void bm_EvictBlocks(u8* start, u8* end, u32 hot_runs, vector<RuntimeBlockInfo*>& hot);
+bool bm_RamLockedWrite(u8* address);
+bool bm_HasCheckedPages(RuntimeBlockInfo* blk);
 void bm_Reset();
 void bm_Periodical_1s();
 void bm_Periodical_14k();
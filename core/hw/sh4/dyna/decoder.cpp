@@ -15,9 +15,6 @@
 #include "hw/sh4/sh4_mem.h"
 #include "decoder_opcodes.h"
 
-#define BLOCK_MAX_SH_OPS_SOFT 500
-#define BLOCK_MAX_SH_OPS_HARD 511
-
 RuntimeBlockInfo* blk;
 
 const char idle_hash[] = 
@@ -105,6 +102,14 @@ struct
       bool has_fpu;
    } info;
 
+   struct
+   {
+      bool enabled;
+      u32 start;  //start of the current segment
+      u32 exits;
+      u32 skip;   //bytes jumped over
+   } trace;
+
    void Setup(u32 rpc,fpscr_t fpu_cfg)
    {
       cpu.rpc=rpc;
@@ -202,6 +207,102 @@ static void dec_End(u32 dst,BlockEndType flags,bool delay)
 	state.NextAddr=state.cpu.rpc+2+(delay?2:0);
 }
 
+//Traces follow the likely way out of a block, as profiled by its staging block, and keep
+//decoding there. The other way leaves through a jexit side exit. Only forward jumps are
+//followed, so the guest code of a trace is still one range for the page tracking and checks.
+#define TRACE_MAX_EXITS 8
+#define TRACE_MAX_SKIP 512
+#define TRACE_MIN_RUNS 16
+#define TRACE_BIAS 90
+
+static bool dec_TraceForward(u32 target)
+{
+	return target>state.cpu.rpc && target-state.cpu.rpc<=TRACE_MAX_SKIP-state.trace.skip;
+}
+
+//how the branch that ends the current segment went while its block was staging
+static bool dec_TraceProfile(u32& ran,u32& taken)
+{
+	RuntimeBlockInfo* prof=bm_GetBlock(state.trace.start);
+
+	if (!prof || prof->staging_runs<0 || prof->BlockType!=state.BlockType
+		|| prof->BranchBlock!=state.JumpAddr || prof->NextBlock!=state.NextAddr)
+		return false;
+
+	//the run that promotes the block leaves before reaching the branch
+	ran=STAGING_RUNS-prof->staging_runs-(prof->staging_runs==0?1:0);
+	taken=prof->taken;
+
+	return ran>=TRACE_MIN_RUNS;
+}
+
+//continues decoding past the end of the current segment, false if the block ends there
+static bool dec_TraceNext(u32 max_cycles)
+{
+	if (!state.trace.enabled || state.trace.exits>=TRACE_MAX_EXITS
+		|| blk->oplist.size()>=BLOCK_MAX_SH_OPS_SOFT || blk->guest_cycles>=max_cycles)
+		return false;
+
+	u32 next;
+
+	switch(state.BlockType)
+	{
+	case BET_StaticJump:
+		//fpscr changes and the size limits end with a jump to the next opcode, which isn't followed
+		if (!dec_TraceForward(state.JumpAddr))
+			return false;
+
+		next=state.JumpAddr;
+		break;
+
+	case BET_Cond_0:
+	case BET_Cond_1:
+		{
+			u32 ran,taken;
+
+			if (!dec_TraceProfile(ran,taken))
+				return false;
+
+			//delayed branches keep the condition from before the delay slot in pc_dyn
+			shil_param cond=mk_reg(blk->has_jcond?reg_pc_dyn:reg_sr_T);
+			u32 branch_on=state.BlockType&1;
+
+			//the exits store the cycles spent so far, they become a refund once the block is decoded
+			if (taken*100>=ran*TRACE_BIAS && dec_TraceForward(state.JumpAddr))
+			{
+				Emit(shop_jexit,shil_param(),cond,mk_imm(branch_on^1),blk->guest_cycles,mk_imm(state.NextAddr));
+				next=state.JumpAddr;
+			}
+			else if ((ran-taken)*100>=ran*TRACE_BIAS)
+			{
+				Emit(shop_jexit,shil_param(),cond,mk_imm(branch_on),blk->guest_cycles,mk_imm(state.JumpAddr));
+				next=state.NextAddr;
+			}
+			else
+				return false;
+
+			blk->has_jcond=false;
+			state.trace.exits++;
+		}
+		break;
+
+	default:
+		return false;
+	}
+
+	state.trace.skip+=next-state.cpu.rpc;
+	state.trace.start=next;
+
+	state.cpu.rpc=next;
+	state.cpu.is_delayslot=false;
+	state.NextOp=NDO_NextOp;
+	state.BlockType=BET_SCL_Intr;
+	state.JumpAddr=0xFFFFFFFF;
+	state.NextAddr=0xFFFFFFFF;
+
+	return true;
+}
+
 #define GetN(str) ((str>>8) & 0xf)
 #define GetM(str) ((str>>4) & 0xf)
 #define GetImm4(str) ((str>>0) & 0xf)
@@ -1007,11 +1108,16 @@ static bool dec_generic(u32 op)
 	return true;
 }
 
-void dec_DecodeBlock(RuntimeBlockInfo* rbi,u32 max_cycles)
+void dec_DecodeBlock(RuntimeBlockInfo* rbi,u32 max_cycles,bool trace)
 {
 	blk=rbi;
 	state.Setup(blk->addr,blk->fpu_cfg);
 	ngen_GetFeatures(&state.ngen);
+
+	state.trace.enabled=trace && state.ngen.Traces && !state.ngen.OnlyDynamicEnds;
+	state.trace.start=blk->addr;
+	state.trace.exits=0;
+	state.trace.skip=0;
 	
 	blk->guest_opcodes=0;
 	
@@ -1081,6 +1187,8 @@ void dec_DecodeBlock(RuntimeBlockInfo* rbi,u32 max_cycles)
 			break;
 
 		case NDO_End:
+			if (dec_TraceNext(max_cycles))
+				break;
 			goto _end;
 		}
 	}
@@ -1106,6 +1214,8 @@ _end:
    }
 #endif
 
+	u32 trace_cycles=blk->guest_cycles;
+
 	//cycle tricks
 	if (settings.dynarec.idleskip)
 	{
@@ -1158,6 +1268,15 @@ _end:
 	blk->guest_cycles=min(blk->guest_cycles,max_cycles);
 	//make sure we don't use wayy-too-few cycles
 	blk->guest_cycles=max(1U,blk->guest_cycles);
+
+	//side exits give back the share of the cycles of the part of the trace they skip
+	for (size_t i=0;i<blk->oplist.size();i++)
+	{
+		shil_opcode& op=blk->oplist[i];
+
+		if (op.op==shop_jexit)
+			op.flags=(u64)blk->guest_cycles*(trace_cycles-op.flags)/trace_cycles;
+	}
 	blk=0;
 }
 
@@ -2,6 +2,9 @@
 #include "shil.h"
 #include "../sh4_if.h"
 
+#define BLOCK_MAX_SH_OPS_SOFT 500
+#define BLOCK_MAX_SH_OPS_HARD 511
+
 #define mkbet(c,s,v) ((c<<3)|(s<<1)|v)
 #define BET_GET_CLS(x) (x>>3)
 
@@ -31,5 +34,5 @@ enum BlockEndType
 };
 
 struct RuntimeBlockInfo;
-void dec_DecodeBlock(RuntimeBlockInfo* rbi,u32 max_cycles);
+void dec_DecodeBlock(RuntimeBlockInfo* rbi,u32 max_cycles,bool trace=false);
 
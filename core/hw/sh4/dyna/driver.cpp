@@ -24,6 +24,7 @@
 #include <float.h>
 
 #include "blockmanager.h"
+#include "blockcache.h"
 #include "ngen.h"
 #include "decoder.h"
 
@@ -48,8 +49,43 @@ u8* CodeCache;
 
 u32 LastAddr;
 u32 LastAddr_min;
+u32 LastAddr_max=CODE_SIZE;
 u32* emit_ptr=0;
 
+//When the backend can evict blocks the cache is used as a ring of segments. Once the current
+//segment is full the next one is recycled: its blocks are evicted, and the ones that ran at
+//least HOT_BLOCK_RUNS times since they were compiled are compiled again at its start.
+#define CODE_SEGMENTS 16
+#define HOT_BLOCK_RUNS 1024
+
+static u32 code_segment;
+//bumped on every eviction, blocks compiled before that may be gone
+static u32 code_evictions;
+
+static u32 emit_SegmentSize(void)
+{
+	return ((CODE_SIZE-LastAddr_min)/CODE_SEGMENTS)&~4095;
+}
+
+static void emit_SetSegment(u32 segment)
+{
+	ngen_features ngen;
+	ngen_GetFeatures(&ngen);
+
+	code_segment=segment;
+
+	if (ngen.BlockEviction)
+	{
+		LastAddr=LastAddr_min+segment*emit_SegmentSize();
+		LastAddr_max=LastAddr+emit_SegmentSize();
+	}
+	else
+	{
+		LastAddr=LastAddr_min;
+		LastAddr_max=CODE_SIZE;
+	}
+}
+
 void* emit_GetCCPtr(void)
 {
    if (emit_ptr)
@@ -60,6 +96,7 @@ void* emit_GetCCPtr(void)
 void emit_SetBaseAddr(void)
 {
    LastAddr_min = LastAddr;
+   emit_SetSegment(0);
 }
 
 void RASDASD()
@@ -70,7 +107,7 @@ void RASDASD()
 
 static void recSh4_ClearCache(void)
 {
-	LastAddr=LastAddr_min;
+	emit_SetSegment(0);
 	bm_Reset();
 
 	printf("recSh4:Dynarec Cache clear at %08X\n",curr_pc);
@@ -84,6 +121,13 @@ static void ngen_mainloop(void* v_cntx)
 {
 	Sh4RCB* ctx = (Sh4RCB*)((u8*)v_cntx - sizeof(Sh4RCB));
 
+   //the native dynarec links its blocks and has its own dispatcher
+   if (settings.dynarec.Type == 0)
+   {
+      ngen_mainloop_x64(v_cntx);
+      return;
+   }
+
    while (inside_loop)
    {
       cycle_counter = SH4_TIMESLICE;
@@ -129,7 +173,7 @@ void emit_Skip(u32 sz)
 }
 u32 emit_FreeSpace()
 {
-	return CODE_SIZE-LastAddr;
+	return LastAddr_max-LastAddr;
 }
 
 
@@ -207,9 +251,9 @@ const char* RuntimeBlockInfo::hash(bool full, bool relocable)
 	return block_hash;
 }
 
-void RuntimeBlockInfo::Setup(u32 rpc,fpscr_t rfpu_cfg)
+void RuntimeBlockInfo::Setup(u32 rpc,fpscr_t rfpu_cfg,bool staging,bool trace)
 {
-	staging_runs=addr=lookups=runs=host_code_size=0;
+	staging_runs=addr=lookups=runs=taken=host_code_size=0;
 	guest_cycles=guest_opcodes=host_opcodes=0;
 	pBranchBlock=pNextBlock=0;
 	code=0;
@@ -222,33 +266,102 @@ void RuntimeBlockInfo::Setup(u32 rpc,fpscr_t rfpu_cfg)
 	
 	oplist.clear();
 
-	dec_DecodeBlock(this,SH4_TIMESLICE/2);
-	AnalyseBlock(this);
+	//blocks found in the cache have been analysed already, they skip staging
+	if (bc_Restore(this))
+		staging=false;
+	else
+	{
+		dec_DecodeBlock(this,SH4_TIMESLICE/2,trace && !staging);
+
+		if (!staging)
+		{
+			AnalyseBlock(this);
+			bc_Record(this);
+		}
+	}
+
+	staging_runs=staging?STAGING_RUNS:-1;
+}
+
+static RuntimeBlockInfo* rdv_BuildBlock(u32 pc,fpscr_t fpu_cfg,bool staging)
+{
+	RuntimeBlockInfo* rbi = ngen_AllocateBlock();
+
+	bool do_opts=((pc&0x3FFFFFFF)>0x0C010100);
+	rbi->Setup(pc,fpu_cfg,staging && do_opts,do_opts);
+
+	bool force_checks=DoCheck(rbi->addr) || bm_HasCheckedPages(rbi);
+	ngen_Compile(rbi,force_checks,(pc&0xFFFFFF)==0x08300 || (pc&0xFFFFFF)==0x10000,rbi->staging_runs>0,do_opts);
+	verify(rbi->code!=0);
+
+	return rbi;
+}
+
+static RuntimeBlockInfo* rdv_CompileBlock(u32 pc,fpscr_t fpu_cfg,bool staging)
+{
+	RuntimeBlockInfo* rbi = rdv_BuildBlock(pc,fpu_cfg,staging);
+
+	bm_AddBlock(rbi);
+
+	return rbi;
+}
+
+//Moves on to the next segment of the cache, evicting the blocks that were there
+static void rdv_RecycleSegment(void)
+{
+	u32 segment=(code_segment+1)%CODE_SEGMENTS;
+	u8* start=CodeCache+LastAddr_min+segment*emit_SegmentSize();
+
+	vector<RuntimeBlockInfo*> hot;
+	bm_EvictBlocks(start,start+emit_SegmentSize(),HOT_BLOCK_RUNS,hot);
+	code_evictions++;
+
+	emit_SetSegment(segment);
+
+	//keep at least half of the segment for new code
+	for (size_t i=0; i<hot.size(); i++)
+	{
+		if (emit_FreeSpace()>=emit_SegmentSize()/2 && FPCA(hot[i]->addr)==ngen_FailedToFindBlock)
+			rdv_CompileBlock(hot[i]->addr,hot[i]->fpu_cfg,false);
+
+		delete hot[i];
+	}
+}
+
+//makes sure there is room for one more block
+static void rdv_ReserveSpace(void)
+{
+	if (emit_FreeSpace()<CODE_BLOCK_MAX)
+	{
+		ngen_features ngen;
+		ngen_GetFeatures(&ngen);
+
+		if (ngen.BlockEviction)
+			rdv_RecycleSegment();
+		else
+			recSh4_ClearCache();
+	}
 }
 
 DynarecCodeEntryPtr rdv_CompilePC(void)
 {
 	u32 pc=next_pc;
 
-	if (emit_FreeSpace()<16*1024 || pc==0x8c0000e0 || pc==0xac010000 || pc==0xac008300)
+	if (pc==0x8c0000e0 || pc==0xac010000 || pc==0xac008300)
 		recSh4_ClearCache();
+	else
+		rdv_ReserveSpace();
+
+	ngen_features ngen;
+	ngen_GetFeatures(&ngen);
 
 	RuntimeBlockInfo* rv=0;
 	do
 	{
-		RuntimeBlockInfo* rbi = ngen_AllocateBlock();
+		RuntimeBlockInfo* rbi = rdv_CompileBlock(pc,fpscr,ngen.Staging);
 		if (rv==0)
          rv=rbi;
 
-		rbi->Setup(pc,fpscr);
-
-		bool do_opts=((rbi->addr&0x3FFFFFFF)>0x0C010100);
-		rbi->staging_runs=do_opts?100:-100;
-		ngen_Compile(rbi,DoCheck(rbi->addr),(pc&0xFFFFFF)==0x08300 || (pc&0xFFFFFF)==0x10000,false,do_opts);
-		verify(rbi->code!=0);
-
-		bm_AddBlock(rbi);
-
       switch (rbi->BlockType)
       {
          case BET_Cond_0:
@@ -264,6 +377,23 @@ DynarecCodeEntryPtr rdv_CompilePC(void)
 	return rv->code;
 }
 
+DynarecCodeEntryPtr DYNACALL rdv_PromoteBlock(u32 pc)
+{
+	next_pc=pc;
+
+	rdv_ReserveSpace();
+
+	//making room may have evicted the block
+	RuntimeBlockInfo* old=bm_GetBlock(pc);
+	if (!old || old->staging_runs!=0)
+		return rdv_FindOrCompile();
+
+	RuntimeBlockInfo* rbi=rdv_BuildBlock(pc,old->fpu_cfg,false);
+	bm_ReplaceBlock(old,rbi);
+
+	return rbi->code;
+}
+
 DynarecCodeEntryPtr DYNACALL rdv_FailedToFindBlock(u32 pc)
 {
 	//printf("rdv_FailedToFindBlock ~ %08X\n",pc);
@@ -287,13 +417,18 @@ void bm_Rebuild();
 u32 DYNACALL rdv_DoInterrupts(void* block_cpde)
 {
 	RuntimeBlockInfo* rbi = bm_GetBlock2(block_cpde);
+
+	//the block may have been discarded by a write while updating the system
+	if (!rbi)
+		rbi = bm_GetStaleBlock(block_cpde);
+
 	return rdv_DoInterrupts_pc(rbi->addr);
 }
 
 DynarecCodeEntryPtr DYNACALL rdv_BlockCheckFail(u32 pc)
 {
 	next_pc=pc;
-	recSh4_ClearCache();
+	bm_DiscardAddress(pc);
 	return rdv_CompilePC();
 }
 
@@ -345,8 +480,13 @@ void* DYNACALL rdv_LinkBlock(u8* code,u32 dpc)
          break;
    }
 
+	u32 evictions=code_evictions;
 	DynarecCodeEntryPtr rv=rdv_FindOrCompile();
 
+	//the block may have been evicted and its code replaced while compiling
+	if (evictions != code_evictions)
+		return (void*)rv;
+
 	if (bm_GetBlock2(code) != rbi)
    {
       printf(" .. null RBI: %08X -- unlinked stale block\n",next_pc);
@@ -465,6 +605,7 @@ static void recSh4_Init(void)
 static void recSh4_Term(void)
 {
 	printf("recSh4 Term\n");
+	bc_Term();
 	bm_Term();
 	Sh4_int_Term();
 }
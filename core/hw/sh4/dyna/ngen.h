@@ -47,6 +47,8 @@
 
 
 #define CODE_SIZE   (16*1024*1024)
+//a single block never takes more than this, it's also the free space needed to compile one
+#define CODE_BLOCK_MAX (64*1024)
 #define FPCA(x) reinterpret_cast<DynarecCodeEntryPtr&>(sh4rcb.fpcb[((x)>>1)&FPCB_MASK])
 
 //alternative emit ptr, set to 0 to use the main buffer
@@ -69,6 +71,8 @@ DynarecCodeEntryPtr DYNACALL rdv_FailedToFindBlock(u32 pc);
 DynarecCodeEntryPtr DYNACALL rdv_BlockCheckFail(u32 pc);
 //Called to compile code @pc
 DynarecCodeEntryPtr rdv_CompilePC();
+//Called when a staging block ran STAGING_RUNS times, compiles it again with all the optimisations
+DynarecCodeEntryPtr DYNACALL rdv_PromoteBlock(u32 pc);
 //Returns 0 if there is no code @pc, code ptr otherwise
 DynarecCodeEntryPtr rdv_FindCode();
 //Finds or compiles code @pc
@@ -84,16 +88,21 @@ u32 DYNACALL rdv_DoInterrupts_pc(u32 pc);
 
 void ngen_init();
 
-//Called to compile a block
+//Called to compile a block. Staging blocks are quick to compile, they skip the shil analysis
+//and most of the backend optimisations and count down staging_runs at entry.
 void ngen_Compile(RuntimeBlockInfo* block,bool force_checks, bool reset, bool staging,bool optimise);
 
 //Called when blocks are reseted
 void ngen_ResetBlocks();
+//Called when a single block is discarded, the backend must drop any pointers into its code
+void ngen_DiscardBlock(RuntimeBlockInfo* block);
 //Value to be returned when the block manager failed to find a block,
 //should call rdv_FailedToFindBlock and then jump to the return value
 extern void (*ngen_FailedToFindBlock)();
 
 #if (FEAT_SHREC == DYNAREC_JIT && HOST_CPU == CPU_X64)
+//the x64 dispatcher, generated at ngen_init
+void ngen_mainloop_x64(void* cntx);
 #else
 //the dynarec mainloop
 void ngen_mainloop(void* cntx);
@@ -104,6 +113,10 @@ struct ngen_features
 {
 	bool OnlyDynamicEnds;     //if set the block endings aren't handled natively and only Dynamic block end type is used
 	bool InterpreterFallback; //if set all the non-branch opcodes are handled with the ifb opcode
+	bool CodeChecks;          //if set blocks compiled with force_checks verify their code, so their pages need no protection
+	bool BlockEviction;       //if set blocks count their runs and can be evicted from the cache one segment at a time
+	bool Staging;             //if set new blocks are compiled with staging, and call rdv_PromoteBlock once they are hot
+	bool Traces;              //if set optimised blocks may follow their likely branches, leaving through jexit side exits
 };
 
 void ngen_GetFeatures(ngen_features* dst);
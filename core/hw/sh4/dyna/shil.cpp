@@ -96,7 +96,7 @@ static void sq_pref(RuntimeBlockInfo* blk, int i, Sh4RegType rt, bool mark)
 				break;
 		}
 
-		if (blk->oplist[c].op==shop_pref || (blk->oplist[c].rd.is_reg() && blk->oplist[c].rd._reg==rt && blk->oplist[c].op!= shop_sub))
+		if (blk->oplist[c].op==shop_pref || blk->oplist[c].op==shop_jexit || (blk->oplist[c].rd.is_reg() && blk->oplist[c].rd._reg==rt && blk->oplist[c].op!= shop_sub))
 			break;
 
 		if (data==32)
@@ -847,7 +847,7 @@ static void srt_waw(RuntimeBlockInfo* blk)
 			if ((op->rs1.is_reg() && op->rs1._reg==reg_sr_T)
 				|| (op->rs2.is_reg() && op->rs2._reg==reg_sr_T)
 				|| (op->rs3.is_reg() && op->rs3._reg==reg_sr_T)
-				|| op->op==shop_ifb)
+				|| op->op==shop_ifb || op->op==shop_jexit)
 			{
 				found=false;
 			}
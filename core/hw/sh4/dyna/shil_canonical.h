@@ -192,6 +192,11 @@ shil_opc(jcond)
 shil_recimp()
 shil_opc_end()
 
+//leaves a trace when rs1==rs2, to the pc in rs3
+shil_opc(jexit)
+shil_recimp()
+shil_opc_end()
+
 //shop_ifb
 shil_opc(ifb)
 shil_recimp()
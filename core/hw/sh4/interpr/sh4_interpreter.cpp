@@ -20,6 +20,7 @@
 #include "../modules/ccn.h"
 #include "../dyna/blockmanager.h"
 #include "../sh4_sched.h"
+#include "hw/mem/_vmem.h"
 
 #include <time.h>
 #include <float.h>
@@ -47,16 +48,181 @@ int UpdateSystem_INTC(void)
 	return UpdateINTC();
 }
 
+/*
+	Decoded opcode cache
+
+	One line per 4k ram page, holding the handler and opcode of every
+	instruction on it, filled on first execution. Only used with the mmu
+	off, when the physical page is known from the pc.
+
+	Write tracking works like the dynarec's: pages with decoded opcodes are
+	write protected and the fault handler clears their line. Pages that
+	keep getting written are left unprotected and verify the opcode on
+	every fetch instead, as does everything when there are no exceptions.
+*/
+#define IC_PAGES (RAM_SIZE/PAGE_SIZE)
+#define IC_LINE_OPS (PAGE_SIZE/2)
+#define IC_MAX_LINES 512
+#define IC_CHECKED_WRITES 4
+
+struct ic_Entry
+{
+	OpCallFP* oph;
+	u32 op;
+};
+
+static ic_Entry* ic_lines[IC_PAGES];
+static u32 ic_line_count;
+
+static u8 ic_locked[IC_PAGES];
+static u8 ic_writes[IC_PAGES];
+static u8 ic_checked[IC_PAGES];
+
+#if defined(TARGET_NO_EXCEPTIONS)
+#define ic_IsChecked(page) true
+#else
+#define ic_IsChecked(page) (ic_checked[page]!=0)
+#endif
+
+//with nvmem ram is mapped 4 times (16mb) or 2 times (32mb) in area 3, all the views are protected
+static u32 ic_RamViews(void)
+{
+	return _nvmem_enabled() ? 0x04000000/RAM_SIZE : 1;
+}
+
+static void ic_ProtectPage(u32 page, bool lock)
+{
+#if !defined(TARGET_NO_EXCEPTIONS)
+	for (u32 i=0; i<ic_RamViews(); i++)
+		protect_pages(mem_b.data + i*RAM_SIZE + page*PAGE_SIZE, PAGE_SIZE, lock ? ACC_READONLY : ACC_READWRITE);
+#endif
+}
+
+//same test as IsOnRam
+static INLINE bool ic_IsOnRam(u32 addr)
+{
+	return ((addr>>26)&7)==3 && (addr>>29)!=7 && (addr>>29)!=3;
+}
+
+//Frees the lines. Can't run while opcodes from a line are executing.
+static void ic_FreeLines(void)
+{
+	for (u32 page=0; page<IC_PAGES; page++)
+	{
+		free(ic_lines[page]);
+		ic_lines[page]=0;
+
+		if (ic_locked[page])
+		{
+			ic_locked[page]=0;
+			ic_ProtectPage(page, false);
+		}
+	}
+
+	ic_line_count=0;
+}
+
+static void ic_Reset(void)
+{
+	ic_FreeLines();
+
+	memset(ic_writes,0,sizeof(ic_writes));
+	memset(ic_checked,0,sizeof(ic_checked));
+}
+
+static ic_Entry* ic_GetLine(u32 page)
+{
+	ic_Entry* line=ic_lines[page];
+
+	if (unlikely(!line))
+	{
+		if (ic_line_count>=IC_MAX_LINES)
+			ic_FreeLines();
+
+		line=ic_lines[page]=(ic_Entry*)calloc(IC_LINE_OPS,sizeof(ic_Entry));
+		ic_line_count++;
+	}
+
+	return line;
+}
+
+//the entry for addr, decoded again if it isn't valid
+static INLINE ic_Entry* ic_GetEntry(ic_Entry* line, u32 page, u32 addr)
+{
+	ic_Entry* e=&line[(addr&(PAGE_SIZE-1))/2];
+	u16* code=(u16*)&mem_b.data[addr&RAM_MASK];
+
+	if (unlikely(!e->oph || (ic_IsChecked(page) && e->op!=*code)))
+	{
+		e->op=*code;
+		e->oph=OpPtr[e->op];
+
+		if (!ic_locked[page] && !ic_IsChecked(page))
+		{
+			ic_locked[page]=1;
+			ic_ProtectPage(page, true);
+		}
+	}
+
+	return e;
+}
+
+//Called from the fault handler, a write hit a ram page holding decoded opcodes
+bool sh4_int_RamLockedWrite(u8* address)
+{
+	size_t offset=address-mem_b.data;
+
+	if (mem_b.data==0 || offset>=(size_t)RAM_SIZE*ic_RamViews())
+		return false;
+
+	u32 page=(offset&RAM_MASK)/PAGE_SIZE;
+
+	if (!ic_locked[page])
+		return false;
+
+	//the line may be executing, it is cleared but kept
+	memset(ic_lines[page],0,IC_LINE_OPS*sizeof(ic_Entry));
+
+	ic_locked[page]=0;
+	ic_ProtectPage(page, false);
+
+	if (++ic_writes[page]>=IC_CHECKED_WRITES)
+		ic_checked[page]=1;
+
+	return true;
+}
+
 static inline void Sh4_int_Run_execInternal(s32 *l)
 {
    do
    {
       u32 addr = next_pc;
-      next_pc += 2;
-      u32 op = ReadMem16(addr);
 
-      OpPtr[op](op);
-      *l -= CPU_RATIO;
+      if (!settings.MMUEnabled && ic_IsOnRam(addr))
+      {
+         u32 page = (addr & RAM_MASK) / PAGE_SIZE;
+         u32 base = addr & ~(PAGE_SIZE - 1);
+         ic_Entry* line = ic_GetLine(page);
+
+         //stays on the line until the pc leaves the page
+         do
+         {
+            ic_Entry* e = ic_GetEntry(line, page, addr);
+            next_pc = addr + 2;
+
+            e->oph(e->op);
+            *l -= CPU_RATIO;
+            addr = next_pc;
+         } while (*l > 0 && (addr & ~(PAGE_SIZE - 1)) == base);
+      }
+      else
+      {
+         next_pc += 2;
+         u32 op = ReadMem16(addr);
+
+         OpPtr[op](op);
+         *l -= CPU_RATIO;
+      }
    } while (*l > 0);
    *l += SH4_TIMESLICE;
    UpdateSystem_INTC();
@@ -66,15 +232,21 @@ static inline void Sh4_int_Run_exec(s32 *l)
 {
    if (settings.MMUEnabled)
    {
-      try
+      jmp_buf guard;
+      jmp_buf* prev = sh4_exception_jmp;
+
+      if (setjmp(guard) == 0)
       {
+         sh4_exception_jmp = &guard;
          Sh4_int_Run_execInternal(l);
       }
-      catch (SH4ThrownException ex)
+      else
       {
-         Do_Exception(ex.epc, ex.expEvn, ex.callVect);
+         Do_Exception(sh4_exception.epc, sh4_exception.expEvn, sh4_exception.callVect);
          *l -= CPU_RATIO * 5;
       }
+
+      sh4_exception_jmp = prev;
    }
    else
       Sh4_int_Run_execInternal(l);
@@ -124,6 +296,8 @@ void Sh4_int_Reset(bool Manual)
 
    next_pc = 0xA0000000;
 
+   ic_Reset();
+
    memset(r,0,sizeof(r));
    memset(r_bank,0,sizeof(r_bank));
 
@@ -151,6 +325,21 @@ static void ExecuteDelayslotInternal(void)
 {
    u32 addr = next_pc;
    next_pc += 2;
+
+   //only uses lines that exist, this runs from inside a line
+   if (!settings.MMUEnabled && ic_IsOnRam(addr))
+   {
+      u32 page = (addr & RAM_MASK) / PAGE_SIZE;
+
+      if (ic_lines[page])
+      {
+         ic_Entry* e = ic_GetEntry(ic_lines[page], page, addr);
+         if (e->op != 0)
+            e->oph(e->op);
+         return;
+      }
+   }
+
    u32 op = ReadMem16(addr);
    if (op != 0)
       ExecuteOpcode(op);
@@ -161,15 +350,10 @@ void ExecuteDelayslot(void)
 {
    if (settings.MMUEnabled)
    {
-      try {
-         ExecuteDelayslotInternal();
-      }
-      catch (SH4ThrownException ex)
-      {
-         ex.epc -= 2;
-         //printf("Delay slot exception\n");
-         throw ex;
-      }
+      //RaiseException moves the epc back to the branch
+      sh4_in_delayslot = true;
+      ExecuteDelayslotInternal();
+      sh4_in_delayslot = false;
    }
    else
       ExecuteDelayslotInternal();
@@ -181,14 +365,21 @@ void ExecuteDelayslot_RTE(void)
 
    if (settings.MMUEnabled)
    {
-      try {
+      jmp_buf guard;
+      jmp_buf* prev = sh4_exception_jmp;
+
+      if (setjmp(guard) == 0)
+      {
+         sh4_exception_jmp = &guard;
          sr.SetFull(ssr);
          ExecuteDelayslot();
       }
-      catch (SH4ThrownException ex)
+      else
       {
          printf("RTE Exception\n");
       }
+
+      sh4_exception_jmp = prev;
    }
    else
    {
@@ -236,8 +427,14 @@ static int DreamcastSecond(int tag, int c, int j)
 }
 
 
+//i-cache invalidation, can come from an opcode running off a line
 static void sh4_int_resetcache(void)
 {
+	for (u32 page=0; page<IC_PAGES; page++)
+	{
+		if (ic_lines[page])
+			memset(ic_lines[page],0,IC_LINE_OPS*sizeof(ic_Entry));
+	}
 }
 
 //Get an interface to sh4 interpreter
@@ -270,5 +467,6 @@ void Sh4_int_Init()
 void Sh4_int_Term(void)
 {
 	Sh4_int_Stop();
+	ic_Reset();
 	printf("Sh4 Term\n");
 }
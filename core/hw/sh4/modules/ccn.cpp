@@ -8,6 +8,7 @@
 #include "../sh4_core.h"
 #include "hw/pvr/pvr.h"
 #include "hw/mem/_vmem.h"
+#include "mmu.h"
 
 
 //Types
@@ -56,6 +57,8 @@ void CCN_MMUCR_write(u32 addr, u32 value)
 	if (temp.TI)
 		temp.TI=0;
 	CCN_MMUCR=temp;
+
+	mmu_flush_stlb();
 }
 void CCN_CCR_write(u32 addr, u32 value)
 {
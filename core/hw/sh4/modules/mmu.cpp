@@ -4,7 +4,9 @@
 #include "hw/sh4/sh4_if.h"
 #include "hw/sh4/sh4_interrupts.h"
 #include "hw/sh4/sh4_core.h"
+#include "hw/sh4/sh4_mem.h"
 #include "types.h"
+#include "serialize.h"
 
 #include "hw/mem/_vmem.h"
 
@@ -62,10 +64,87 @@ u32 ITLB_LRU_USE[64];
 //max 64MB can be remapped on SQ
 u32 sq_remap[64];
 
+/*
+	Software tlb
+
+	Direct mapped on 1kb virtual pages, it caches the successful UTLB lookups
+	so the common case doesn't scan the 64 entries. The tag has the asid and
+	sr.MD of the lookup, and each entry the generation of the UTLB entry it
+	came from, which UTLB_Sync bumps. Only MMUCR writes flush everything.
+
+	ptr is set when the page is on system ram, the memory handlers then
+	access it directly.
+*/
+#define STLB_SIZE 4096
+#define STLB_VALID 0x200
+
+struct stlb_entry
+{
+	u32 tag;
+	u32 ppn;
+	u8* ptr;
+	u32 gen;
+	u8 utlb;
+	bool write;
+};
+
+static stlb_entry stlb[STLB_SIZE];
+static u32 utlb_gen[64];
+
+static INLINE u32 stlb_tag(u32 va)
+{
+	return (va & ~0x3FF) | STLB_VALID | (CCN_PTEH.ASID << 1) | sr.MD;
+}
+
+//the entry for va, if it is valid
+template<u32 translation_type>
+static INLINE stlb_entry* stlb_lookup(u32 va)
+{
+	stlb_entry* e = &stlb[(va >> 10) & (STLB_SIZE - 1)];
+
+	if (e->tag != stlb_tag(va) || e->gen != utlb_gen[e->utlb])
+		return 0;
+
+	if (translation_type == MMU_TT_DWRITE && !e->write)
+		return 0;
+
+	return e;
+}
+
+static void stlb_fill(u32 va, u32 pa, u32 entry)
+{
+	stlb_entry* e = &stlb[(va >> 10) & (STLB_SIZE - 1)];
+
+	e->tag = stlb_tag(va);
+	e->ppn = pa & ~0x3FF;
+	e->ptr = ((pa >> 26) & 7) == 3 ? &mem_b.data[e->ppn & RAM_MASK] : 0;
+	e->gen = utlb_gen[entry];
+	e->utlb = entry;
+	e->write = (UTLB[entry].Data.PR & 1) && UTLB[entry].Data.D;
+}
+
+//host pointer for va when it is on ram and in the stlb, 0 otherwise
+template<u32 translation_type>
+static INLINE u8* stlb_ptr(u32 va)
+{
+	stlb_entry* e = stlb_lookup<translation_type>(va);
+
+	if (!e || !e->ptr)
+		return 0;
+
+	return e->ptr + (va & 0x3FF);
+}
+
+void mmu_flush_stlb(void)
+{
+	memset(stlb, 0, sizeof(stlb));
+}
+
 void MMU_reset(void)
 {
 	memset(UTLB, 0, sizeof(UTLB));
 	memset(ITLB, 0, sizeof(ITLB));
+	mmu_flush_stlb();
 }
 
 void MMU_term(void)
@@ -76,8 +155,14 @@ void RaiseException(u32 expEvnt, u32 callVect)
 {
    if (settings.MMUEnabled)
    {
-      SH4ThrownException ex = { next_pc - 2, expEvnt, callVect };
-      throw ex;
+      verify(sh4_exception_jmp != 0);
+
+      sh4_exception.epc = next_pc - 2 - (sh4_in_delayslot ? 2 : 0);
+      sh4_exception.expEvn = expEvnt;
+      sh4_exception.callVect = callVect;
+      sh4_in_delayslot = false;
+
+      longjmp(*sh4_exception_jmp, 1);
    }
    else
       msgboxf("Can't raise exceptions yet", MBX_ICONERROR);
@@ -312,6 +397,14 @@ u32 mmu_data_translation(u32 va, u32& rv)
 	return va;
 	}
 	*/
+	stlb_entry* e = stlb_lookup<translation_type>(va);
+
+	if (e)
+	{
+		rv = e->ppn | (va & 0x3FF);
+		return MMU_ERROR_NONE;
+	}
+
 	u32 entry;
 	u32 lookup = mmu_full_lookup(va, entry, rv);
 
@@ -338,6 +431,9 @@ u32 mmu_data_translation(u32 va, u32& rv)
 		else if (UTLB[entry].Data.D == 0)
 			return MMU_ERROR_FIRSTWRITE;
 	}
+
+	stlb_fill(va, rv, entry);
+
 	return MMU_ERROR_NONE;
 }
 
@@ -443,6 +539,9 @@ bool UTLB_Sync(u32 entry)
 {	
    if (settings.MMUEnabled)
    {
+      //drops the stlb entries that came from it
+      utlb_gen[entry]++;
+
       printf_mmu("UTLB MEM remap %d : 0x%X to 0x%X : %d\n", entry, UTLB[entry].Address.VPN << 10, UTLB[entry].Data.PPN << 10, UTLB[entry].Data.V);
       if (UTLB[entry].Data.V == 0)
          return true;
@@ -494,6 +593,9 @@ void ITLB_Sync(u32 entry)
 
 u8 DYNACALL mmu_ReadMem8(u32 adr)
 {
+	u8* ptr = stlb_ptr<MMU_TT_DREAD>(adr);
+	if (ptr)
+		return *(u8*)ptr;
 	u32 addr;
 	u32 tv = mmu_data_translation<MMU_TT_DREAD>(adr, addr);
 	if (tv == 0)
@@ -511,6 +613,9 @@ u16 DYNACALL mmu_ReadMem16(u32 adr)
 		mmu_raise_exception(MMU_ERROR_BADADDR, adr, MMU_TT_DREAD);
 		return 0;
 	}
+	u8* ptr = stlb_ptr<MMU_TT_DREAD>(adr);
+	if (ptr)
+		return *(u16*)ptr;
 	u32 addr;
 	u32 tv = mmu_data_translation<MMU_TT_DREAD>(adr, addr);
 	if (tv == 0)
@@ -545,6 +650,9 @@ u32 DYNACALL mmu_ReadMem32(u32 adr)
 		mmu_raise_exception(MMU_ERROR_BADADDR, adr, MMU_TT_DREAD);
 		return 0;
 	}
+	u8* ptr = stlb_ptr<MMU_TT_DREAD>(adr);
+	if (ptr)
+		return *(u32*)ptr;
 	u32 addr;
 	u32 tv = mmu_data_translation<MMU_TT_DREAD>(adr, addr);
 	if (tv == 0)
@@ -562,6 +670,9 @@ u64 DYNACALL mmu_ReadMem64(u32 adr)
 		mmu_raise_exception(MMU_ERROR_BADADDR, adr, MMU_TT_DREAD);
 		return 0;
 	}
+	u8* ptr = stlb_ptr<MMU_TT_DREAD>(adr);
+	if (ptr)
+		return *(u64*)ptr;
 	u32 addr;
 	u32 tv = mmu_data_translation<MMU_TT_DREAD>(adr, addr);
 	if (tv == 0)
@@ -576,6 +687,12 @@ u64 DYNACALL mmu_ReadMem64(u32 adr)
 
 void DYNACALL mmu_WriteMem8(u32 adr, u8 data)
 {
+	u8* ptr = stlb_ptr<MMU_TT_DWRITE>(adr);
+	if (ptr)
+	{
+		*(u8*)ptr = data;
+		return;
+	}
 	u32 addr;
 	u32 tv = mmu_data_translation<MMU_TT_DWRITE>(adr, addr);
 	if (tv == 0)
@@ -594,6 +711,12 @@ void DYNACALL mmu_WriteMem16(u32 adr, u16 data)
 		mmu_raise_exception(MMU_ERROR_BADADDR, adr, MMU_TT_DWRITE);
 		return;
 	}
+	u8* ptr = stlb_ptr<MMU_TT_DWRITE>(adr);
+	if (ptr)
+	{
+		*(u16*)ptr = data;
+		return;
+	}
 	u32 addr;
 	u32 tv = mmu_data_translation<MMU_TT_DWRITE>(adr, addr);
 	if (tv == 0)
@@ -612,6 +735,12 @@ void DYNACALL mmu_WriteMem32(u32 adr, u32 data)
 		mmu_raise_exception(MMU_ERROR_BADADDR, adr, MMU_TT_DWRITE);
 		return;
 	}
+	u8* ptr = stlb_ptr<MMU_TT_DWRITE>(adr);
+	if (ptr)
+	{
+		*(u32*)ptr = data;
+		return;
+	}
 	u32 addr;
 	u32 tv = mmu_data_translation<MMU_TT_DWRITE>(adr, addr);
 	if (tv == 0)
@@ -630,6 +759,12 @@ void DYNACALL mmu_WriteMem64(u32 adr, u64 data)
 		mmu_raise_exception(MMU_ERROR_BADADDR, adr, MMU_TT_DWRITE);
 		return;
 	}
+	u8* ptr = stlb_ptr<MMU_TT_DWRITE>(adr);
+	if (ptr)
+	{
+		*(u64*)ptr = data;
+		return;
+	}
 	u32 addr;
 	u32 tv = mmu_data_translation<MMU_TT_DWRITE>(adr, addr);
 	if (tv == 0)
@@ -678,3 +813,14 @@ bool mmu_TranslateSQW(u32 adr, u32* mapped)
 
 	return true;
 }
+
+void mmu_Serialize(ser_Stream& s)
+{
+	SER(s,UTLB);
+	SER(s,ITLB);
+	SER(s,sq_remap);
+	SER(s,mmu_error_TT);
+
+	if (s.load())
+		mmu_flush_stlb();
+}
@@ -17,6 +17,8 @@ bool UTLB_Sync(u32 entry);
 void ITLB_Sync(u32 entry);
 
 bool mmu_match(u32 va, CCN_PTEH_type Address, CCN_PTEL_type Data);
+//Drops all the cached translations, the tlbs or MMUCR changed
+void mmu_flush_stlb(void);
 
 u8 DYNACALL mmu_ReadMem8(u32 addr);
 u16 DYNACALL mmu_ReadMem16(u32 addr);
@@ -7,6 +7,7 @@
 #include "tmu.h"
 #include "hw/sh4/sh4_interrupts.h"
 #include "hw/sh4/sh4_mmr.h"
+#include "serialize.h"
 
 
 #define TMU_UNDERFLOW 0x0100
@@ -274,3 +275,13 @@ void tmu_reset(void)
 void tmu_term(void)
 {
 }
+
+void tmu_Serialize(ser_Stream& s)
+{
+	SER(s,tmu_shift);
+	SER(s,tmu_mask);
+	SER(s,tmu_mask64);
+	SER(s,old_mode);
+	SER(s,tmu_ch_base);
+	SER(s,tmu_ch_base64);
+}
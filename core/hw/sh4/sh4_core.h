@@ -1,4 +1,5 @@
 #pragma once
+#include <setjmp.h>
 #include "types.h"
 #include "sh4_if.h"
 
@@ -89,3 +90,11 @@ struct SH4ThrownException {
 	u32 expEvn;
 	u32 callVect;
 };
+
+//Exceptions raised from inside an opcode (mmu faults) aren't thrown. RaiseException
+//stores them in sh4_exception and longjmps to sh4_exception_jmp, set by the code running
+//the opcodes. There is no unwinding, so this also works from dynarec code.
+extern jmp_buf* sh4_exception_jmp;
+extern SH4ThrownException sh4_exception;
+//set while a delay slot runs, exceptions then restart at the branch
+extern bool sh4_in_delayslot;
@@ -5,6 +5,7 @@
 #include "types.h"
 #include "sh4_core.h"
 #include "sh4_interrupts.h"
+#include "serialize.h"
 
 
 Sh4RCB* p_sh4rcb;
@@ -196,3 +197,23 @@ u32 Sh4Context::offset(u32 sh4_reg)
 
 	return offs;
 }
+
+void sh4_Serialize(ser_Stream& s)
+{
+	//the cpu keeps running across a load
+	u32 running=Sh4cntx.CpuRunning;
+
+	SER(s,Sh4cntx.raw);
+	SER(s,p_sh4rcb->sq_buffer);
+
+	Sh4cntx.CpuRunning=running;
+
+	if (s.load())
+	{
+		old_rm=0xFF;
+		old_dn=0xFF;
+		SetFloatStatusReg();
+
+		sh4_cpu.ResetCache();
+	}
+}
@@ -50,6 +50,9 @@ void Sh4_int_SetRegister(Sh4RegType reg,u32 regdata);
 void ExecuteDelayslot(void);
 void ExecuteDelayslot_RTE(void);
 
+//Called from the fault handler, true if the write hit a page holding decoded opcodes
+bool sh4_int_RamLockedWrite(u8* address);
+
 
 #ifdef __cplusplus
 extern "C" {
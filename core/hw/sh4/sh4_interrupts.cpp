@@ -13,6 +13,7 @@
 #include "sh4_interrupts.h"
 #include "sh4_core.h"
 #include "sh4_mmr.h"
+#include "serialize.h"
 
 /*
 
@@ -151,6 +152,10 @@ void ResetInterruptMask(InterruptID intr)
 }
 
 
+jmp_buf* sh4_exception_jmp;
+SH4ThrownException sh4_exception;
+bool sh4_in_delayslot;
+
 bool Do_Exception(u32 epc, u32 expEvn, u32 CallVect)
 {
 	verify(sr.BL == 0);
@@ -247,3 +252,14 @@ void interrupts_term(void)
 {
 
 }
+
+void interrupts_Serialize(ser_Stream& s)
+{
+	SER(s,InterruptEnvId);
+	SER(s,InterruptBit);
+	SER(s,InterruptLevelBit);
+
+	SER(s,interrupt_vpend);
+	SER(s,interrupt_vmask);
+	SER(s,decoded_srimask);
+}
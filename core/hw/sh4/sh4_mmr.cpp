@@ -8,6 +8,7 @@
 #include "modules/mmu.h"
 #include "modules/ccn.h"
 #include "modules/modules.h"
+#include "serialize.h"
 
 //64bytes of sq // now on context ~
 
@@ -806,3 +807,19 @@ void map_p4(void)
 
 	map_area7(0xE0);
 }
+
+void sh4_mmr_Serialize(ser_Stream& s)
+{
+	Array<RegisterStruct>* blocks[]={&CCN,&UBC,&BSC,&DMAC,&CPG,&RTC,&INTC,&TMU,&SCI,&SCIF};
+
+	for (u32 i=0;i<sizeof(blocks)/sizeof(blocks[0]);i++)
+		ser_Regs(s,blocks[i]->data,blocks[i]->Size);
+
+	ser_Data(s,OnChipRAM.data,OnChipRAM.Size);
+
+	SER(s,BSC_PDTRA);
+	SER(s,CCN_QACR_TR);
+	SER(s,SCIF_SCFSR2);
+	SER(s,SCIF_SCFRDR2);
+	SER(s,SCIF_SCFDR2);
+}
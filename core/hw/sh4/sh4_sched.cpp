@@ -3,6 +3,7 @@
 #include "sh4_interrupts.h"
 #include "sh4_core.h"
 #include "sh4_sched.h"
+#include "serialize.h"
 
 
 //sh4 scheduler
@@ -158,3 +159,28 @@ void sh4_sched_tick(int cycles)
 		sh4_sched_ffts();
 	}
 }
+
+//the handlers are registered at init, in the same order every time
+void sh4_sched_Serialize(ser_Stream& s)
+{
+	SER(s,sh4_sched_ffb);
+	SER(s,sh4_sched_intr);
+	SER(s,sh4_sched_next_id);
+	SER(s,Sh4cntx.sh4_sched_next);
+
+	u32 count=list.size();
+	SER(s,count);
+
+	if (count!=list.size())
+	{
+		s.failed=true;
+		return;
+	}
+
+	for (u32 i=0;i<count;i++)
+	{
+		SER(s,list[i].tag);
+		SER(s,list[i].start);
+		SER(s,list[i].end);
+	}
+}
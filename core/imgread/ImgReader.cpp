@@ -4,6 +4,7 @@
 #include "ImgReader.h"
 //Get a copy of the operators for structs ... ugly , but works :)
 #include "common.h"
+#include "hw/gdrom/gdrom_if.h"
 
 void GetSessionInfo(u8* out,u8 ses);
 
@@ -78,5 +79,7 @@ s32 libGDR_Init()
 //called when exiting from sh4 thread , from the new thread context (for any thread specific init) :P
 void libGDR_Term()
 {
+	//the prefetch thread reads through the drive, it goes first
+	gdrom_reg_Term();
 	TermDrive();
 }
@@ -15,6 +15,9 @@ Disc* cdi_parse(const wchar* file)
 
 	Disc* rv= new Disc();
 
+	//mapped once, every track reads from the same mapping
+	MappedImage* map=MapImage(fsource);
+
 	image_s image = { 0 };
 	track_s track = { 0 };
 	CDI_init(fsource,&image,0);
@@ -98,7 +101,11 @@ Disc* cdi_parse(const wchar* file)
 				t.CTRL=track.mode==0?0:4;
 				t.StartFAD=track.start_lba+track.pregap_length;
 				t.EndFAD=t.StartFAD+track.length-1;
-				t.file = new RawTrackFile(core_fopen(file),track.position + track.pregap_length * track.sector_size,t.StartFAD,track.sector_size);
+				u32 track_offs=track.position + track.pregap_length * track.sector_size;
+				if (map)
+					t.file = new MappedTrackFile(map,track_offs,t.StartFAD,track.sector_size);
+				else
+					t.file = new RawTrackFile(core_fopen(file),track_offs,t.StartFAD,track.sector_size);
 
 				rv->tracks.push_back(t);
 
@@ -156,6 +163,10 @@ Disc* cdi_parse(const wchar* file)
 		image.remaining_sessions--;
 	}
 
+	//the tracks hold their own references, it goes with the disc
+	if (map)
+		ReleaseImage(map);
+
 	rv->type=GuessDiscType(CD_M1,CD_M2,CD_DA);
 
 	rv->LeadOut.StartFAD=rv->EndFAD;
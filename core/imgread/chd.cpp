@@ -2,38 +2,259 @@
 
 #include "deps/chdr/chd.h"
 
+#ifndef TARGET_NO_THREADS
+#include <rthreads/rthreads.h>
+#endif
+
+//hunks decompressed ahead of a sequential read
+#define CHD_READ_AHEAD 4
+
+struct CHDHunk
+{
+	u32 hunk;
+	u32 last_used;
+	u8* data;
+};
+
 struct CHDDisc : Disc
 {
 	chd_file* chd;
 	u8* hunk_mem;
-	u32 old_hunk;
 
 	u32 hunkbytes;
+	u32 totalhunks;
 	u32 sph;
+
+	//lru cache of decompressed hunks
+	vector<CHDHunk> cache;
+	u32 cache_clock;
+	u32 last_slot;
+	u32 last_hunk;
+
+#ifndef TARGET_NO_THREADS
+	//the read ahead worker decompresses into its own buffer, chd_read isn't reentrant
+	slock_t* chd_lock;
+	slock_t* cache_lock;
+	scond_t* ahead_wake;
+	sthread_t* ahead_thread;
+	u8* ahead_mem;
+	u32 ahead_next;
+	u32 ahead_end;
+	bool ahead_quit;
+#endif
 	
 	CHDDisc()
 	{
 		chd=0;
 		hunk_mem=0;
+		cache_clock=0;
+		last_slot=0;
+		last_hunk=0xFFFFFFFF;
+#ifndef TARGET_NO_THREADS
+		chd_lock=0;
+		cache_lock=0;
+		ahead_wake=0;
+		ahead_thread=0;
+		ahead_mem=0;
+		ahead_next=ahead_end=0;
+		ahead_quit=false;
+#endif
 	}
 
 	bool TryOpen(const wchar* file);
 
+	void ReadHunk(u32 hunk,u32 offs,u8* dst,u32 size,u32 count=1);
+
 	~CHDDisc() 
 	{ 
+#ifndef TARGET_NO_THREADS
+		if (ahead_thread)
+		{
+			slock_lock(cache_lock);
+			ahead_quit=true;
+			scond_signal(ahead_wake);
+			slock_unlock(cache_lock);
+
+			sthread_join(ahead_thread);
+		}
+		if (ahead_wake)
+			scond_free(ahead_wake);
+		if (cache_lock)
+			slock_free(cache_lock);
+		if (chd_lock)
+			slock_free(chd_lock);
+		if (ahead_mem)
+			delete [] ahead_mem;
+#endif
+		for (size_t i=0;i<cache.size();i++)
+			delete [] cache[i].data;
 		if (hunk_mem)
 			delete [] hunk_mem;
 		if (chd)
 			chd_close(chd);
 	}
+
+private:
+	bool CacheLookup(u32 hunk,u32 offs,u8* dst,u32 size,u32 count);
+	void CacheInsert(u32 hunk,const u8* data);
+#ifndef TARGET_NO_THREADS
+	void ReadAhead(u32 hunk);
+	static void AheadThread(void* param);
+#endif
 };
 
+//count sectors of size bytes, packed in dst
+static void CopySectors(const u8* src,u8* dst,u32 size,u32 count)
+{
+	for (u32 i=0;i<count;i++)
+		memcpy(dst+i*size,src+i*(2352+96),size);
+}
+
+//copies from the cached hunk if it is there, the caller holds cache_lock
+bool CHDDisc::CacheLookup(u32 hunk,u32 offs,u8* dst,u32 size,u32 count)
+{
+	if (cache[last_slot].hunk!=hunk)
+	{
+		size_t i;
+		for (i=0;i<cache.size();i++)
+		{
+			if (cache[i].hunk==hunk)
+				break;
+		}
+
+		if (i==cache.size())
+			return false;
+
+		last_slot=i;
+	}
+
+	cache[last_slot].last_used=++cache_clock;
+	if (dst)
+		CopySectors(cache[last_slot].data+offs,dst,size,count);
+
+	return true;
+}
+
+//replaces the least recently used hunk, the caller holds cache_lock
+void CHDDisc::CacheInsert(u32 hunk,const u8* data)
+{
+	size_t victim=0;
+
+	for (size_t i=1;i<cache.size();i++)
+	{
+		if (cache[i].last_used<cache[victim].last_used)
+			victim=i;
+	}
+
+	cache[victim].hunk=hunk;
+	cache[victim].last_used=++cache_clock;
+	memcpy(cache[victim].data,data,hunkbytes);
+
+	last_slot=victim;
+}
+
+void CHDDisc::ReadHunk(u32 hunk,u32 offs,u8* dst,u32 size,u32 count)
+{
+#ifndef TARGET_NO_THREADS
+	slock_lock(cache_lock);
+	bool hit=CacheLookup(hunk,offs,dst,size,count);
+	slock_unlock(cache_lock);
+
+	//sequential reads keep the worker a few hunks ahead
+	if (hunk!=last_hunk)
+	{
+		if (hunk==last_hunk+1)
+			ReadAhead(hunk);
+		last_hunk=hunk;
+	}
+
+	if (hit)
+		return;
+
+	slock_lock(chd_lock);
+
+	//the worker may have just decompressed it
+	slock_lock(cache_lock);
+	hit=CacheLookup(hunk,offs,dst,size,count);
+	slock_unlock(cache_lock);
+
+	if (!hit)
+	{
+		chd_read(chd,hunk,hunk_mem); //CHDERR_NONE
+
+		slock_lock(cache_lock);
+		CacheInsert(hunk,hunk_mem);
+		slock_unlock(cache_lock);
+
+		CopySectors(hunk_mem+offs,dst,size,count);
+	}
+
+	slock_unlock(chd_lock);
+#else
+	if (CacheLookup(hunk,offs,dst,size,count))
+		return;
+
+	chd_read(chd,hunk,hunk_mem); //CHDERR_NONE
+	CacheInsert(hunk,hunk_mem);
+
+	CopySectors(hunk_mem+offs,dst,size,count);
+#endif
+}
+
+#ifndef TARGET_NO_THREADS
+void CHDDisc::ReadAhead(u32 hunk)
+{
+	u32 end=std::min(hunk+1+std::min<u32>(CHD_READ_AHEAD,cache.size()/2),totalhunks);
+
+	slock_lock(cache_lock);
+	if (ahead_next<hunk+1 || ahead_next>end)
+		ahead_next=hunk+1;
+	ahead_end=end;
+	scond_signal(ahead_wake);
+	slock_unlock(cache_lock);
+}
+
+void CHDDisc::AheadThread(void* param)
+{
+	CHDDisc* disc=(CHDDisc*)param;
+
+	slock_lock(disc->cache_lock);
+
+	for (;;)
+	{
+		while (!disc->ahead_quit && disc->ahead_next>=disc->ahead_end)
+			scond_wait(disc->ahead_wake,disc->cache_lock);
+
+		if (disc->ahead_quit)
+			break;
+
+		u32 hunk=disc->ahead_next++;
+
+		if (disc->CacheLookup(hunk,0,0,0,0))
+			continue;
+
+		slock_unlock(disc->cache_lock);
+
+		slock_lock(disc->chd_lock);
+		chd_error err=chd_read(disc->chd,hunk,disc->ahead_mem);
+		slock_unlock(disc->chd_lock);
+
+		slock_lock(disc->cache_lock);
+		if (err==CHDERR_NONE && !disc->CacheLookup(hunk,0,0,0,0))
+			disc->CacheInsert(hunk,disc->ahead_mem);
+	}
+
+	slock_unlock(disc->cache_lock);
+}
+#endif
+
 struct CHDTrack : TrackFile
 {
 	CHDDisc* disc;
 	u32 StartFAD;
 	u32 StartHunk;
 	u32 fmt;
+	vector<u8> temp;
 
 	CHDTrack(CHDDisc* disc, u32 StartFAD,u32 StartHunk, u32 fmt) 
 	{ 
@@ -47,14 +268,9 @@ struct CHDTrack : TrackFile
 	{
 		u32 fad_offs=FAD-StartFAD;
 		u32 hunk=(fad_offs)/disc->sph + StartHunk;
-		if (disc->old_hunk!=hunk)
-		{
-			chd_read(disc->chd,hunk,disc->hunk_mem); //CHDERR_NONE
-		}
-
 		u32 hunk_ofs=fad_offs%disc->sph;
 
-		memcpy(dst,disc->hunk_mem+hunk_ofs*(2352+96),fmt);
+		disc->ReadHunk(hunk,hunk_ofs*(2352+96),dst,fmt);
 		
 		*sector_type=fmt==2352?SECFMT_2352:SECFMT_2048_MODE1;
 		
@@ -62,6 +278,40 @@ struct CHDTrack : TrackFile
 		//memcpy(subcode,disc->hunk_mem+hunk_ofs*(2352+96)+2352,96);
 		*subcode_type=SUBFMT_NONE;
 	}
+
+	//whole hunks at a time, converting from a staging buffer if needed
+	virtual void ReadRange(u32 FAD,u32 count,u32 fmt,u8* dst)
+	{
+		SectorFormat secfmt=this->fmt==2352?SECFMT_2352:SECFMT_2048_MODE1;
+		bool direct=SectorCopyOnly(secfmt,fmt);
+
+		if (!direct)
+			temp.resize(disc->sph*this->fmt);
+
+		while (count)
+		{
+			u32 fad_offs=FAD-StartFAD;
+			u32 hunk=(fad_offs)/disc->sph + StartHunk;
+			u32 hunk_ofs=fad_offs%disc->sph;
+			u32 n=min(count,disc->sph-hunk_ofs);
+
+			if (direct)
+			{
+				disc->ReadHunk(hunk,hunk_ofs*(2352+96),dst,fmt,n);
+			}
+			else
+			{
+				disc->ReadHunk(hunk,hunk_ofs*(2352+96),&temp[0],this->fmt,n);
+
+				for (u32 i=0;i<n;i++)
+					ConvertSectorFrom(&temp[i*this->fmt],secfmt,dst+i*fmt,fmt,FAD+i);
+			}
+
+			dst+=n*fmt;
+			FAD+=n;
+			count-=n;
+		}
+	}
 };
 
 bool CHDDisc::TryOpen(const wchar* file)
@@ -76,8 +326,16 @@ bool CHDDisc::TryOpen(const wchar* file)
 	const chd_header* head = chd_get_header(chd);
 
 	hunkbytes = head->hunkbytes;
+	totalhunks = head->totalhunks;
 	hunk_mem = new u8[hunkbytes];
-	old_hunk=0xFFFFFFF;
+
+	cache.resize(std::max<u32>(settings.imgread.ChdCacheHunks,1));
+	for (size_t i=0;i<cache.size();i++)
+	{
+		cache[i].hunk=0xFFFFFFFF;
+		cache[i].last_used=0;
+		cache[i].data=new u8[hunkbytes];
+	}
 
 	sph = hunkbytes/(2352+96);
 
@@ -149,6 +407,14 @@ bool CHDDisc::TryOpen(const wchar* file)
 
 	FillGDSession();
 
+#ifndef TARGET_NO_THREADS
+	chd_lock=slock_new();
+	cache_lock=slock_new();
+	ahead_wake=scond_new();
+	ahead_mem=new u8[hunkbytes];
+	ahead_thread=sthread_create(AheadThread,this);
+#endif
+
 	return true;
 }
 
@@ -1,4 +1,38 @@
 #include "common.h"
+#ifndef TARGET_NO_THREADS
+#include <rthreads/rthreads.h>
+
+//the gdrom prefetch thread reads sectors while the emu thread may swap discs.
+//Made when the first disc opens, freed by TermDrive
+static slock_t* disc_lock;
+#endif
+
+//no lock before a disc was ever opened, there's nothing to read then
+static void LockDisc(void)
+{
+#ifndef TARGET_NO_THREADS
+	if (disc_lock)
+		slock_lock(disc_lock);
+#endif
+}
+
+static void UnlockDisc(void)
+{
+#ifndef TARGET_NO_THREADS
+	if (disc_lock)
+		slock_unlock(disc_lock);
+#endif
+}
+
+static void CloseDisc(void)
+{
+	LockDisc();
+	if (disc!=0)
+		delete disc;
+
+	disc=0;
+	UnlockDisc();
+}
 
 Disc* chd_parse(const wchar* file);
 Disc* gdi_parse(const wchar* file);
@@ -117,6 +151,95 @@ bool ConvertSector(u8* in_buff , u8* out_buff , int from , int to,int sector)
    return true;
 }
 
+bool SectorCopyOnly(SectorFormat secfmt,u32 fmt)
+{
+	if (fmt==2352)
+		return secfmt==SECFMT_2352;
+	if (fmt==2048)
+		return secfmt==SECFMT_2048_MODE1 || secfmt==SECFMT_2048_MODE2_FORM1;
+	return false;
+}
+
+void ConvertSectorFrom(u8* src,SectorFormat secfmt,u8* dst,u32 fmt,u32 FAD)
+{
+	//TODO: Proper sector conversions
+	if (secfmt==SECFMT_2352)
+	{
+		ConvertSector(src,dst,2352,fmt,FAD);
+	}
+	else if (fmt == 2048 && secfmt==SECFMT_2336_MODE2)
+		memcpy(dst,src+8,2048);
+	else if (fmt==2048 && (secfmt==SECFMT_2048_MODE1 || secfmt==SECFMT_2048_MODE2_FORM1 ))
+	{
+		memcpy(dst,src,2048);
+	}
+	else if (fmt==2352 && (secfmt==SECFMT_2048_MODE1 || secfmt==SECFMT_2048_MODE2_FORM1 ))
+	{
+		printf("GDR:fmt=2352;secfmt=2048\n");
+		memcpy(dst,src,2048);
+	}
+	else
+	{
+		printf("ERROR: UNABLE TO CONVERT SECTOR. THIS IS FATAL.");
+		//verify(false);
+	}
+}
+
+void TrackFile::ReadRange(u32 FAD,u32 count,u32 fmt,u8* dst)
+{
+	u8 temp[2352];
+	SectorFormat secfmt;
+	SubcodeFormat subfmt;
+
+	for (u32 i=0;i<count;i++)
+	{
+		subfmt=SUBFMT_NONE;
+		Read(FAD+i,temp,&secfmt,q_subchannel,&subfmt);
+		ConvertSectorFrom(temp,secfmt,dst+i*fmt,fmt,FAD+i);
+	}
+}
+
+MappedImage* MapImage(core_file* file)
+{
+	size_t size;
+	u8* data=file?core_fmap(file,&size):0;
+
+	if (!data)
+		return 0;
+
+	MappedImage* map=new MappedImage();
+	map->data=data;
+	map->size=size;
+	map->refs=1;
+
+	return map;
+}
+
+void ReleaseImage(MappedImage* map)
+{
+	if (--map->refs)
+		return;
+
+	core_funmap(map->data,map->size);
+	delete map;
+}
+
+TrackFile* OpenTrackFile(core_file* file,u32 file_offs,u32 first_fad,u32 secfmt)
+{
+	MappedImage* map=MapImage(file);
+
+	if (!map)
+		return new RawTrackFile(file,file_offs,first_fad,secfmt);
+
+	//the mapping outlives the file handle
+	core_fclose(file);
+
+	TrackFile* rv=new MappedTrackFile(map,file_offs,first_fad,secfmt);
+	ReleaseImage(map);
+
+	return rv;
+}
+
 Disc* OpenDisc(const wchar* fn)
 {
 	Disc* rv;
@@ -128,10 +251,19 @@ Disc* OpenDisc(const wchar* fn)
 
 bool InitDrive_(wchar* fn)
 {
-	TermDrive();
+	CloseDisc();
 
 	//try all drivers
-	disc = OpenDisc(fn);
+	Disc* opened = OpenDisc(fn);
+
+#ifndef TARGET_NO_THREADS
+	if (!disc_lock)
+		disc_lock = slock_new();
+#endif
+
+	LockDisc();
+	disc = opened;
+	UnlockDisc();
 
 	if (disc!=0)
 	{
@@ -261,12 +393,16 @@ bool DiscSwap(u32 fileflags)
 }
 #endif
 
+//the gdrom prefetch thread has to be stopped already
 void TermDrive()
 {
-	if (disc!=0)
-		delete disc;
+	CloseDisc();
 
-	disc=0;
+#ifndef TARGET_NO_THREADS
+	if (disc_lock)
+		slock_free(disc_lock);
+	disc_lock=0;
+#endif
 }
 
 
@@ -312,16 +448,18 @@ static u32 CreateTrackInfo_se(u32 ctrl,u32 addr,u32 tracknum)
 void GetDriveSector(u8 * buff,u32 StartSector,u32 SectorCount,u32 secsz)
 {
    //printf("GD: read %08X, %d\n",StartSector,SectorCount);
-   if (!disc)
-      return;
-
-   disc->ReadSectors(StartSector,SectorCount,buff,secsz);
-
-   if (disc->type == GdRom && StartSector==45150 && SectorCount==7)
+   LockDisc();
+   if (disc)
    {
-      PatchRegion_0(buff,secsz);
-      PatchRegion_6(buff+2048*6,secsz);
+      disc->ReadSectors(StartSector,SectorCount,buff,secsz);
+
+      if (disc->type == GdRom && StartSector==45150 && SectorCount==7)
+      {
+         PatchRegion_0(buff,secsz);
+         PatchRegion_6(buff+2048*6,secsz);
+      }
    }
+   UnlockDisc();
 }
 void GetDriveToc(u32* to,DiskArea area)
 {
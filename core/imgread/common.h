@@ -81,6 +81,8 @@ enum SubcodeFormat
 };
 
 bool ConvertSector(u8* in_buff , u8* out_buff , int from , int to,int sector);
+bool SectorCopyOnly(SectorFormat secfmt,u32 fmt);
+void ConvertSectorFrom(u8* src,SectorFormat secfmt,u8* dst,u32 fmt,u32 FAD);
 
 bool InitDrive(u32 fileflags=0);
 void TermDrive();
@@ -109,6 +111,8 @@ struct Session
 struct TrackFile
 {
 	virtual void Read(u32 FAD,u8* dst,SectorFormat* sector_type,u8* subcode,SubcodeFormat* subcode_type)=0;
+	//count sectors converted to fmt, the default goes through Read one by one
+	virtual void ReadRange(u32 FAD,u32 count,u32 fmt,u8* dst);
 	virtual ~TrackFile() {};
 };
 
@@ -162,47 +166,55 @@ struct Disc
 		return false;
 	}
 
-	void ReadSectors(u32 FAD,u32 count,u8* dst,u32 fmt)
+	//the track FAD is read from, and how many sectors from FAD on it covers
+	Track* FindTrack(u32 FAD,u32* run)
 	{
-		u8 temp[2352];
-		SectorFormat secfmt;
-		SubcodeFormat subfmt;
-
-		while(count)
+		for (size_t i=tracks.size();i-->0;)
 		{
-			if (ReadSector(FAD,temp,&secfmt,q_subchannel,&subfmt))
+			Track& t=tracks[i];
+
+			if (FAD>=t.StartFAD && (FAD<=t.EndFAD || t.EndFAD==0) && t.file)
 			{
-				//TODO: Proper sector conversions
-				if (secfmt==SECFMT_2352)
-				{
-					ConvertSector(temp,dst,2352,fmt,FAD);
-				}
-				else if (fmt == 2048 && secfmt==SECFMT_2336_MODE2)
-					memcpy(dst,temp+8,2048);
-				else if (fmt==2048 && (secfmt==SECFMT_2048_MODE1 || secfmt==SECFMT_2048_MODE2_FORM1 ))
-				{
-					memcpy(dst,temp,2048);
-				}
-				else if (fmt==2352 && (secfmt==SECFMT_2048_MODE1 || secfmt==SECFMT_2048_MODE2_FORM1 ))
-				{
-					printf("GDR:fmt=2352;secfmt=2048\n");
-					memcpy(dst,temp,2048);
-				}
-				else
+				//open ended tracks run until the next one
+				u32 end=t.EndFAD?t.EndFAD+1:0xFFFFFFFF;
+				for (size_t j=i+1;j<tracks.size();j++)
 				{
-					printf("ERROR: UNABLE TO CONVERT SECTOR. THIS IS FATAL.");
-					//verify(false);
+					if (tracks[j].file && tracks[j].StartFAD>FAD && tracks[j].StartFAD<end)
+						end=tracks[j].StartFAD;
 				}
+
+				*run=end-FAD;
+				return &t;
 			}
-			else
+		}
+
+		return 0;
+	}
+
+	void ReadSectors(u32 FAD,u32 count,u8* dst,u32 fmt)
+	{
+		while(count)
+		{
+			u32 run;
+			Track* track=FindTrack(FAD,&run);
+
+			if (!track)
 			{
 				printf("Sector Read miss FAD: %d\n", FAD);
+				run=1;
 			}
-			dst+=fmt;
-			FAD++;
-			count--;
+			else
+			{
+				run=min(run,count);
+				track->file->ReadRange(FAD,run,fmt,dst);
+			}
+
+			dst+=run*fmt;
+			FAD+=run;
+			count-=run;
 		}
 	}
+
 	virtual ~Disc() 
 	{
 		for (size_t i=0;i<tracks.size();i++)
@@ -257,12 +269,30 @@ extern Disc* disc;
 
 Disc* OpenDisc(const wchar* fn);
 
+//for now hackish
+static inline SectorFormat RawSectorFormat(u32 fmt)
+{
+	switch (fmt)
+	{
+		case 2352:
+			return SECFMT_2352;
+		case 2048:
+			return SECFMT_2048_MODE2_FORM1;
+		case 2336:
+			return SECFMT_2336_MODE2;
+		default:
+			verify(false);
+			return SECFMT_2352;
+	}
+}
+
 struct RawTrackFile : TrackFile
 {
 	core_file* file;
 	s32 offset;
 	u32 fmt;
 	bool cleanup;
+	vector<u8> temp;
 
 	RawTrackFile(core_file* file,u32 file_offs,u32 first_fad,u32 secfmt)
 	{
@@ -275,26 +305,41 @@ struct RawTrackFile : TrackFile
 
 	virtual void Read(u32 FAD,u8* dst,SectorFormat* sector_type,u8* subcode,SubcodeFormat* subcode_type)
 	{
-		//for now hackish
-      switch (fmt)
-      {
-         case 2352:
-            *sector_type=SECFMT_2352;
-            break;
-         case 2048:
-            *sector_type=SECFMT_2048_MODE2_FORM1;
-            break;
-         case 2336:
-            *sector_type=SECFMT_2336_MODE2;
-            break;
-         default:
-            verify(false);
-            break;
-      }
+		*sector_type=RawSectorFormat(fmt);
 
 		core_fseek(file,offset+FAD*fmt,SEEK_SET);
 		core_fread(file, dst, fmt);
 	}
+
+	//one seek, and reads of up to 32 sectors at a time
+	virtual void ReadRange(u32 FAD,u32 count,u32 fmt,u8* dst)
+	{
+		SectorFormat secfmt=RawSectorFormat(this->fmt);
+
+		core_fseek(file,offset+FAD*this->fmt,SEEK_SET);
+
+		if (SectorCopyOnly(secfmt,fmt))
+		{
+			core_fread(file,dst,count*fmt);
+			return;
+		}
+
+		temp.resize(32*this->fmt);
+
+		while (count)
+		{
+			u32 n=min(count,(u32)32);
+			core_fread(file,&temp[0],n*this->fmt);
+
+			for (u32 i=0;i<n;i++)
+				ConvertSectorFrom(&temp[i*this->fmt],secfmt,dst+i*fmt,fmt,FAD+i);
+
+			dst+=n*fmt;
+			FAD+=n;
+			count-=n;
+		}
+	}
+
 	virtual ~RawTrackFile()
 	{
 		if (cleanup && file)
@@ -302,6 +347,91 @@ struct RawTrackFile : TrackFile
 	}
 };
 
+//read only mapping of a whole image file, shared by the tracks in it
+struct MappedImage
+{
+	u8* data;
+	size_t size;
+	u32 refs;
+};
+
+//maps the file, 0 if it can't be. The caller holds one reference, the file
+//isn't needed for the mapping afterwards
+MappedImage* MapImage(core_file* file);
+//unmaps the image with the last reference
+void ReleaseImage(MappedImage* map);
+
+//track backed by a mapped image, takes a reference to it
+struct MappedTrackFile : TrackFile
+{
+	MappedImage* map;
+	u8* data;
+	size_t size;
+	s64 offset;
+	u32 fmt;
+
+	MappedTrackFile(MappedImage* map,u32 file_offs,u32 first_fad,u32 secfmt)
+	{
+		map->refs++;
+		this->map=map;
+		this->data=map->data;
+		this->size=map->size;
+		this->offset=(s64)file_offs-(s64)first_fad*secfmt;
+		this->fmt=secfmt;
+	}
+
+	u8* GetSector(u32 FAD)
+	{
+		s64 pos=offset+(s64)FAD*fmt;
+
+		if (pos<0 || pos+fmt>(s64)size)
+			return 0;
+
+		return data+pos;
+	}
+
+	virtual void Read(u32 FAD,u8* dst,SectorFormat* sector_type,u8* subcode,SubcodeFormat* subcode_type)
+	{
+		*sector_type=RawSectorFormat(fmt);
+
+		u8* src=GetSector(FAD);
+
+		if (src)
+			memcpy(dst,src,fmt);
+	}
+
+	//converted straight from the mapping, as one span if no conversion is needed
+	virtual void ReadRange(u32 FAD,u32 count,u32 fmt,u8* dst)
+	{
+		SectorFormat secfmt=RawSectorFormat(this->fmt);
+		u8* src=GetSector(FAD);
+
+		//past the end of the image, like a short read leaves dst alone
+		if (!src)
+			return;
+
+		u32 avail=(u32)((data+size-src)/this->fmt);
+		count=min(count,avail);
+
+		if (SectorCopyOnly(secfmt,fmt))
+		{
+			memcpy(dst,src,count*fmt);
+			return;
+		}
+
+		for (u32 i=0;i<count;i++)
+			ConvertSectorFrom(src+i*this->fmt,secfmt,dst+i*fmt,fmt,FAD+i);
+	}
+
+	virtual ~MappedTrackFile()
+	{
+		ReleaseImage(map);
+	}
+};
+
+//maps the file if possible, takes ownership of it either way
+TrackFile* OpenTrackFile(core_file* file,u32 file_offs,u32 first_fad,u32 secfmt);
+
 DiscType GuessDiscType(bool m1, bool m2, bool da);
 
 extern void gd_setdisc();
@@ -90,7 +90,7 @@ Disc* load_gdi(const char* file)
 		if (SSIZE!=0)
 		{
 			strcpy(pathptr, track_filename.c_str());
-			t.file = new RawTrackFile(core_fopen(path),OFFSET,t.StartFAD,SSIZE);	
+			t.file = OpenTrackFile(core_fopen(path),OFFSET,t.StartFAD,SSIZE);	
 		}
 		disc->tracks.push_back(t);
 	}
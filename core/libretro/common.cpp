@@ -93,6 +93,8 @@ void os_MakeExecutable(void* ptr, u32 sz)
 bool VramLockedWrite(u8* address);
 bool ngen_Rewrite(size_t &addr, size_t retadr, size_t acc);
 bool BM_LockedWrite(u8* address);
+bool bm_RamLockedWrite(u8* address);
+bool sh4_int_RamLockedWrite(u8* address);
 
 static LONG ExceptionHandler(EXCEPTION_POINTERS *ExceptionInfo)
 {
@@ -115,6 +117,12 @@ static LONG ExceptionHandler(EXCEPTION_POINTERS *ExceptionInfo)
    if (BM_LockedWrite(address))
       return EXCEPTION_CONTINUE_EXECUTION;
 #endif
+#if FEAT_SHREC != DYNAREC_NONE
+   if (bm_RamLockedWrite(address))
+      return EXCEPTION_CONTINUE_EXECUTION;
+#endif
+   if (sh4_int_RamLockedWrite(address))
+      return EXCEPTION_CONTINUE_EXECUTION;
 #if FEAT_SHREC == DYNAREC_JIT && HOST_CPU == CPU_X86
    if ( ngen_Rewrite((size_t&)ep->ContextRecord->Eip,*(size_t*)ep->ContextRecord->Esp,ep->ContextRecord->Eax) )
    {
@@ -124,6 +132,9 @@ static LONG ExceptionHandler(EXCEPTION_POINTERS *ExceptionInfo)
       ep->ContextRecord->Ecx=ep->ContextRecord->Eax;
       return EXCEPTION_CONTINUE_EXECUTION;
    }
+#elif FEAT_SHREC == DYNAREC_JIT && HOST_CPU == CPU_X64
+   if (ngen_Rewrite((size_t&)ep->ContextRecord->Rip, 0, 0))
+      return EXCEPTION_CONTINUE_EXECUTION;
 #endif
    else
    {
@@ -317,6 +328,8 @@ bool ngen_Rewrite(size_t& addr,size_t retadr,size_t acc);
 u32* ngen_readm_fail_v2(u32* ptr,u32* regs,u32 saddr);
 bool VramLockedWrite(u8* address);
 bool BM_LockedWrite(u8* address);
+bool bm_RamLockedWrite(u8* address);
+bool sh4_int_RamLockedWrite(u8* address);
 
 #ifdef __MACH__
 static void sigill_handler(int sn, siginfo_t * si, void *segfault_ctx)
@@ -359,6 +372,12 @@ printf("mprot hit @ ptr 0x%08X @@ code: %08X, %d\n", ctx.pc, dyna_cde);
    if (BM_LockedWrite((u8*)si->si_addr))
       return;
 #endif
+#if FEAT_SHREC != DYNAREC_NONE
+   if (bm_RamLockedWrite((u8*)si->si_addr))
+      return;
+#endif
+   if (sh4_int_RamLockedWrite((u8*)si->si_addr))
+      return;
 #if FEAT_SHREC == DYNAREC_JIT
 #if HOST_CPU==CPU_ARM
    if (dyna_cde)
@@ -378,7 +397,8 @@ printf("mprot hit @ ptr 0x%08X @@ code: %08X, %d\n", ctx.pc, dyna_cde);
       context_to_segfault(&ctx, segfault_ctx);
    }
 #elif HOST_CPU == CPU_X64
-   //x64 has no rewrite support
+   if (dyna_cde && ngen_Rewrite((size_t&)ctx.pc, 0, 0))
+      context_to_segfault(&ctx, segfault_ctx);
 #else
 #error JIT: Not supported arch
 #endif
@@ -11,6 +11,7 @@
 #include <glsm/glsm.h>
 #endif
 #include "../rend/rend.h"
+#include "serialize.h"
 
 #include "libretro.h"
 
@@ -127,6 +128,14 @@ void retro_set_environment(retro_environment_t cb)
             ,
       },
 #endif
+      {
+         "reicast_block_cache",
+         "Persistent block cache (restart); enabled|disabled",
+      },
+      {
+         "reicast_chd_cache_size",
+         "CHD hunk cache size (restart); 64|16|32|128|256",
+      },
       {
          "reicast_boot_to_bios",
          "Boot to BIOS (restart); disabled|enabled",
@@ -135,6 +144,28 @@ void retro_set_environment(retro_environment_t cb)
          "reicast_internal_resolution",
          "Internal resolution (restart); 640x480|1280x960|1920x1440|2560x1920|3200x2400|3840x2880|4480x3360|5120x3840|5760x4320|6400x4800|7040x5280|7680x5760|8320x6240|8960x6720|9600x7200|10240x7680|10880x8160|11520x8640|12160x9120|12800x9600",
       },
+#if HOST_CPU == CPU_X86 || HOST_CPU == CPU_X64
+      {
+         "reicast_renderer",
+         "Renderer (restart); hardware|software",
+      },
+#ifndef TARGET_NO_THREADS
+      {
+         "reicast_softrend_threads",
+         "Software renderer threads (restart); auto|1|2|4|8|16|32",
+      },
+#endif
+#endif
+      {
+         "reicast_incremental_ta",
+         "Incremental TA parsing (restart); disabled|enabled",
+      },
+#if FEAT_AREC == DYNAREC_JIT && HOST_CPU == CPU_X64
+      {
+         "reicast_arm7_rec",
+         "ARM7 recompiler (experimental); disabled|enabled",
+      },
+#endif
       {
          "reicast_mipmapping",
          "Mipmapping; enabled|disabled",
@@ -217,6 +248,11 @@ void retro_deinit(void)
 
 bool enable_rtt     = true;
 static bool is_dupe = false;
+static bool soft_render = false;   //picked once, on load
+
+#if HOST_CPU == CPU_X86 || HOST_CPU == CPU_X64
+extern u32 softrend_pixels[];
+#endif
 
 static void update_variables(void)
 {
@@ -241,6 +277,45 @@ static void update_variables(void)
       fprintf(stderr, "[reicast]: Got size: %u x %u.\n", screen_width, screen_height);
    }
 
+   var.key = "reicast_renderer";
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+      settings.pvr.rend = !strcmp("software", var.value) ? 1 : 0;
+   else
+      settings.pvr.rend = 0;
+
+   //the software renderer only draws at native resolution
+   if (settings.pvr.rend == 1)
+   {
+      screen_width  = 640;
+      screen_height = 480;
+   }
+
+   //the tile workers only exist in threaded builds
+   settings.pvr.MaxThreads = 0;
+#ifndef TARGET_NO_THREADS
+   var.key = "reicast_softrend_threads";
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+      settings.pvr.MaxThreads = atoi(var.value);
+#endif
+
+   var.key = "reicast_incremental_ta";
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+      settings.pvr.ta_incremental = !strcmp("enabled", var.value) ? 1 : 0;
+   else
+      settings.pvr.ta_incremental = 0;
+
+#if FEAT_AREC == DYNAREC_JIT && HOST_CPU == CPU_X64
+   var.key = "reicast_arm7_rec";
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+      settings.aica.ArmRec = !strcmp("enabled", var.value);
+   else
+      settings.aica.ArmRec = false;
+#endif
+
    var.key = "reicast_cpu_mode";
 
    if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
@@ -251,6 +326,20 @@ static void update_variables(void)
          settings.dynarec.Type = 1;
    }
 
+   var.key = "reicast_block_cache";
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+      settings.dynarec.BlockCache = (strcmp("disabled", var.value) != 0);
+   else
+      settings.dynarec.BlockCache = true;
+
+   var.key = "reicast_chd_cache_size";
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+      settings.imgread.ChdCacheHunks = atoi(var.value);
+   else
+      settings.imgread.ChdCacheHunks = 64;
+
    var.key = "reicast_boot_to_bios";
 
    if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
@@ -413,6 +502,11 @@ void retro_run (void)
 
    dc_run();
 #if defined(HAVE_OPENGL) || defined(HAVE_OPENGLES)
+#if HOST_CPU == CPU_X86 || HOST_CPU == CPU_X64
+   if (soft_render)
+      video_cb(is_dupe ? NULL : softrend_pixels, 640, 480, 640 * sizeof(u32));
+   else
+#endif
    video_cb(is_dupe ? 0 : RETRO_HW_FRAME_BUFFER_VALID, screen_width, screen_height, 0);
 #endif
    is_dupe     = true;
@@ -570,7 +664,13 @@ bool retro_load_game(const struct retro_game_info *game)
       }
    }
 
+   soft_render = settings.pvr.rend == 1;
+
 #if defined(HAVE_OPENGL) || defined(HAVE_OPENGLES)
+   //no gl context at all, so it also runs where there's no gpu
+   if (soft_render)
+      return true;
+
    params.context_reset         = context_reset;
    params.context_destroy       = context_destroy;
    params.environ_cb            = environ_cb;
@@ -612,17 +712,24 @@ size_t retro_get_memory_size(unsigned type)
 
 size_t retro_serialize_size (void)
 {
-   return 0; //TODO
+   //fixed, rewind and netplay want the same size every time
+   return ser_Size();
 }
 
 bool retro_serialize(void *data, size_t size)
 {
-   return false; //TODO
+   if (first_run)
+      return false;
+
+   return ser_Save(data, size);
 }
 
 bool retro_unserialize(const void * data, size_t size)
 {
-   return false; //TODO
+   if (first_run)
+      return false;
+
+   return ser_Load(data, size);
 }
 
 // Cheats
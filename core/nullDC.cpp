@@ -15,6 +15,10 @@
 
 #include "reios/reios.h"
 
+#if FEAT_SHREC != DYNAREC_NONE
+#include "hw/sh4/dyna/blockcache.h"
+#endif
+
 settings_t settings;
 
 extern char game_dir[1024];
@@ -168,6 +172,32 @@ static void LoadSpecialSettings(void)
    }
 }
 
+#if FEAT_SHREC != DYNAREC_NONE
+static void InitBlockCache(void)
+{
+   char name[32];
+   unsigned i, len = 0;
+
+   /* one cache per game, named after the product number */
+   for (i = 0; i < 10 && reios_product_number[i]; i++)
+   {
+      if (isalnum(reios_product_number[i]) || reios_product_number[i] == '-')
+         name[len++] = reios_product_number[i];
+   }
+
+   if (len == 0)
+      return;
+
+   name[len] = 0;
+
+#ifdef _WIN32
+   bc_Init(get_writable_data_path("data\\") + name + ".bcache");
+#else
+   bc_Init(get_writable_data_path("data/") + name + ".bcache");
+#endif
+}
+#endif
+
 int dc_init(int argc,wchar* argv[])
 {
 	setbuf(stdin,0);
@@ -228,6 +258,11 @@ int dc_init(int argc,wchar* argv[])
 
    LoadSpecialSettings();
 
+#if FEAT_SHREC != DYNAREC_NONE
+   if (settings.dynarec.Enable && settings.dynarec.BlockCache)
+      InitBlockCache();
+#endif
+
 	return rv;
 }
 
@@ -262,13 +297,12 @@ void LoadSettings(void)
    settings.aica.NoSound			= 0;
 	settings.pvr.subdivide_transp	= 0;
 	settings.pvr.ta_skip			   = 0;
-	settings.pvr.rend				   = 0;
    settings.QueueRender          = 0;
    settings.pvr.Emulation.AlphaSortMode = 0;
    settings.pvr.Emulation.zMin         = 0.f;
    settings.pvr.Emulation.zMax         = 1.0f;
+	//pvr.rend, pvr.MaxThreads and pvr.ta_incremental come from the core options
 
-	settings.pvr.MaxThreads			      = 3;
 	settings.pvr.SynchronousRendering	= 0;
 
 	settings.debug.SerialConsole        = 0;
@@ -11,8 +11,153 @@
 #include "hw/sh4/dyna/ngen.h"
 #include "hw/sh4/sh4_mem.h"
 #include "hw/sh4/dyna/regalloc.h"
+#include "hw/mem/_vmem.h"
 
 extern int cycle_counter;
+extern bool inside_loop;
+
+class BlockCompilerx64;
+
+typedef Xbyak::Operand::Code x64_reg;
+
+//Only callee saved registers are allocated, so spans survive the calls to the memory handlers
+//and the canonical implementations. xmm8-15 are volatile on SysV and get saved around calls.
+static const x64_reg alloc_regs[] =
+{
+	Xbyak::Operand::RBX, Xbyak::Operand::RBP,
+	Xbyak::Operand::R12, Xbyak::Operand::R13,
+	Xbyak::Operand::R14, Xbyak::Operand::R15,
+	(x64_reg)-1
+};
+
+static const s8 alloc_fpu[] = { 8, 9, 10, 11, 12, 13, 14, 15, -1 };
+
+#define ALLOC_FPU_COUNT 8
+
+//shadow space + xmm save slots, set up once by the dispatcher and shared by all blocks
+#define FRAME_XMM_SAVE 0x20
+#define FRAME_SIZE (FRAME_XMM_SAVE + ALLOC_FPU_COUNT * 16)
+
+//win64 also saves xmm6-15 for the host, the extra 8 bytes realign rsp after the pushes
+#ifdef _WIN32
+#define DISPATCHER_STACK (FRAME_SIZE + 10 * 16 + 8)
+#else
+#define DISPATCHER_STACK (FRAME_SIZE + 8)
+#endif
+
+//Entry points generated by ngen_init_x64, they live below the cache base so clears keep them
+static void (*mainloop)(void* cntx);
+static const void* no_update;
+static const void* intc_sched;
+static const void* link_generic;
+static const void* link_cond_branch;
+static const void* link_cond_next;
+static const void* block_check_fail;
+static const void* block_promote;
+
+//Return address stack, calls push the return pc and the code found for it at the time,
+//returns that hit the top entry jump there directly instead of going through the fpcb
+#define RAS_SIZE 32
+
+struct x64_ras_entry
+{
+	u32 pc;
+	DynarecCodeEntryPtr code;
+};
+
+static x64_ras_entry ras[RAS_SIZE];
+static u32 ras_top;
+
+//Fastmem sites load the guest address masked to 29 bits from virt_ram_base. The sites have a
+//fixed size, so a faulting one can be patched into a call to its slow path stub.
+#define FASTMEM_ACCESS_SIZE 5
+
+enum fastmem_kind
+{
+	FMK_Read8, FMK_Read16, FMK_Read32, FMK_Read64,
+	FMK_Write8, FMK_Write16, FMK_Write32, FMK_Write64,
+	FMK_Count
+};
+
+static const void* mem_slow[FMK_Count];
+static u32 fastmem_prefix;
+
+//blocks up to this size compare their code inline, longer ones compare a hash of it
+#define CHECK_INLINE_MAX 64
+
+static u32 DYNACALL CodeHash(const u8* code, u32 size)
+{
+	u64 hash = 0xcbf29ce484222325ULL;
+
+	for (u32 i = 0; i < size; i += 2)
+	{
+		hash ^= *(u16*)&code[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return (u32)(hash ^ (hash >> 32));
+}
+
+//jumps to the block for the pc in eax, the pc must already be in next_pc
+static void GenDispatch(Xbyak::CodeGenerator& cg)
+{
+	cg.shr(cg.eax, 1);
+	cg.and_(cg.eax, FPCB_MASK);
+	cg.mov(cg.rdx, (size_t)&sh4rcb.fpcb[0]);
+	cg.jmp(cg.qword[cg.rdx + cg.rax * 8]);
+}
+
+//The relinkable part of a static or conditional block end. It always has the same size,
+//a rel32 jmp to a linked block or a rel32 call to a link stub, which uses the return address
+//to find the block. Conditional ends expect the flags from the compare before relink_offset.
+static void GenLink(Xbyak::CodeGenerator& cg, RuntimeBlockInfo* block)
+{
+	switch (block->BlockType)
+	{
+	case BET_StaticJump:
+	case BET_StaticCall:
+		if (block->pBranchBlock)
+			cg.jmp((const void*)block->pBranchBlock->code, Xbyak::CodeGenerator::T_NEAR);
+		else
+			cg.call(link_generic);
+		break;
+
+	case BET_Cond_0:
+	case BET_Cond_1:
+		{
+			Xbyak::Label branch_not_taken;
+
+			cg.jne(branch_not_taken, Xbyak::CodeGenerator::T_SHORT);
+
+			if (block->pBranchBlock)
+				cg.jmp((const void*)block->pBranchBlock->code, Xbyak::CodeGenerator::T_NEAR);
+			else
+				cg.call(link_cond_branch);
+
+			cg.L(branch_not_taken);
+
+			if (block->pNextBlock)
+				cg.jmp((const void*)block->pNextBlock->code, Xbyak::CodeGenerator::T_NEAR);
+			else
+				cg.call(link_cond_next);
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+struct x64_reg_alloc: RegAlloc<x64_reg, s8, false>
+{
+	BlockCompilerx64* compiler;
+
+	virtual void Preload(u32 reg, x64_reg nreg);
+	virtual void Writeback(u32 reg, x64_reg nreg);
+
+	virtual void Preload_FPU(u32 reg, s8 nreg);
+	virtual void Writeback_FPU(u32 reg, s8 nreg);
+};
 
 class BlockCompilerx64 : public Xbyak::CodeGenerator{
 public:
@@ -21,6 +166,8 @@ public:
 	vector<Xbyak::Reg64> call_regs64;
 	vector<Xbyak::Xmm> call_regsxmm;
 
+	x64_reg_alloc reg;
+
 	BlockCompilerx64() : Xbyak::CodeGenerator(64 * 1024, emit_GetCCPtr()) {
 #ifdef _WIN32
       call_regs.push_back(ecx);
@@ -48,42 +195,451 @@ public:
 		call_regsxmm.push_back(xmm1);
 		call_regsxmm.push_back(xmm2);
 		call_regsxmm.push_back(xmm3);
+
+		reg.compiler = this;
 	}
 
-#define sh_to_reg(prm, op, rd) \
-			if (prm.is_imm())			\
-				op(rd, prm._imm);	\
-			else if (prm.is_reg()) \
-         {							\
-				mov(rax, (size_t)prm.reg_ptr());	\
-				op(rd, dword[rax]);				\
+	Xbyak::Reg32 mapg(const shil_param& prm) { return Xbyak::Reg32(reg.mapg(prm)); }
+	Xbyak::Xmm mapf(const shil_param& prm) { return Xbyak::Xmm(reg.mapf(prm)); }
+
+	//r11 is volatile on both abis and never holds a parameter, so it is used to address the context
+	void load_u32(const Xbyak::Reg32& rd, const shil_param& prm)
+	{
+		if (prm.is_imm())
+			mov(rd, prm._imm);
+		else if (reg.IsAllocg(prm))
+		{
+			if (mapg(prm) != rd)
+				mov(rd, mapg(prm));
+		}
+		else if (reg.IsAllocf(prm))
+			movd(rd, mapf(prm));
+		else if (prm.is_reg())
+		{
+			mov(r11, (size_t)prm.reg_ptr());
+			mov(rd, dword[r11]);
+		}
+	}
+
+	void store_u32(const shil_param& prm, const Xbyak::Reg32& rs)
+	{
+		if (reg.IsAllocg(prm))
+		{
+			if (mapg(prm) != rs)
+				mov(mapg(prm), rs);
+		}
+		else if (reg.IsAllocf(prm))
+			movd(mapf(prm), rs);
+		else
+		{
+			mov(r11, (size_t)prm.reg_ptr());
+			mov(dword[r11], rs);
+		}
+	}
+
+	void load_f32(const Xbyak::Xmm& rd, const shil_param& prm)
+	{
+		if (prm.is_imm())
+		{
+			mov(eax, prm._imm);
+			movd(rd, eax);
+		}
+		else if (reg.IsAllocf(prm))
+		{
+			if (mapf(prm) != rd)
+				movss(rd, mapf(prm));
+		}
+		else if (reg.IsAllocg(prm))
+			movd(rd, mapg(prm));
+		else if (prm.is_reg())
+		{
+			mov(r11, (size_t)prm.reg_ptr());
+			movss(rd, dword[r11]);
+		}
+	}
+
+	void store_f32(const shil_param& prm, const Xbyak::Xmm& rs)
+	{
+		if (reg.IsAllocf(prm))
+		{
+			if (mapf(prm) != rs)
+				movss(mapf(prm), rs);
+		}
+		else if (reg.IsAllocg(prm))
+			movd(mapg(prm), rs);
+		else
+		{
+			mov(r11, (size_t)prm.reg_ptr());
+			movss(dword[r11], rs);
+		}
+	}
+
+	//the destination register of an integer op, eax if rd is not allocated or
+	//if writing to it early would clobber rs2
+	Xbyak::Reg32 dest_u32(const shil_opcode& op)
+	{
+		if (!reg.IsAllocg(op.rd))
+			return eax;
+
+		if (op.rs2.is_reg() && op.rs2._reg == op.rd._reg && !(op.rs1.is_reg() && op.rs1._reg == op.rd._reg))
+			return eax;
+
+		return mapg(op.rd);
+	}
+
+	Xbyak::Xmm dest_f32(const shil_opcode& op)
+	{
+		if (!reg.IsAllocf(op.rd))
+			return xmm0;
+
+		if (op.rs2.is_reg() && op.rs2._reg == op.rd._reg && !(op.rs1.is_reg() && op.rs1._reg == op.rd._reg))
+			return xmm0;
+
+		return mapf(op.rd);
+	}
+
+	//rs2 as an operand: the allocated register, or ecx/xmm1 loaded from the context
+	const Xbyak::Operand& src2_u32(const shil_opcode& op, Xbyak::Reg32& tmp)
+	{
+		if (reg.IsAllocg(op.rs2))
+			tmp = mapg(op.rs2);
+		else
+		{
+			tmp = ecx;
+			load_u32(ecx, op.rs2);
+		}
+		return tmp;
+	}
+
+	const Xbyak::Operand& src2_f32(const shil_opcode& op, Xbyak::Xmm& tmp)
+	{
+		if (reg.IsAllocf(op.rs2))
+			tmp = mapf(op.rs2);
+		else
+		{
+			tmp = xmm1;
+			load_f32(xmm1, op.rs2);
+		}
+		return tmp;
+	}
+
+	//xmm8-15 are callee saved on win64, so the dispatcher takes care of them there
+	void SaveXmm()
+	{
+#ifndef _WIN32
+		for (int i = 0; alloc_fpu[i] != -1; i++)
+			if (reg.SpanNRegfIntr(reg.current_opid, alloc_fpu[i]))
+				movss(dword[rsp + FRAME_XMM_SAVE + i * 16], Xbyak::Xmm(alloc_fpu[i]));
+#endif
+	}
+
+	void RestoreXmm()
+	{
+#ifndef _WIN32
+		for (int i = 0; alloc_fpu[i] != -1; i++)
+			if (reg.SpanNRegfIntr(reg.current_opid, alloc_fpu[i]))
+				movss(Xbyak::Xmm(alloc_fpu[i]), dword[rsp + FRAME_XMM_SAVE + i * 16]);
+#endif
+	}
+
+	void GenRasPush(u32 ret_pc)
+	{
+		mov(rax, (size_t)&ras_top);
+		mov(ecx, dword[rax]);
+		inc(ecx);
+		and_(ecx, RAS_SIZE - 1);
+		mov(dword[rax], ecx);
+		shl(ecx, 4);
+		mov(rdx, (size_t)ras);
+		add(rdx, rcx);
+		mov(dword[rdx], ret_pc);
+		mov(rax, (size_t)&FPCA(ret_pc));
+		mov(rax, qword[rax]);
+		mov(qword[rdx + 8], rax);
+	}
+
+	//expects the return pc in eax, falls through when it misses
+	void GenRasPop()
+	{
+		Xbyak::Label miss;
+
+		mov(rcx, (size_t)&ras_top);
+		mov(edx, dword[rcx]);
+		lea(r8d, ptr[rdx - 1]);
+		and_(r8d, RAS_SIZE - 1);
+		mov(dword[rcx], r8d);
+		shl(edx, 4);
+		mov(rcx, (size_t)ras);
+		add(rcx, rdx);
+		cmp(dword[rcx], eax);
+		jne(miss, T_SHORT);
+		jmp(qword[rcx + 8]);
+		L(miss);
+	}
+
+	//address in call_regs[0], value in call_regs[1] for writes, the result of reads in eax/rax
+	void GenFastmem(u32 size, bool write)
+	{
+		size_t start = getSize();
+
+		mov(r11, (size_t)virt_ram_base);
+		mov(eax, call_regs[0]);
+		and_(eax, 0x1FFFFFFF);
+
+		u32 prefix = getSize() - start;
+		verify(fastmem_prefix == 0 || fastmem_prefix == prefix);
+		fastmem_prefix = prefix;
+
+		int idx = call_regs[1].getIdx();
+
+		if (!write)
+		{
+			switch (size)
+			{
+			case 1: movsx(eax, byte[r11 + rax]); break;
+			case 2: movsx(eax, word[r11 + rax]); break;
+			case 4: mov(eax, dword[r11 + rax]); break;
+			case 8: mov(rax, qword[r11 + rax]); break;
+			default: die("1..8 bytes");
+			}
+		}
+		else
+		{
+			switch (size)
+			{
+			case 1: mov(byte[r11 + rax], Xbyak::Reg8(idx, true)); break;
+			case 2: mov(word[r11 + rax], Xbyak::Reg16(idx)); break;
+			case 4: mov(dword[r11 + rax], Xbyak::Reg32(idx)); break;
+			case 8: mov(qword[r11 + rax], Xbyak::Reg64(idx)); break;
+			default: die("1..8 bytes");
+			}
+		}
+
+		while (getSize() - start < prefix + FASTMEM_ACCESS_SIZE)
+			nop();
+	}
+
+	//compares the guest code of the block with what it was compiled from
+	void GenCheck(RuntimeBlockInfo* block, Xbyak::Label& fail)
+	{
+		u8* ptr = GetMemPtr(block->addr, block->sh4_code_size);
+		if (!ptr)
+			return;
+
+		u32 size = block->sh4_code_size;
+
+		if (size > CHECK_INLINE_MAX)
+		{
+			mov(call_regs64[0], (size_t)ptr);
+			mov(call_regs[1], size);
+			call((void*)CodeHash);
+			cmp(eax, CodeHash(ptr, size));
+			jne(fail, T_NEAR);
+			return;
+		}
+
+		mov(rax, (size_t)ptr);
+
+		u32 offs = 0;
+		while (offs < size)
+		{
+			if (size - offs >= 8)
+			{
+				mov(rcx, *(u64*)&ptr[offs]);
+				cmp(qword[rax + offs], rcx);
+				offs += 8;
+			}
+			else if (size - offs >= 4)
+			{
+				cmp(dword[rax + offs], *(u32*)&ptr[offs]);
+				offs += 4;
+			}
+			else
+			{
+				cmp(word[rax + offs], (u32)(s32)*(s16*)&ptr[offs]);
+				offs += 2;
+			}
+			jne(fail, T_NEAR);
+		}
+	}
+
+	void GenCall(const void* function)
+	{
+		SaveXmm();
+		call(function);
+		RestoreXmm();
+	}
+
+	void GenBinaryOp(shil_opcode& op)
+	{
+		Xbyak::Reg32 rd = dest_u32(op);
+		load_u32(rd, op.rs1);
+
+		if (op.rs2.is_imm())
+		{
+			switch (op.op)
+			{
+			case shop_and: and_(rd, op.rs2._imm); break;
+			case shop_or:  or_(rd, op.rs2._imm); break;
+			case shop_xor: xor_(rd, op.rs2._imm); break;
+			case shop_add: add(rd, op.rs2._imm); break;
+			case shop_sub: sub(rd, op.rs2._imm); break;
+			default: die("Invalid binary op");
+			}
+		}
+		else
+		{
+			Xbyak::Reg32 tmp;
+			const Xbyak::Operand& rs2 = src2_u32(op, tmp);
+
+			switch (op.op)
+			{
+			case shop_and: and_(rd, rs2); break;
+			case shop_or:  or_(rd, rs2); break;
+			case shop_xor: xor_(rd, rs2); break;
+			case shop_add: add(rd, rs2); break;
+			case shop_sub: sub(rd, rs2); break;
+			default: die("Invalid binary op");
+			}
+		}
+
+		store_u32(op.rd, rd);
+	}
+
+	void GenShiftOp(shil_opcode& op)
+	{
+		Xbyak::Reg32 rd = dest_u32(op);
+
+		if (op.rs2.is_imm())
+		{
+			load_u32(rd, op.rs1);
+			int amt = op.rs2._imm & 0x1f;
+
+			switch (op.op)
+			{
+			case shop_shl: shl(rd, amt); break;
+			case shop_shr: shr(rd, amt); break;
+			case shop_sar: sar(rd, amt); break;
+			case shop_ror: ror(rd, amt); break;
+			default: die("Invalid shift op");
 			}
+		}
+		else
+		{
+			load_u32(rd, op.rs1);
+			load_u32(ecx, op.rs2);
+
+			switch (op.op)
+			{
+			case shop_shl: shl(rd, cl); break;
+			case shop_shr: shr(rd, cl); break;
+			case shop_sar: sar(rd, cl); break;
+			case shop_ror: ror(rd, cl); break;
+			default: die("Invalid shift op");
+			}
+		}
+
+		store_u32(op.rd, rd);
+	}
+
+	void GenCompareOp(shil_opcode& op)
+	{
+		Xbyak::Reg32 rs1 = eax;
+		if (reg.IsAllocg(op.rs1))
+			rs1 = mapg(op.rs1);
+		else
+			load_u32(eax, op.rs1);
+
+		if (op.rs2.is_imm())
+		{
+			if (op.op == shop_test)
+				test(rs1, op.rs2._imm);
+			else
+				cmp(rs1, op.rs2._imm);
+		}
+		else
+		{
+			Xbyak::Reg32 tmp;
+			const Xbyak::Operand& rs2 = src2_u32(op, tmp);
 
-#define sh_to_reg_noimm(prm, op, rd) \
-			if (prm.is_reg()) {							\
-				mov(rax, (size_t)prm.reg_ptr());	\
-				op(rd, dword[rax]);				\
-				}
+			if (op.op == shop_test)
+				test(rs1, (const Xbyak::Reg32&)rs2);
+			else
+				cmp(rs1, rs2);
+		}
+
+		switch (op.op)
+		{
+		case shop_test:
+		case shop_seteq: sete(al); break;
+		case shop_setge: setge(al); break;
+		case shop_setgt: setg(al); break;
+		case shop_setae: setae(al); break;
+		case shop_setab: seta(al); break;
+		default: die("Invalid compare op");
+		}
+
+		movzx(eax, al);
+		store_u32(op.rd, eax);
+	}
+
+	void GenFloatOp(shil_opcode& op)
+	{
+		Xbyak::Xmm rd = dest_f32(op);
+		load_f32(rd, op.rs1);
 
-#define reg_to_sh(prm, rs) \
-   mov(rax, (size_t)prm.reg_ptr()); \
-   mov(dword[rax], rs)
+		Xbyak::Xmm tmp;
+		const Xbyak::Operand& rs2 = src2_f32(op, tmp);
 
-#define reg_to_sh_ss(prm, rs) \
-   mov(rax, (size_t)prm.reg_ptr()); \
-   movss(dword[rax], rs)
+		switch (op.op)
+		{
+		case shop_fadd: addss(rd, rs2); break;
+		case shop_fsub: subss(rd, rs2); break;
+		case shop_fmul: mulss(rd, rs2); break;
+		case shop_fdiv: divss(rd, rs2); break;
+		default: die("Invalid float op");
+		}
+
+		store_f32(op.rd, rd);
+	}
 
 	void compile(RuntimeBlockInfo* block, bool force_checks, bool reset, bool staging, bool optimise)
    {
-		mov(rax, (size_t)&cycle_counter);
+		//staging blocks skip the allocation, all their operands go through the context
+		if (!staging)
+			reg.DoAlloc(block, alloc_regs, alloc_fpu);
 
-		sub(dword[rax], block->guest_cycles);
+		//blocks run in the dispatcher frame, so there is no prologue besides the checks
+		Xbyak::Label body;
+		Xbyak::Label check_fail;
+		Xbyak::Label promote;
 
-		sub(rsp, 0x28);
+		if (force_checks)
+			GenCheck(block, check_fail);
+
+		//the block manager evicts the blocks that run the least
+		mov(rax, (size_t)&block->runs);
+		inc(dword[rax]);
+
+		if (staging)
+		{
+			mov(rax, (size_t)&block->staging_runs);
+			dec(dword[rax]);
+			jz(promote, T_NEAR);
+		}
+
+		mov(rax, (size_t)&cycle_counter);
+		sub(dword[rax], block->guest_cycles);
+		jg(body, T_SHORT);
+		call(intc_sched);
+		L(body);
 
 		for (size_t i = 0; i < block->oplist.size(); i++)
       {
          shil_opcode& op  = block->oplist[i];
+
+         reg.OpBegin(&op, i);
+
          switch (op.op)
          {
 
@@ -96,100 +652,342 @@ public:
 
                mov(call_regs[0], op.rs3._imm);
 
-               call((void*)OpDesc[op.rs3._imm]->oph);
+               GenCall((void*)OpDesc[op.rs3._imm]->oph);
                break;
 
             case shop_jcond:
             case shop_jdyn:
-               mov(rax, (size_t)op.rs1.reg_ptr());
+               {
+                  Xbyak::Reg32 rd = reg.IsAllocg(op.rd) ? mapg(op.rd) : eax;
 
-               mov(ecx, dword[rax]);
+                  load_u32(rd, op.rs1);
 
-               if (op.rs2.is_imm())
-                  add(ecx, op.rs2._imm);
+                  if (op.rs2.is_imm())
+                     add(rd, op.rs2._imm);
 
-               mov(rdx, (size_t)op.rd.reg_ptr());
-               mov(dword[rdx], ecx);
+                  store_u32(op.rd, rd);
+               }
+               break;
+
+            case shop_jexit:
+               {
+                  Xbyak::Label stay;
+
+                  load_u32(eax, op.rs1);
+                  cmp(eax, op.rs2._imm);
+                  jne(stay, T_NEAR);
+
+                  if (op.flags)
+                  {
+                     mov(rax, (size_t)&cycle_counter);
+                     add(dword[rax], op.flags);
+                  }
+
+                  mov(eax, op.rs3._imm);
+                  mov(rdx, (size_t)&next_pc);
+                  mov(dword[rdx], eax);
+                  GenDispatch(*this);
+
+                  L(stay);
+               }
                break;
 
             case shop_mov32:
-               sh_to_reg(op.rs1, mov, ecx);
-               reg_to_sh(op.rd, ecx);
+               if (reg.IsAllocf(op.rd))
+                  load_f32(mapf(op.rd), op.rs1);
+               else if (reg.IsAllocg(op.rd))
+                  load_u32(mapg(op.rd), op.rs1);
+               else if (reg.IsAllocf(op.rs1))
+                  store_f32(op.rd, mapf(op.rs1));
+               else
+               {
+                  load_u32(eax, op.rs1);
+                  store_u32(op.rd, eax);
+               }
                break;
 
             case shop_mov64:
-               sh_to_reg(op.rs1, mov, rcx);
-               reg_to_sh(op.rd, rcx);
+               mov(rax, (size_t)op.rs1.reg_ptr());
+               mov(rax, qword[rax]);
+               mov(rcx, (size_t)op.rd.reg_ptr());
+               mov(qword[rcx], rax);
                break;
 
             case shop_readm:
                {
-                  sh_to_reg(op.rs1, mov, call_regs[0]);
-                  sh_to_reg(op.rs3, add, call_regs[0]);
+                  load_u32(call_regs[0], op.rs1);
+                  if (op.rs3.is_imm())
+                     add(call_regs[0], op.rs3._imm);
+                  else if (reg.IsAllocg(op.rs3))
+                     add(call_regs[0], mapg(op.rs3));
+                  else if (op.rs3.is_reg())
+                  {
+                     load_u32(eax, op.rs3);
+                     add(call_regs[0], eax);
+                  }
 
                   u32 size = op.flags & 0x7f;
 
-                  switch (size)
+                  if (_nvmem_enabled())
+                     GenFastmem(size, false);
+                  else
+                  {
+                     switch (size)
+                     {
+                        case 1:
+                           GenCall((void*)ReadMem8);
+                           movsx(eax, al);
+                           break;
+                        case 2:
+                           GenCall((void*)ReadMem16);
+                           movsx(eax, ax);
+                           break;
+                        case 4:
+                           GenCall((void*)ReadMem32);
+                           break;
+                        case 8:
+                           GenCall((void*)ReadMem64);
+                           break;
+                        default:
+                           die("1..8 bytes");
+                           break;
+                     }
+                  }
+
+                  if (size == 8)
                   {
-                     case 1:
-                        call((void*)ReadMem8);
-                        movsx(rcx, al);
-
-                        reg_to_sh(op.rd, ecx);
-                        break;
-                     case 2:
-                        call((void*)ReadMem16);
-                        movsx(rcx, ax);
-
-                        reg_to_sh(op.rd, ecx);
-                        break;
-                     case 4:
-                        call((void*)ReadMem32);
-                        mov(rcx, rax);
-
-                        reg_to_sh(op.rd, ecx);
-                        break;
-                     case 8:
-                        call((void*)ReadMem64);
-                        mov(rcx, rax);
-
-                        reg_to_sh(op.rd, rcx);
-                        break;
-                     default:
-                        die("1..8 bytes");
-                        break;
+                     mov(rcx, (size_t)op.rd.reg_ptr());
+                     mov(qword[rcx], rax);
                   }
+                  else
+                     store_u32(op.rd, eax);
                }
                break;
 
             case shop_writem:
                {
                   u32 size = op.flags & 0x7f;
-                  sh_to_reg(op.rs1, mov, call_regs[0]);
-                  sh_to_reg(op.rs3, add, call_regs[0]);
+                  load_u32(call_regs[0], op.rs1);
+                  if (op.rs3.is_imm())
+                     add(call_regs[0], op.rs3._imm);
+                  else if (reg.IsAllocg(op.rs3))
+                     add(call_regs[0], mapg(op.rs3));
+                  else if (op.rs3.is_reg())
+                  {
+                     load_u32(eax, op.rs3);
+                     add(call_regs[0], eax);
+                  }
+
+                  if (size == 8)
+                  {
+                     mov(rax, (size_t)op.rs2.reg_ptr());
+                     mov(call_regs64[1], qword[rax]);
+                  }
+                  else
+                     load_u32(call_regs[1], op.rs2);
+
+                  if (_nvmem_enabled())
+                     GenFastmem(size, true);
+                  else
+                  {
+                     switch (size)
+                     {
+                        case 1:
+                           GenCall((void*)WriteMem8);
+                           break;
+                        case 2:
+                           GenCall((void*)WriteMem16);
+                           break;
+                        case 4:
+                           GenCall((void*)WriteMem32);
+                           break;
+                        case 8:
+                           GenCall((void*)WriteMem64);
+                           break;
+                        default:
+                           die("1..8 bytes");
+                           break;
+                     }
+                  }
+               }
+               break;
+
+            case shop_and:
+            case shop_or:
+            case shop_xor:
+            case shop_add:
+            case shop_sub:
+               GenBinaryOp(op);
+               break;
+
+            case shop_shl:
+            case shop_shr:
+            case shop_sar:
+               GenShiftOp(op);
+               break;
+
+            case shop_ror:
+               if (op.rs2.is_imm())
+                  GenShiftOp(op);
+               else
+                  shil_chf[op.op](&op);
+               break;
 
-                  switch (size)
+            case shop_not:
+            case shop_neg:
+            case shop_swap:
+            case shop_swaplb:
+               {
+                  Xbyak::Reg32 rd = reg.IsAllocg(op.rd) ? mapg(op.rd) : eax;
+                  load_u32(rd, op.rs1);
+
+                  if (op.op == shop_not)
+                     not_(rd);
+                  else if (op.op == shop_neg)
+                     neg(rd);
+                  else if (op.op == shop_swap)
+                     bswap(rd);
+                  else
                   {
-                     case 1:
-                        sh_to_reg(op.rs2, mov, call_regs[1]);
-                        call((void*)WriteMem8);
-                        break;
-                     case 2:
-                        sh_to_reg(op.rs2, mov, call_regs[1]);
-                        call((void*)WriteMem16);
-                        break;
-                     case 4:
-                        sh_to_reg(op.rs2, mov, call_regs[1]);
-                        call((void*)WriteMem32);
-                        break;
-                     case 8:
-                        sh_to_reg(op.rs2, mov, call_regs64[1]);
-                        call((void*)WriteMem64);
-                        break;
-                     default:
-                        die("1..8 bytes");
-                        break;
+                     if (rd != eax)
+                        mov(eax, rd);
+                     ror(ax, 8);
+                     rd = eax;
                   }
+
+                  store_u32(op.rd, rd);
+               }
+               break;
+
+            case shop_ext_s8:
+            case shop_ext_s16:
+               load_u32(eax, op.rs1);
+               if (op.op == shop_ext_s8)
+                  movsx(eax, al);
+               else
+                  movsx(eax, ax);
+               store_u32(op.rd, eax);
+               break;
+
+            case shop_test:
+            case shop_seteq:
+            case shop_setge:
+            case shop_setgt:
+            case shop_setae:
+            case shop_setab:
+               GenCompareOp(op);
+               break;
+
+            case shop_mul_u16:
+            case shop_mul_s16:
+            case shop_mul_i32:
+               load_u32(eax, op.rs1);
+               load_u32(ecx, op.rs2);
+               if (op.op == shop_mul_u16)
+               {
+                  movzx(eax, ax);
+                  movzx(ecx, cx);
+               }
+               else if (op.op == shop_mul_s16)
+               {
+                  movsx(eax, ax);
+                  movsx(ecx, cx);
+               }
+               imul(eax, ecx);
+               store_u32(op.rd, eax);
+               break;
+
+            case shop_mul_u64:
+            case shop_mul_s64:
+               load_u32(eax, op.rs1);
+               load_u32(ecx, op.rs2);
+               if (op.op == shop_mul_s64)
+               {
+                  movsxd(rax, eax);
+                  movsxd(rcx, ecx);
+               }
+               imul(rax, rcx);
+               store_u32(op.rd, eax);
+               shr(rax, 32);
+               store_u32(op.rd2, eax);
+               break;
+
+            case shop_fadd:
+            case shop_fsub:
+            case shop_fmul:
+            case shop_fdiv:
+               GenFloatOp(op);
+               break;
+
+            case shop_fabs:
+            case shop_fneg:
+               load_u32(eax, op.rs1);
+               if (op.op == shop_fabs)
+                  and_(eax, 0x7FFFFFFF);
+               else
+                  xor_(eax, 0x80000000);
+               store_u32(op.rd, eax);
+               break;
+
+            case shop_fsqrt:
+               {
+                  Xbyak::Xmm rd = reg.IsAllocf(op.rd) ? mapf(op.rd) : xmm0;
+                  load_f32(xmm1, op.rs1);
+                  sqrtss(rd, xmm1);
+                  store_f32(op.rd, rd);
+               }
+               break;
+
+            case shop_fmac:
+               //rd = rs1 + rs2 * rs3, rounded twice like the canonical version
+               load_f32(xmm1, op.rs2);
+               load_f32(xmm2, op.rs3);
+               mulss(xmm1, xmm2);
+               load_f32(xmm0, op.rs1);
+               addss(xmm0, xmm1);
+               store_f32(op.rd, xmm0);
+               break;
+
+            case shop_fseteq:
+            case shop_fsetgt:
+               load_f32(xmm0, op.rs1);
+               load_f32(xmm1, op.rs2);
+               //no parity check, this matches the canonical version built with -ffast-math
+               ucomiss(xmm0, xmm1);
+               if (op.op == shop_fseteq)
+                  sete(al);
+               else
+                  seta(al);
+               movzx(eax, al);
+               store_u32(op.rd, eax);
+               break;
+
+            case shop_cvt_i2f_n:
+            case shop_cvt_i2f_z:
+               {
+                  Xbyak::Xmm rd = reg.IsAllocf(op.rd) ? mapf(op.rd) : xmm0;
+                  load_u32(eax, op.rs1);
+                  cvtsi2ss(rd, eax);
+                  store_f32(op.rd, rd);
+               }
+               break;
+
+            case shop_cvt_f2i_t:
+               //cvttss2si gives 0x80000000 on overflow and NaN. Like the interpreter's
+               //ftrc fixup, positive overflow becomes 0x7FFFFFFF and NaN stays 0x80000000
+               {
+                  Xbyak::Label done;
+
+                  load_f32(xmm0, op.rs1);
+                  cvttss2si(eax, xmm0);
+                  cmp(eax, 0x80000000);
+                  jne(done, T_SHORT);
+                  xorps(xmm1, xmm1);
+                  comiss(xmm0, xmm1);
+                  jbe(done, T_SHORT);   //also taken for NaN
+                  mov(eax, 0x7FFFFFFF);
+                  L(done);
+                  store_u32(op.rd, eax);
                }
                break;
 
@@ -197,39 +995,36 @@ public:
                shil_chf[op.op](&op);
                break;
          }
-      }
 
-		mov(rax, (size_t)&next_pc);
+         reg.OpEnd(&op);
+      }
 
 		switch (block->BlockType) {
 
 		case BET_StaticJump:
+			break;
+
 		case BET_StaticCall:
-			//next_pc = block->BranchBlock;
-			mov(dword[rax], block->BranchBlock);
+			GenRasPush(block->NextBlock);
 			break;
 
 		case BET_Cond_0:
 		case BET_Cond_1:
-			{
-				//next_pc = next_pc_value;
-				//if (*jdyn == 0)
-				//next_pc = branch_pc_value;
-
-				mov(dword[rax], block->NextBlock);
-
-				if (block->has_jcond)
-					mov(rdx, (size_t)&Sh4cntx.jdyn);
-				else
-					mov(rdx, (size_t)&sr.T);
-
-				cmp(dword[rdx], block->BlockType & 1);
-				Xbyak::Label branch_not_taken;
+			if (block->has_jcond)
+				mov(rdx, (size_t)&Sh4cntx.jdyn);
+			else
+				mov(rdx, (size_t)&sr.T);
 
-				jne(branch_not_taken, T_SHORT);
-				mov(dword[rax], block->BranchBlock);
-				L(branch_not_taken);
+			//staging blocks profile the branch for the traces
+			if (staging)
+			{
+				mov(eax, dword[rdx]);
+				xor_(eax, (block->BlockType & 1) ^ 1);
+				mov(rcx, (size_t)&block->taken);
+				add(dword[rcx], eax);
 			}
+
+			cmp(dword[rdx], block->BlockType & 1);
 			break;
 
 		case BET_DynamicJump:
@@ -237,12 +1032,21 @@ public:
 		case BET_DynamicRet:
 			//next_pc = *jdyn;
 			mov(rdx, (size_t)&Sh4cntx.jdyn);
-			mov(edx, dword[rdx]);
-			mov(dword[rax], edx);
+			mov(eax, dword[rdx]);
+			mov(rdx, (size_t)&next_pc);
+			mov(dword[rdx], eax);
+
+			if (block->BlockType == BET_DynamicCall)
+				GenRasPush(block->NextBlock);
+			else if (block->BlockType == BET_DynamicRet)
+				GenRasPop();
+
+			GenDispatch(*this);
 			break;
 
 		case BET_DynamicIntr:
 		case BET_StaticIntr:
+			mov(rax, (size_t)&next_pc);
 			if (block->BlockType == BET_DynamicIntr) {
 				//next_pc = *jdyn;
 				mov(rdx, (size_t)&Sh4cntx.jdyn);
@@ -255,21 +1059,44 @@ public:
 			}
 
 			call((void*)UpdateINTC);
+			jmp(no_update);
 			break;
 
 		default:
 			die("Invalid block end type");
 		}
 
+		//static and conditional ends start unlinked, rdv_LinkBlock patches them later
+		block->relink_offset = getSize();
+		block->relink_data = 0;
+		block->pBranchBlock = 0;
+		block->pNextBlock = 0;
 
-		add(rsp, 0x28);
-		ret();
+		GenLink(*this, block);
+
+		if (force_checks)
+		{
+			//the block may be evicted while recompiling, so it can't be returned to
+			L(check_fail);
+			mov(call_regs[0], block->addr);
+			jmp(block_check_fail);
+		}
+
+		if (staging)
+		{
+			L(promote);
+			mov(call_regs[0], block->addr);
+			jmp(block_promote);
+		}
 
 		ready();
 
 		block->code = (DynarecCodeEntryPtr)getCode();
+		block->host_code_size = getSize();
 
 		emit_Skip(getSize());
+
+		reg.Cleanup();
 	}
 
 	struct CC_PS
@@ -302,17 +1129,17 @@ public:
 		case CPT_u64rvL:
 		case CPT_u32rv:
 			mov(rcx, rax);
-			reg_to_sh(prm, ecx);
+			store_u32(prm, ecx);
 			break;
 
 		case CPT_u64rvH:
 			shr(rcx, 32);
-			reg_to_sh(prm, ecx);
+			store_u32(prm, ecx);
 			break;
 
-			//Store from ST(0)
+			//Store from xmm0
 		case CPT_f32rv:
-			reg_to_sh_ss(prm, xmm0);
+			store_f32(prm, xmm0);
 			break;
 		}
 	}
@@ -330,33 +1157,335 @@ public:
             //push the contents
 
             case CPT_u32:
-               sh_to_reg(prm, mov, call_regs[regused++]);
+               load_u32(call_regs[regused++], prm);
                break;
 
             case CPT_f32:
-               sh_to_reg_noimm(prm, movss, call_regsxmm[xmmused++]);
+               load_f32(call_regsxmm[xmmused++], prm);
                break;
 
-               //push the ptr itself
+               //push the ptr itself, vectors are never allocated
             case CPT_ptr:
+               verify(!reg.IsAllocAny(prm));
                mov(call_regs64[regused++], (size_t)prm.reg_ptr());
 
-               //die("FAIL");
-
                break;
          }
 		}
+		GenCall(function);
+	}
+
+};
+
+void x64_reg_alloc::Preload(u32 reg, x64_reg nreg)
+{
+	compiler->mov(compiler->r11, (size_t)GetRegPtr(reg));
+	compiler->mov(Xbyak::Reg32(nreg), compiler->dword[compiler->r11]);
+}
+
+void x64_reg_alloc::Writeback(u32 reg, x64_reg nreg)
+{
+	compiler->mov(compiler->r11, (size_t)GetRegPtr(reg));
+	compiler->mov(compiler->dword[compiler->r11], Xbyak::Reg32(nreg));
+}
+
+void x64_reg_alloc::Preload_FPU(u32 reg, s8 nreg)
+{
+	compiler->mov(compiler->r11, (size_t)GetRegPtr(reg));
+	compiler->movss(Xbyak::Xmm(nreg), compiler->dword[compiler->r11]);
+}
+
+void x64_reg_alloc::Writeback_FPU(u32 reg, s8 nreg)
+{
+	compiler->mov(compiler->r11, (size_t)GetRegPtr(reg));
+	compiler->movss(compiler->dword[compiler->r11], Xbyak::Xmm(nreg));
+}
+
+class DispatcherGenx64 : public Xbyak::CodeGenerator
+{
+public:
+	DispatcherGenx64() : Xbyak::CodeGenerator(4096, emit_GetCCPtr()) { }
+
+	//a link stub is called from the end of a block, its return address identifies the block
+	const void* GenLinkStub(u32 dpc)
+	{
+		const void* rv = getCurr();
+
+#ifdef _WIN32
+		pop(rcx);
+		sub(rcx, 5);
+		mov(edx, dpc);
+#else
+		pop(rdi);
+		sub(rdi, 5);
+		mov(esi, dpc);
+#endif
+		call((void*)rdv_LinkBlock);
+		jmp(rax);
+
+		return rv;
+	}
+
+	//called from a patched fastmem site, nothing but eax and the volatile gprs may change
+	const void* GenSlowStub(const void* function, u32 size, bool write)
+	{
+		const void* rv = getCurr();
+
+		sub(rsp, FRAME_SIZE + 8);
+#ifndef _WIN32
+		for (int i = 0; alloc_fpu[i] != -1; i++)
+			movss(dword[rsp + FRAME_XMM_SAVE + i * 16], Xbyak::Xmm(alloc_fpu[i]));
+#endif
 		call(function);
+
+		if (!write && size == 1)
+			movsx(eax, al);
+		else if (!write && size == 2)
+			movsx(eax, ax);
+
+#ifndef _WIN32
+		for (int i = 0; alloc_fpu[i] != -1; i++)
+			movss(Xbyak::Xmm(alloc_fpu[i]), dword[rsp + FRAME_XMM_SAVE + i * 16]);
+#endif
+		add(rsp, FRAME_SIZE + 8);
+		ret();
+
+		return rv;
 	}
 
+	void gen()
+	{
+		Xbyak::Label exit_loop;
+
+		mainloop = (void (*)(void*))getCurr();
+
+		push(rbx);
+		push(rbp);
+#ifdef _WIN32
+		push(rdi);
+		push(rsi);
+#endif
+		push(r12);
+		push(r13);
+		push(r14);
+		push(r15);
+		sub(rsp, DISPATCHER_STACK);
+
+#ifdef _WIN32
+		for (int i = 0; i < 10; i++)
+			movups(ptr[rsp + FRAME_SIZE + i * 16], Xbyak::Xmm(6 + i));
+#endif
+
+		mov(rax, (size_t)&cycle_counter);
+		mov(dword[rax], SH4_TIMESLICE);
+
+		no_update = getCurr();
+		mov(rax, (size_t)&next_pc);
+		mov(eax, dword[rax]);
+		GenDispatch(*this);
+
+		//called from the entry of a block that ran out of cycles
+		intc_sched = getCurr();
+		{
+			Xbyak::Label do_interrupts;
+
+			mov(rax, (size_t)&cycle_counter);
+			add(dword[rax], SH4_TIMESLICE);
+
+			sub(rsp, 8);
+			call((void*)UpdateSystem);
+			add(rsp, 8);
+
+			test(eax, eax);
+			jnz(do_interrupts);
+			mov(rax, (size_t)&inside_loop);
+			cmp(byte[rax], 0);
+			je(do_interrupts);
+			ret();
+
+			//drop the return address, the block is restarted from the dispatcher
+			L(do_interrupts);
+#ifdef _WIN32
+			pop(rcx);
+#else
+			pop(rdi);
+#endif
+			call((void*)rdv_DoInterrupts);
+
+			mov(rax, (size_t)&inside_loop);
+			cmp(byte[rax], 0);
+			je(exit_loop);
+			jmp(no_update);
+		}
+
+		L(exit_loop);
+#ifdef _WIN32
+		for (int i = 0; i < 10; i++)
+			movups(Xbyak::Xmm(6 + i), ptr[rsp + FRAME_SIZE + i * 16]);
+#endif
+		add(rsp, DISPATCHER_STACK);
+		pop(r15);
+		pop(r14);
+		pop(r13);
+		pop(r12);
+#ifdef _WIN32
+		pop(rsi);
+		pop(rdi);
+#endif
+		pop(rbp);
+		pop(rbx);
+		ret();
+
+		link_generic = GenLinkStub(0);
+		link_cond_branch = GenLinkStub(1);
+		link_cond_next = GenLinkStub(0);
+
+		mem_slow[FMK_Read8] = GenSlowStub((void*)ReadMem8, 1, false);
+		mem_slow[FMK_Read16] = GenSlowStub((void*)ReadMem16, 2, false);
+		mem_slow[FMK_Read32] = GenSlowStub((void*)ReadMem32, 4, false);
+		mem_slow[FMK_Read64] = GenSlowStub((void*)ReadMem64, 8, false);
+		mem_slow[FMK_Write8] = GenSlowStub((void*)WriteMem8, 1, true);
+		mem_slow[FMK_Write16] = GenSlowStub((void*)WriteMem16, 2, true);
+		mem_slow[FMK_Write32] = GenSlowStub((void*)WriteMem32, 4, true);
+		mem_slow[FMK_Write64] = GenSlowStub((void*)WriteMem64, 8, true);
+
+		block_check_fail = getCurr();
+		call((void*)rdv_BlockCheckFail);
+		jmp(rax);
+
+		block_promote = getCurr();
+		call((void*)rdv_PromoteBlock);
+		jmp(rax);
+
+		//rdv_FindOrCompile is safe with stale fpcb entries, like the ones in the return stack
+		ngen_FailedToFindBlock = (void (*)())getCurr();
+		call((void*)rdv_FindOrCompile);
+		jmp(rax);
+
+		ready();
+		emit_Skip(getSize());
+	}
 };
 
+void ngen_init_x64(void)
+{
+	DispatcherGenx64* gen = new DispatcherGenx64();
+	gen->gen();
+	delete gen;
+
+	emit_SetBaseAddr();
+
+	//the fpcb still points to the old lookup fallback
+	bm_Reset();
+}
+
+void ngen_mainloop_x64(void* cntx)
+{
+	mainloop(cntx);
+}
+
+void ngen_ResetBlocks_x64(void)
+{
+	for (int i = 0; i < RAS_SIZE; i++)
+	{
+		ras[i].pc = 0xFFFFFFFF;
+		ras[i].code = ngen_FailedToFindBlock;
+	}
+	ras_top = 0;
+}
+
+//decodes the access emitted by GenFastmem
+static int GetFastmemKind(const u8* code)
+{
+	bool opsize = code[0] == 0x66;
+	if (opsize)
+		code++;
+
+	bool rexw = code[0] == 0x49;
+	if (code[0] != 0x41 && !rexw)
+		return -1;
+
+	switch (code[1])
+	{
+	case 0x0F:
+		if (code[2] == 0xBE)
+			return FMK_Read8;
+		if (code[2] == 0xBF)
+			return FMK_Read16;
+		return -1;
+
+	case 0x8B:
+		return rexw ? FMK_Read64 : FMK_Read32;
+
+	case 0x88:
+		return FMK_Write8;
+
+	case 0x89:
+		return opsize ? FMK_Write16 : rexw ? FMK_Write64 : FMK_Write32;
+	}
+
+	return -1;
+}
+
+//Called from the fault handler, addr is the faulting host pc. The site is replaced by a call to
+//the slow path and a jump over the rest of it, then execution restarts at the site.
+bool ngen_Rewrite(size_t& addr, size_t retadr, size_t acc)
+{
+	u8* code = (u8*)addr;
+
+	if (fastmem_prefix == 0 || code < CodeCache + fastmem_prefix || code >= CodeCache + CODE_SIZE)
+		return false;
+
+	//and eax, 0x1FFFFFFF right before the access
+	if (code[-5] != 0x25 || *(u32*)(code - 4) != 0x1FFFFFFF)
+		return false;
+
+	int kind = GetFastmemKind(code);
+	if (kind < 0)
+		return false;
+
+	u8* site = code - fastmem_prefix;
+
+	Xbyak::CodeGenerator cg(16, site);
+	cg.call(mem_slow[kind]);
+	cg.jmp(site + fastmem_prefix + FASTMEM_ACCESS_SIZE, Xbyak::CodeGenerator::T_SHORT);
+	cg.ready();
+
+	addr = (size_t)site;
+
+	return true;
+}
+
+void ngen_DiscardBlock_x64(RuntimeBlockInfo* block)
+{
+	for (int i = 0; i < RAS_SIZE; i++)
+	{
+		if (block->contains_code((u8*)ras[i].code))
+		{
+			ras[i].pc = 0xFFFFFFFF;
+			ras[i].code = ngen_FailedToFindBlock;
+		}
+	}
+}
+
+u32 ngen_Relink_x64(RuntimeBlockInfo* block)
+{
+	if (!block->code)
+		return 0;
+
+	Xbyak::CodeGenerator cg(64, (u8*)block->code + block->relink_offset);
+	GenLink(cg, block);
+	cg.ready();
+
+	return cg.getSize();
+}
+
 void ngen_Compile_x64(RuntimeBlockInfo* block, bool force_checks, bool reset, bool staging, bool optimise)
 {
 	compiler_data = static_cast<void*>(new BlockCompilerx64());
 
    BlockCompilerx64 *compiler = (BlockCompilerx64*)compiler_data;
-	
+
 	compiler->compile(block, force_checks, reset, staging, optimise);
 
 	delete compiler;
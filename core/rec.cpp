@@ -23,6 +23,9 @@ void ngen_init(void)
 #elif FEAT_SHREC == DYNAREC_JIT && HOST_CPU == CPU_ARM
          extern void ngen_init_arm(void);
          ngen_init_arm();
+#elif FEAT_SHREC == DYNAREC_JIT && HOST_CPU == CPU_X64
+         extern void ngen_init_x64(void);
+         ngen_init_x64();
 #endif
          break;
       case 1: /* rec_cpp */
@@ -39,6 +42,13 @@ struct DynaRBI : RuntimeBlockInfo
     * errors */
    virtual u32 Relink()
    {
+#if FEAT_SHREC == DYNAREC_JIT && HOST_CPU == CPU_X64
+      if (settings.dynarec.Type == 0)
+      {
+         extern u32 ngen_Relink_x64(RuntimeBlockInfo* block);
+         return ngen_Relink_x64(this);
+      }
+#endif
       return 0;
    }
 
@@ -68,6 +78,17 @@ void ngen_GetFeatures(ngen_features* dst)
 {
 	dst->InterpreterFallback = false;
 	dst->OnlyDynamicEnds = false;
+
+	//only the x64 backend implements these
+#if FEAT_SHREC == DYNAREC_JIT && HOST_CPU == CPU_X64
+	bool x64 = settings.dynarec.Type == 0;
+#else
+	bool x64 = false;
+#endif
+	dst->CodeChecks = x64;
+	dst->BlockEviction = x64;
+	dst->Staging = x64;
+	dst->Traces = x64;
 }
 
 int idxnxx = 0;
@@ -76,6 +97,24 @@ void ngen_ResetBlocks(void)
 {
    printf("@@\tngen_ResetBlocks()\n");
 	idxnxx = 0;
+#if FEAT_SHREC == DYNAREC_JIT && HOST_CPU == CPU_X64
+   if (settings.dynarec.Type == 0)
+   {
+      extern void ngen_ResetBlocks_x64(void);
+      ngen_ResetBlocks_x64();
+   }
+#endif
+}
+
+void ngen_DiscardBlock(RuntimeBlockInfo* block)
+{
+#if FEAT_SHREC == DYNAREC_JIT && HOST_CPU == CPU_X64
+   if (settings.dynarec.Type == 0)
+   {
+      extern void ngen_DiscardBlock_x64(RuntimeBlockInfo* block);
+      ngen_DiscardBlock_x64(block);
+   }
+#endif
 }
 
 void *compiler_data;
@@ -0,0 +1,309 @@
+#include <memalign.h>
+
+#include <algorithm>
+
+#ifdef __SSE4_1__
+#include <xmmintrin.h>
+#endif
+
+#include "TexCache.h"
+#include "../libretro/libretro.h"
+
+#include "../hw/pvr/pvr.h"
+#include "../hw/pvr/tr.h"
+#include "../hw/pvr/pixel_convert.h"
+
+/*
+Textures
+
+Texture decoding and the parts of the texture cache that don't care where
+the pixels end up. gl_backend uploads them, the software renderer keeps
+them in memory as bilinear quads.
+*/
+
+bool KillTex=false;
+
+PvrTexInfo format[8]=
+{
+	{"1555", 16,TextureType_5551, &tex1555_PL,&tex1555_TW,&tex1555_VQ},	//1555
+	{"565", 16,TextureType_565,   &tex565_PL,&tex565_TW,&tex565_VQ},		//565
+	{"4444", 16,TextureType_4444, &tex4444_PL,&tex4444_TW,&tex4444_VQ},	//4444
+	{"yuv", 16,TextureType_565,   &texYUV422_PL,&texYUV422_TW,&texYUV422_VQ},	//yuv
+	{"UNSUPPORTED BUMP MAPPED POLY", 16,TextureType_4444,&texBMP_PL,&texBMP_TW,&texBMP_VQ},	//bump_ns
+	{"pal4", 4,TextureType_5551,0,texPAL4_TW,0},	//pal4
+	{"pla8", 8,TextureType_5551,0,texPAL8_TW,0},	//pal8
+	{"ns/1555", 0},	//ns, 1555
+};
+
+const u32 compressed_mipmap_offsets[8] =
+{
+	0x00006, /*    8  x 8*/
+	0x00016, /*   16  x 16*/
+	0x00056, /*   32  x 32 */
+	0x00156, /*   64  x 64 */
+	0x00556, /*  128  x 128*/
+	0x01556, /*  256  x 256*/
+	0x05556, /*  512  x 512 */
+	0x15556  /* 1024  x 1024 */
+};
+
+const TextureType PAL_TYPE[4]=
+{TextureType_5551,TextureType_565,TextureType_4444,TextureType_4444};
+
+u16 temp_tex_buffer[1024*1024];
+
+void texcache_Init(u64 cpu)
+{
+   tex_DetectSimd(cpu);
+}
+
+void BaseTextureCacheData::Create(void)
+{
+   /* Reset state info */
+   Lookups    = 0;
+   Updates    = 0;
+   dirty      = FrameCount;
+   lock_block = 0;
+
+   /* Decode info from TSP/TCW into the texture struct */
+   tex        = &format[tcw.PixelFmt==7?0:tcw.PixelFmt];		/* texture format table entry */
+
+   sa_tex     = (tcw.TexAddr<<3) & VRAM_MASK;               /* texture start address */
+   sa         = sa_tex;						                     /* data texture start address (modified for MIPs, as needed) */
+   w          = 8 << tsp.TexU;                              /* texture width */
+   h          = 8 << tsp.TexV;                              /* texture height */
+   stride     = w;
+
+   pal_table_rev = 0;
+
+   /* PAL texture */
+   switch (tex->bpp)
+   {
+      case 4:
+         pal_table_rev=&pal_rev_16[tcw.PalSelect];
+         indirect_color_ptr=tcw.PalSelect<<4;
+         break;
+      case 8:
+         pal_table_rev=&pal_rev_256[tcw.PalSelect>>4];
+         indirect_color_ptr=(tcw.PalSelect>>4)<<8;
+         break;
+   }
+
+   /* VQ table (if VQ texture) */
+   if (tcw.VQ_Comp)
+      indirect_color_ptr = sa;
+
+   texconv = 0;
+
+   /* Convert a PVR texture into OpenGL */
+   switch (tcw.PixelFmt)
+   {
+      case TA_PIXEL_1555:     /* ARGB1555  - value: 1 bit; RGB values: 5 bits each */
+      case TA_PIXEL_RESERVED: /* RESERVED1 - Regarded as 1555 */
+      case TA_PIXEL_565:      /* RGB565    - R value: 5 bits; G value: 6 bits; B value: 5 bits */
+      case TA_PIXEL_4444:     /* ARGB4444  - value: 4 bits; RGB values: 4 bits each */
+      case TA_PIXEL_YUV422:   /* YUV422    - 32 bits per 2 pixels; YUYV values: 8 bits each */
+      case TA_PIXEL_BUMPMAP:  /* BUMPMAP   - NOT_PROPERLY SUPPORTED- 16 bits/pixel; S value: 8 bits; R value: 8 bits */
+      case TA_PIXEL_4BPP:     /* 4BPP      - Palette texture with 4 bits/pixel */
+      case TA_PIXEL_8BPP:     /* 8BPP      - Palette texture with 8 bits/pixel */
+         if (tcw.ScanOrder && tex->PL)
+         {
+            /* Planar textures support stride selection,
+             * mostly used for NPOT textures (videos). */
+            if (tcw.StrideSel)
+               stride  = (TEXT_CONTROL&31)*32;
+
+            texconv    = tex->PL;                  /* Call the format specific conversion code */
+            size       = stride * h * tex->bpp/8;  /* Calculate the size, in bytes, for the locking. */
+         }
+         else
+         {
+            size = w * h;
+            if (tcw.VQ_Comp)
+            {
+               indirect_color_ptr = sa;
+               if (tcw.MipMapped)
+                  sa             += compressed_mipmap_offsets[tsp.TexU];
+               texconv            = tex->VQ;
+            }
+            else
+            {
+               if (tcw.MipMapped)
+                  sa             += compressed_mipmap_offsets[tsp.TexU]*tex->bpp/2;
+               texconv            = tex->TW;
+               size              *= tex->bpp;
+            }
+            size /= 8;
+         }
+         break;
+      default:
+         printf("Unhandled texture %d\n",tcw.PixelFmt);
+         size=w*h*2;
+         break;
+   }
+}
+
+TextureType BaseTextureCacheData::BeginUpdate(void)
+{
+   TextureType textype = tex->type;
+
+   Updates++;                                   /* texture state tracking stuff */
+   dirty              = 0;
+   update_frame       = FrameCount;
+
+   /* palette changes update it while it's still locked */
+   Unlock();
+
+   if (pal_table_rev)
+   {
+      textype         = PAL_TYPE[PAL_RAM_CTRL&3];
+      pal_local_rev   = *pal_table_rev;             /* make sure to update the local rev,
+                                                   so it won't have to redo the texture */
+   }
+
+   stride = w;
+   if (tcw.StrideSel && tcw.ScanOrder && tex->PL)
+      stride = (TEXT_CONTROL&31)*32; //I think this needs +1 ?
+
+   return textype;
+}
+
+void BaseTextureCacheData::Decode(u16* dst) const
+{
+   PixelBuffer pbt;
+
+   pbt.p_buffer_start = pbt.p_current_line = dst;
+   pbt.pixels_per_line = w;
+   pbt.palette_index   = indirect_color_ptr;              /* might be used if paletted texture */
+   pbt.vq_codebook     = (u8*)&vram.data[indirect_color_ptr];  /* might be used if VQ texture */
+
+   //texture conversion work
+   if (texconv)
+      texconv(&pbt,(u8*)&vram.data[sa], stride, h);
+   else
+   {
+      /* fill it in with a temporary color. */
+      printf("UNHANDLED TEXTURE\n");
+      memset(dst,0xF88F8F7F,w*h*2);
+   }
+}
+
+void BaseTextureCacheData::Lock(void)
+{
+   lock_block = libCore_vramlock_Lock(sa_tex,sa+size-1,this);
+}
+
+void BaseTextureCacheData::Unlock(void)
+{
+   if (lock_block)
+      libCore_vramlock_Unlock_block(lock_block);
+   lock_block = 0;
+}
+
+void rend_text_invl(vram_block* bl)
+{
+	BaseTextureCacheData* tcd = (BaseTextureCacheData*)bl->userdata;
+	tcd->dirty=FrameCount;
+	tcd->lock_block=0;
+
+	libCore_vramlock_Unlock_block_wb(bl);
+}
+
+/* Software renderer textures, every texel is stored with its 3 neighbours
+ * so the rasterizer can filter with one load */
+struct SoftTextureCacheData : BaseTextureCacheData
+{
+   u16* pData;
+   TextureType tex_type;
+
+   void Create(void)
+   {
+      pData    = 0;
+      tex_type = TextureType_565;
+      BaseTextureCacheData::Create();
+   }
+
+   void Update(void)
+   {
+      tex_type = BeginUpdate();
+
+      Decode(temp_tex_buffer);
+      Lock();
+
+      /* w and h never change, so the buffer is reused and the software
+       * renderer can keep pointers to it for the whole frame */
+      if (!pData)
+      {
+#ifdef __SSE4_1__
+         pData = (u16*)_mm_malloc(w * h * 16, 16);
+#else
+         pData = (u16*)memalign_alloc(16, w * h * 16);
+#endif
+      }
+      for (int y = 0; y < h; y++)
+      {
+         for (int x = 0; x < w; x++)
+         {
+            u32* data = (u32*)&pData[(x + y*w) * 8];
+
+            data[0]   = decoded_colors[tex_type][temp_tex_buffer[(x + 1) % w + (y + 1) % h * w]];
+            data[1]   = decoded_colors[tex_type][temp_tex_buffer[(x + 0) % w + (y + 1) % h * w]];
+            data[2]   = decoded_colors[tex_type][temp_tex_buffer[(x + 1) % w + (y + 0) % h * w]];
+            data[3]   = decoded_colors[tex_type][temp_tex_buffer[(x + 0) % w + (y + 0) % h * w]];
+         }
+      }
+   }
+
+   void Delete(void)
+   {
+      if (pData)
+#ifdef __SSE4_1__
+         _mm_free(pData);
+#else
+         memalign_free(pData);
+#endif
+      pData = 0;
+      Unlock();
+   }
+};
+
+static TexHashTable<SoftTextureCacheData> SoftTexCache;
+
+text_info raw_GetTexture(TSP tsp, TCW tcw)
+{
+   text_info rv             = { 0 };
+   u64 key                  = ((u64)tcw.full<<32) | tsp.full;
+   SoftTextureCacheData* tf = SoftTexCache.Find(key);
+
+   if (!tf)
+   {
+      tf = new SoftTextureCacheData();
+      SoftTexCache.Insert(key, tf);
+
+      tf->tsp=tsp;
+      tf->tcw=tcw;
+      tf->Create();
+   }
+
+   if (tf->NeedsUpdate())
+      tf->Update();
+
+   tf->Lookups++;
+
+   rv.pdata             = tf->pData;
+   rv.width             = tf->w;
+   rv.height            = tf->h;
+   rv.textype           = tf->tex_type;
+
+   return rv;
+}
+
+void raw_CollectCleanup(void)
+{
+   texcache_Collect(SoftTexCache);
+}
+
+void raw_killtex(void)
+{
+   texcache_Clear(SoftTexCache);
+}
@@ -0,0 +1,267 @@
+#pragma once
+#include "rend/rend.h"
+
+#include <vector>
+
+/* formats textures are decoded to, also the decoded_colors index */
+enum TextureType
+{
+   TextureType_565,
+   TextureType_5551,
+   TextureType_4444
+};
+
+struct text_info {
+	u16* pdata;
+	u32 width;
+	u32 height;
+	u32 textype; // 0 565, 1 1555, 2 4444
+};
+
+/* lookup tables for the software renderer texture format */
+extern u32 decoded_colors[3][65536];
+
+/* set to drop every cached texture on the next frame */
+extern bool KillTex;
+
+struct PixelBuffer;
+typedef void TexConvFP(PixelBuffer* pb,u8* p_in,u32 Width,u32 Height);
+
+struct PvrTexInfo
+{
+	const char* name;
+	int bpp;        //4/8 for pal. 16 for uv, argb
+	TextureType type;
+	TexConvFP *PL;
+	TexConvFP *TW;
+	TexConvFP *VQ;
+};
+
+/* picks the texture decoders for the host, cpu is the frontend's cpu features */
+void texcache_Init(u64 cpu);
+
+/* Open addressed hash table from u64 keys to caller owned pointers.
+ * Linear probing, NULL marks an empty slot, erase shifts back the probe chain. */
+template<typename T>
+struct TexHashTable
+{
+   struct Slot
+   {
+      u64 key;
+      T*  value;
+   };
+
+   std::vector<Slot> slots;
+   u32 count;
+
+   TexHashTable() : count(0) { }
+
+   static u32 Hash(u64 key)
+   {
+      key ^= key >> 33;
+      key *= 0xff51afd7ed558ccdULL;
+      key ^= key >> 33;
+      return (u32)key;
+   }
+
+   u32 Mask() const { return (u32)slots.size() - 1; }
+
+   T* Find(u64 key) const
+   {
+      if (slots.empty())
+         return NULL;
+
+      for (u32 i = Hash(key) & Mask(); slots[i].value; i = (i + 1) & Mask())
+      {
+         if (slots[i].key == key)
+            return slots[i].value;
+      }
+
+      return NULL;
+   }
+
+   void Insert(u64 key, T* value)
+   {
+      /* keep the load under 1/2 */
+      if ((count + 1) * 2 > slots.size())
+         Grow();
+
+      u32 i = Hash(key) & Mask();
+      for (; slots[i].value; i = (i + 1) & Mask())
+      {
+         if (slots[i].key == key)
+         {
+            slots[i].value = value;
+            return;
+         }
+      }
+
+      slots[i].key   = key;
+      slots[i].value = value;
+      count++;
+   }
+
+   void Erase(u64 key)
+   {
+      if (slots.empty())
+         return;
+
+      u32 i = Hash(key) & Mask();
+      for (; slots[i].value; i = (i + 1) & Mask())
+      {
+         if (slots[i].key == key)
+            break;
+      }
+
+      if (!slots[i].value)
+         return;
+
+      /* move back anything that probed past the hole */
+      for (u32 j = (i + 1) & Mask(); slots[j].value; j = (j + 1) & Mask())
+      {
+         u32 home = Hash(slots[j].key) & Mask();
+         if (((j - home) & Mask()) >= ((j - i) & Mask()))
+         {
+            slots[i] = slots[j];
+            i        = j;
+         }
+      }
+
+      slots[i].value = NULL;
+      count--;
+   }
+
+   void Clear()
+   {
+      slots.clear();
+      count = 0;
+   }
+
+   void Grow()
+   {
+      std::vector<Slot> old;
+      old.swap(slots);
+
+      Slot empty = { 0, NULL };
+      slots.resize(old.empty() ? 256 : old.size() * 2, empty);
+      count = 0;
+
+      for (size_t i = 0; i < old.size(); i++)
+      {
+         if (old[i].value)
+            Insert(old[i].key, old[i].value);
+      }
+   }
+};
+
+/* What a cached texture is decoded from, and the vram lock that marks it
+ * dirty. The GL and software caches add where the pixels go. */
+struct BaseTextureCacheData
+{
+	TSP tsp;             /* PowerVR texture parameters */
+	TCW tcw;
+
+	u32 Lookups;
+
+	/* decoded texture info */
+   u32 sa;              /* pixel data start address in VRAM (might be offset for mipmaps/etc) */
+   u32 sa_tex;		      /* texture data start address in VRAM */
+   u32 w,h;             /* Width & height of the texture */
+   u32 size;            /* Size, in bytes, in VRAM */
+   u32 stride;          /* Width of the rows in VRAM, in pixels */
+
+	PvrTexInfo *tex;
+	TexConvFP  *texconv;
+
+	u32 dirty;
+	u32 update_frame;    /* FrameCount of the last update */
+	vram_block* lock_block;
+
+	u32 Updates;
+
+	/* Used for palette updates */
+	u32  pal_local_rev;         /* Local palette rev */
+	u32* pal_table_rev;         /* Table palette rev pointer */
+	u32  indirect_color_ptr;    /* Palette color table index for paletted texture */
+
+	                            /* VQ quantizers table for VQ texture.
+	                             * A texture can't be both VQ and PAL (paletted) at the same time */
+
+   /* Decode info from tsp/tcw */
+   void Create(void);
+
+	/* true if : dirty, paletted texture and revs don't match, or its vram
+	 * was written in a frame after the last update */
+	bool NeedsUpdate()
+   {
+      return (dirty) || (pal_table_rev!=0 && *pal_table_rev!=pal_local_rev) ||
+         libCore_vramlock_DirtySince(sa_tex,sa+size-1,update_frame+1);
+   }
+
+   /* Starts an update: drops the old lock and catches up with the palette.
+    * Returns the format the texture decodes to. */
+   TextureType BeginUpdate(void);
+
+   /* Pixels Decode writes. Rows are stride wide, which can be more than w */
+   u32 DecodeSize(void) const { return (stride > w ? stride : w) * h; }
+
+   /* Decodes to dst, w pixels per row */
+   void Decode(u16* dst) const;
+
+   /* lock the texture to detect changes in it */
+   void Lock(void);
+   void Unlock(void);
+};
+
+/* u16 scratch for the decoders, 1024x1024 */
+extern u16 temp_tex_buffer[1024*1024];
+
+/* Drops a few of the entries that haven't been used for 120 frames */
+template<typename T>
+void texcache_Collect(TexHashTable<T>& cache)
+{
+   std::vector<u64> list;
+
+   u32 TargetFrame = (FrameCount > 120 ? FrameCount : 120) - 120;
+
+   for (size_t i=0;i<cache.slots.size();i++)
+   {
+      T* tf = cache.slots[i].value;
+
+      if (tf && tf->dirty && tf->dirty < TargetFrame)
+         list.push_back(cache.slots[i].key);
+
+      if (list.size() > 5)
+         break;
+   }
+
+   for (size_t i=0; i<list.size(); i++)
+   {
+      T* tf = cache.Find(list[i]);
+      cache.Erase(list[i]);
+      tf->Delete();
+      delete tf;
+   }
+}
+
+template<typename T>
+void texcache_Clear(TexHashTable<T>& cache)
+{
+	for (size_t i=0;i<cache.slots.size();i++)
+	{
+		T* tf = cache.slots[i].value;
+		if (tf)
+		{
+			tf->Delete();
+			delete tf;
+		}
+	}
+
+	cache.Clear();
+}
+
+/* texture cache access for the software renderer, textures are decoded
+ * to bilinear quads instead of being uploaded */
+text_info raw_GetTexture(TSP tsp, TCW tcw);
+void raw_CollectCleanup(void);
+void raw_killtex(void);
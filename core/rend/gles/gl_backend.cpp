@@ -1,5 +1,4 @@
 #include <math.h>
-#include <map>
 
 #include <memalign.h>
 
@@ -18,7 +17,6 @@
 
 #include "../../hw/pvr/pvr.h"
 #include "../../hw/pvr/tr.h"
-#include "../../hw/pvr/pixel_convert.h"
 
 #define VERTEX_POS_ARRAY      0
 #define VERTEX_COL_BASE_ARRAY 1
@@ -26,9 +24,9 @@
 #define VERTEX_UV_ARRAY       3
 
 extern retro_environment_t environ_cb;
+extern retro_get_cpu_features_t perf_get_cpu_features_cb;
 extern bool fog_needs_update;
 extern bool enable_rtt;
-bool KillTex=false;
 
 struct modvol_shader_type
 {
@@ -191,338 +189,365 @@ static struct
 	}
 } cache;
 
-typedef void TexConvFP(PixelBuffer* pb,u8* p_in,u32 Width,u32 Height);
+/* TextureType -> GL pixel type */
+static const GLuint gl_textype[3]=
+{GL_UNSIGNED_SHORT_5_6_5,GL_UNSIGNED_SHORT_5_5_5_1,GL_UNSIGNED_SHORT_4_4_4_4};
 
-struct PvrTexInfo
+struct FBT
 {
-	const char* name;
-	int bpp;        //4/8 for pal. 16 for uv, argb
-	GLuint type;
-	TexConvFP *PL;
-	TexConvFP *TW;
-	TexConvFP *VQ;
+	u32 TexAddr;
+	GLuint depthb,stencilb;
+	GLuint tex;
+	GLuint fbo;
 };
 
-PvrTexInfo format[8]=
+FBT fb_rtt;
+
+/* GL texture, shared by the cache entries that decode to the same pixels */
+struct TexObject
 {
-	{"1555", 16,GL_UNSIGNED_SHORT_5_5_5_1, &tex1555_PL,&tex1555_TW,&tex1555_VQ},	//1555
-	{"565", 16,GL_UNSIGNED_SHORT_5_6_5,    &tex565_PL,&tex565_TW,&tex565_VQ},		//565
-	{"4444", 16,GL_UNSIGNED_SHORT_4_4_4_4, &tex4444_PL,&tex4444_TW,&tex4444_VQ},	//4444
-	{"yuv", 16,GL_UNSIGNED_SHORT_5_6_5,    &texYUV422_PL,&texYUV422_TW,&texYUV422_VQ},	//yuv
-	{"UNSUPPORTED BUMP MAPPED POLY", 16,GL_UNSIGNED_SHORT_4_4_4_4,&texBMP_PL,&texBMP_TW,&texBMP_VQ},	//bump_ns
-	{"pal4", 4,0,0,texPAL4_TW,0},	//pal4
-	{"pla8", 8,0,0,texPAL8_TW,0},	//pal8
-	{"ns/1555", 0},	//ns, 1555
+   GLuint texID;
+   u32    refs;
+   u64    content;      /* content key of the uploaded pixels, 0 if none */
 };
 
-const u32 compressed_mipmap_offsets[8] =
+/* content key -> texture holding those pixels */
+static TexHashTable<TexObject> TexContent;
+
+/* 64 bit hash of the texture source data, 8 bytes at a time */
+static u64 tex_hash(const u8* data, u32 size, u64 seed)
 {
-	0x00006, /*    8  x 8*/
-	0x00016, /*   16  x 16*/
-	0x00056, /*   32  x 32 */
-	0x00156, /*   64  x 64 */
-	0x00556, /*  128  x 128*/
-	0x01556, /*  256  x 256*/
-	0x05556, /*  512  x 512 */
-	0x15556  /* 1024  x 1024 */
-};
+   const u64 k = 0x9E3779B97F4A7C15ULL;
+   u64 h       = seed ^ (size * k);
+   u32 i       = 0;
 
-const GLuint PAL_TYPE[4]=
-{GL_UNSIGNED_SHORT_5_5_5_1,GL_UNSIGNED_SHORT_5_6_5,GL_UNSIGNED_SHORT_4_4_4_4,GL_UNSIGNED_SHORT_4_4_4_4};
+   for (; i + 8 <= size; i += 8)
+   {
+      u64 v;
+      memcpy(&v, data + i, 8);
+      h ^= v * k;
+      h  = ((h << 31) | (h >> 33)) * 0xC2B2AE3D27D4EB4FULL;
+   }
 
-u16 temp_tex_buffer[1024*1024];
-extern u32 decoded_colors[3][65536];
+   for (; i < size; i++)
+      h = (h ^ data[i]) * k;
 
-struct FBT
+   h ^= h >> 29;
+   h *= k;
+   h ^= h >> 32;
+
+   return h;
+}
+
+static void tex_release(TexObject* obj)
 {
-	u32 TexAddr;
-	GLuint depthb,stencilb;
-	GLuint tex;
-	GLuint fbo;
-};
+   if (!obj || --obj->refs)
+      return;
 
-FBT fb_rtt;
+   if (obj->content && TexContent.Find(obj->content) == obj)
+      TexContent.Erase(obj->content);
 
-/* Texture Cache */
-struct TextureCacheData
+   glDeleteTextures(1, &obj->texID);
+   delete obj;
+}
+
+static void tex_upload(GLuint texID, GLuint textype, u32 w, u32 h, bool mipmap, u16* pixels)
 {
-	TSP tsp;             /* PowerVR texture parameters */
-	TCW tcw;
+   glBindTexture(GL_TEXTURE_2D, texID);
+   GLuint comps=textype==GL_UNSIGNED_SHORT_5_6_5?GL_RGB:GL_RGBA;
+   glTexImage2D(GL_TEXTURE_2D, 0,comps , w, h, 0, comps, textype, pixels);
+   if (mipmap)
+      glGenerateMipmap(GL_TEXTURE_2D);
+   glBindTexture(GL_TEXTURE_2D, 0);
+}
 
-   GLuint texID;        /* GL texture ID */
-	u16* pData;
-	int tex_type;
+#ifndef TARGET_NO_THREADS
+/* Texture decoding runs on a few workers while the frame is parsed. The GL
+ * texture is picked when the texture is looked up, and the decoded pixels are
+ * uploaded on the GL thread before the frame is drawn, so lookups never wait.
+ * Only built with NO_THREADS=0, the default build decodes in Update(). */
+#define TEX_DECODE_THREADS 3
 
-	u32 Lookups;
+struct TexDecodeJob
+{
+   TexObject*  obj;        /* ref held until the upload */
+   BaseTextureCacheData src;   /* a copy, the entry can be updated again before this is decoded */
+   GLuint      textype;
+   bool        mipmap;
+   vector<u16> pixels;
+};
 
-	/* decoded texture info */
-   u32 sa;              /* pixel data start address in VRAM (might be offset for mipmaps/etc) */
-   u32 sa_tex;		      /* texture data start address in VRAM */
-   u32 w,h;             /* Width & height of the texture */
-   u32 size;            /* Size, in bytes, in VRAM */
+static struct
+{
+   slock_t*   lock;
+   scond_t*   wake;        /* workers: jobs were queued */
+   scond_t*   done;        /* gl thread: a job was decoded */
+   sthread_t* threads[TEX_DECODE_THREADS];
+   bool       quit;
+
+   vector<TexDecodeJob*> jobs;   /* everything queued since the last upload */
+   u32        next;        /* next job to decode */
+   u32        decoded;
+} tex_decode;
+
+static void tex_decode_thread(void*)
+{
+   slock_lock(tex_decode.lock);
 
-	PvrTexInfo *tex;
-	TexConvFP  *texconv;
+   for (;;)
+   {
+      while (!tex_decode.quit && tex_decode.next == tex_decode.jobs.size())
+         scond_wait(tex_decode.wake, tex_decode.lock);
 
-	u32 dirty;
-	vram_block* lock_block;
+      if (tex_decode.quit)
+         break;
 
-	u32 Updates;
+      TexDecodeJob* job = tex_decode.jobs[tex_decode.next++];
+      slock_unlock(tex_decode.lock);
 
-	/* Used for palette updates */
-	u32  pal_local_rev;         /* Local palette rev */
-	u32* pal_table_rev;         /* Table palette rev pointer */
-	u32  indirect_color_ptr;    /* Palette color table index for paletted texture */
+      job->src.Decode(&job->pixels[0]);
 
-	                            /* VQ quantizers table for VQ texture.
-	                             * A texture can't be both VQ and PAL (paletted) at the same time */
+      slock_lock(tex_decode.lock);
+      tex_decode.decoded++;
+      scond_signal(tex_decode.done);
+   }
 
-	//Create GL texture from tsp/tcw
-	void Create(bool isGL)
-	{
-      texID      = 0;
+   slock_unlock(tex_decode.lock);
+}
 
-		if (isGL)
-			glGenTextures(1, &texID);
-		
-		/* Reset state info */
-		pData      = 0;
-		tex_type   = 0;
-		Lookups    = 0;
-		Updates    = 0;
-		dirty      = FrameCount;
-		lock_block = 0;
-
-		/* Decode info from TSP/TCW into the texture struct */
-		tex        = &format[tcw.PixelFmt==7?0:tcw.PixelFmt];		/* texture format table entry */
-
-		sa_tex     = (tcw.TexAddr<<3) & VRAM_MASK;               /* texture start address */
-		sa         = sa_tex;						                     /* data texture start address (modified for MIPs, as needed) */
-		w          = 8 << tsp.TexU;                              /* texture width */
-		h          = 8 << tsp.TexV;                              /* texture height */
-
-		if (texID)
-      {
-         /* Bind texture to set modes */
-         glBindTexture(GL_TEXTURE_2D, texID);
+static void tex_decode_queue(TexDecodeJob* job)
+{
+   job->pixels.resize(job->src.DecodeSize());
+   job->obj->refs++;
 
-         /* Set texture repeat mode */
-         if (tsp.ClampU)
-            glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-         else 
-            glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, tsp.FlipU ? GL_MIRRORED_REPEAT : GL_REPEAT);
+   slock_lock(tex_decode.lock);
+   tex_decode.jobs.push_back(job);
+   scond_signal(tex_decode.wake);
+   slock_unlock(tex_decode.lock);
+}
 
-         if (tsp.ClampV)
-            glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-         else 
-            glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, tsp.FlipV ? GL_MIRRORED_REPEAT : GL_REPEAT);
+/* waits for the queued decodes and uploads them, in queue order */
+static void tex_decode_upload(void)
+{
+   if (!tex_decode.lock)
+      return;
 
-#ifdef HAVE_OPENGLES
-         glHint(GL_GENERATE_MIPMAP_HINT, GL_NICEST);
-#endif
+   slock_lock(tex_decode.lock);
+   while (tex_decode.decoded != tex_decode.jobs.size())
+      scond_wait(tex_decode.done, tex_decode.lock);
 
-         /* Set texture filter mode */
-         if (tsp.FilterMode == 0)
-         {
-            /* Disable filtering, mipmaps */
-            glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_NEAREST);
-            glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_NEAREST);
-         }
-         else
-         {
-            /* Bilinear filtering */
-            /* PowerVR supports also trilinear via two passes, but we ignore that for now */
-            glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,
-                  (tcw.MipMapped && settings.rend.UseMipmaps)?GL_LINEAR_MIPMAP_NEAREST:GL_LINEAR);
-            glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
-         }
-      }
+   vector<TexDecodeJob*> jobs;
+   jobs.swap(tex_decode.jobs);
+   tex_decode.next    = 0;
+   tex_decode.decoded = 0;
+   slock_unlock(tex_decode.lock);
 
-      pal_table_rev = 0;
+   for (size_t i = 0; i < jobs.size(); i++)
+   {
+      TexDecodeJob* job = jobs[i];
 
-		/* PAL texture */
-      switch (tex->bpp)
-      {
-         case 4:
-            pal_table_rev=&pal_rev_16[tcw.PalSelect];
-            indirect_color_ptr=tcw.PalSelect<<4;
-            break;
-         case 8:
-            pal_table_rev=&pal_rev_256[tcw.PalSelect>>4];
-            indirect_color_ptr=(tcw.PalSelect>>4)<<8;
-            break;
-      }
+      tex_upload(job->obj->texID, job->textype, job->src.w, job->src.h, job->mipmap, &job->pixels[0]);
+      tex_release(job->obj);
+      delete job;
+   }
+}
 
-		/* VQ table (if VQ texture) */
-		if (tcw.VQ_Comp)
-			indirect_color_ptr = sa;
+static void tex_decode_init(void)
+{
+   if (tex_decode.lock)
+      return;
 
-      texconv = 0;
+   tex_decode.lock    = slock_new();
+   tex_decode.wake    = scond_new();
+   tex_decode.done    = scond_new();
+   tex_decode.quit    = false;
+   tex_decode.next    = 0;
+   tex_decode.decoded = 0;
 
-      /* Convert a PVR texture into OpenGL */
-		switch (tcw.PixelFmt)
-      {
-         case TA_PIXEL_1555:     /* ARGB1555  - value: 1 bit; RGB values: 5 bits each */
-         case TA_PIXEL_RESERVED: /* RESERVED1 - Regarded as 1555 */
-         case TA_PIXEL_565:      /* RGB565    - R value: 5 bits; G value: 6 bits; B value: 5 bits */
-         case TA_PIXEL_4444:     /* ARGB4444  - value: 4 bits; RGB values: 4 bits each */
-         case TA_PIXEL_YUV422:   /* YUV422    - 32 bits per 2 pixels; YUYV values: 8 bits each */
-         case TA_PIXEL_BUMPMAP:  /* BUMPMAP   - NOT_PROPERLY SUPPORTED- 16 bits/pixel; S value: 8 bits; R value: 8 bits */
-         case TA_PIXEL_4BPP:     /* 4BPP      - Palette texture with 4 bits/pixel */
-         case TA_PIXEL_8BPP:     /* 8BPP      - Palette texture with 8 bits/pixel */
-            if (tcw.ScanOrder && tex->PL)
-            {
-               int stride = w;
-
-               /* Planar textures support stride selection,
-                * mostly used for NPOT textures (videos). */
-               if (tcw.StrideSel)
-                  stride  = (TEXT_CONTROL&31)*32;
-
-               texconv    = tex->PL;                  /* Call the format specific conversion code */
-               size       = stride * h * tex->bpp/8;  /* Calculate the size, in bytes, for the locking. */
-            }
-            else
-            {
-               size = w * h;
-               if (tcw.VQ_Comp)
-               {
-                  indirect_color_ptr = sa;
-                  if (tcw.MipMapped)
-                     sa             += compressed_mipmap_offsets[tsp.TexU];
-                  texconv            = tex->VQ;
-               }
-               else
-               {
-                  if (tcw.MipMapped)
-                     sa             += compressed_mipmap_offsets[tsp.TexU]*tex->bpp/2;
-                  texconv            = tex->TW;
-                  size              *= tex->bpp;
-               }
-               size /= 8;
-            }
-            break;
-         default:
-            printf("Unhandled texture %d\n",tcw.PixelFmt);
-            size=w*h*2;
-            memset(temp_tex_buffer,0xFFFFFFFF,size);
-            break;
-      }
-	}
+   for (int i = 0; i < TEX_DECODE_THREADS; i++)
+      tex_decode.threads[i] = sthread_create(tex_decode_thread, 0);
+}
+
+static void tex_decode_term(void)
+{
+   if (!tex_decode.lock)
+      return;
+
+   tex_decode_upload();
+
+   slock_lock(tex_decode.lock);
+   tex_decode.quit = true;
+   scond_broadcast(tex_decode.wake);
+   slock_unlock(tex_decode.lock);
+
+   for (int i = 0; i < TEX_DECODE_THREADS; i++)
+      sthread_join(tex_decode.threads[i]);
+
+   scond_free(tex_decode.done);
+   scond_free(tex_decode.wake);
+   slock_free(tex_decode.lock);
+   tex_decode.lock = 0;
+}
+#endif
+
+/* Texture Cache */
+struct TextureCacheData : BaseTextureCacheData
+{
+   TexObject* obj;      /* GL texture, possibly shared */
+
+	//Create GL texture from tsp/tcw
+	void Create(void)
+	{
+      obj = 0;
+      BaseTextureCacheData::Create();
+   }
 
 	void Update(void)
    {
-      PixelBuffer pbt;
-      GLuint textype;
-      u32 stride         = w;
+      GLuint textype     = gl_textype[BeginUpdate()];
 
-      Updates++;                                   /* texture state tracking stuff */
-      dirty              = 0;
-      textype            = tex->type;
+      if (UpdateShared(textype, stride))
+         return;
 
-      if (pal_table_rev) 
+#ifndef TARGET_NO_THREADS
+      if (texconv && tex_decode.lock)
       {
-         textype         = PAL_TYPE[PAL_RAM_CTRL&3];
-         pal_local_rev   = *pal_table_rev;             /* make sure to update the local rev, 
-                                                      so it won't have to redo the texture */
+         TexDecodeJob* job = new TexDecodeJob();
+         job->obj          = obj;
+         job->src          = *this;
+         job->textype      = textype;
+         job->mipmap       = tcw.MipMapped && settings.rend.UseMipmaps;
+
+         /* lock first, so writes while it's decoded still mark it dirty */
+         Lock();
+         tex_decode_queue(job);
+         return;
       }
+#endif
 
-      palette_index      = indirect_color_ptr;              /* might be used if paletted texture */
-      vq_codebook        = (u8*)&vram.data[indirect_color_ptr];  /* might be used if VQ texture */
+      Decode(temp_tex_buffer);
 
-      //texture conversion work
-      pbt.p_buffer_start = pbt.p_current_line=temp_tex_buffer;
-      pbt.pixels_per_line=w;
+      /* lock the texture to detect changes in it. */
+      Lock();
 
-      if (tcw.StrideSel && tcw.ScanOrder && tex->PL) 
-         stride = (TEXT_CONTROL&31)*32; //I think this needs +1 ?
+      tex_upload(obj->texID, textype, w, h, tcw.MipMapped && settings.rend.UseMipmaps, temp_tex_buffer);
+   }
 
-      if(texconv)
-         texconv(&pbt,(u8*)&vram.data[sa], stride, h);
-      else
-      {
-         /* fill it in with a temporary color. */
-         printf("UNHANDLED TEXTURE\n");
-         memset(temp_tex_buffer,0xF88F8F7F,w*h*2);
-      }
+   /* Everything the decoded pixels depend on: the source data in vram,
+    * the palette slice and format, and the bits that shape the GL texture. */
+   u64 ContentKey(GLuint textype, u32 stride)
+   {
+      u32 shape_tsp = tsp.TexU | (tsp.TexV << 3) | (tsp.FilterMode << 6) |
+         (tsp.ClampU << 8) | (tsp.ClampV << 9) | (tsp.FlipU << 10) | (tsp.FlipV << 11);
+      u32 shape_tcw = tcw.MipMapped | (tcw.VQ_Comp << 1) | (tcw.PixelFmt << 2) |
+         (tcw.ScanOrder << 5) | (tcw.StrideSel << 6) | (settings.rend.UseMipmaps << 7);
+      u64 seed      = ((u64)shape_tsp << 32) ^ ((u64)shape_tcw << 48) ^ ((u64)textype << 16) ^ stride;
+      u64 key   = tex_hash(&vram.data[sa_tex], sa + size - sa_tex, seed);
+
+      if (pal_table_rev)
+         key = tex_hash((u8*)&palette_ram[indirect_color_ptr], (tex->bpp == 4 ? 16 : 256) * 4, key);
+
+      /* 0 means no content */
+      return key ? key : 1;
+   }
 
-      /* lock the texture to detect changes in it. */
-      lock_block = libCore_vramlock_Lock(sa_tex,sa+size-1,this);
+   /* Reuses an uploaded texture if one with the same pixels exists,
+    * otherwise makes sure obj is a texture only this entry uses. */
+   bool UpdateShared(GLuint textype, u32 stride)
+   {
+      u64 key = texconv ? ContentKey(textype, stride) : 0;
 
-      if (texID)
-      {
-         glBindTexture(GL_TEXTURE_2D, texID);
-         GLuint comps=textype==GL_UNSIGNED_SHORT_5_6_5?GL_RGB:GL_RGBA;
-         glTexImage2D(GL_TEXTURE_2D, 0,comps , w, h, 0, comps, textype, temp_tex_buffer);
-         if (tcw.MipMapped && settings.rend.UseMipmaps)
-            glGenerateMipmap(GL_TEXTURE_2D);
-         glBindTexture(GL_TEXTURE_2D, 0);
-      }
-      else
+      if (key)
       {
-         switch (textype)
+         /* rewritten with the same data */
+         if (obj && obj->content == key)
          {
-            case GL_UNSIGNED_SHORT_5_6_5:
-               tex_type = 0;
-               break;
-            case GL_UNSIGNED_SHORT_5_5_5_1:
-               tex_type = 1;
-               break;
-            case GL_UNSIGNED_SHORT_4_4_4_4:
-               tex_type = 2;
-               break;
+            Lock();
+            return true;
          }
 
-         if (pData)
-         {
-#ifdef __SSE4_1__
-            _mm_free(pData);
-#else
-            memalign_free(pData);
-#endif
-         }
+         TexObject* other = TexContent.Find(key);
 
-#ifdef __SSE4_1__
-         pData = (u16*)_mm_malloc(w * h * 16, 16);
-#else
-         pData = (u16*)memalign_alloc(16, w * h * 16);
-#endif
-         for (int y = 0; y < h; y++)
+         if (other)
          {
-            for (int x = 0; x < w; x++)
-            {
-               u32* data = (u32*)&pData[(x + y*w) * 8];
-
-               data[0]   = decoded_colors[tex_type][temp_tex_buffer[(x + 1) % w + (y + 1) % h * w]];
-               data[1]   = decoded_colors[tex_type][temp_tex_buffer[(x + 0) % w + (y + 1) % h * w]];
-               data[2]   = decoded_colors[tex_type][temp_tex_buffer[(x + 1) % w + (y + 0) % h * w]];
-               data[3]   = decoded_colors[tex_type][temp_tex_buffer[(x + 0) % w + (y + 0) % h * w]];
-            }
+            other->refs++;
+            tex_release(obj);
+            obj = other;
+
+            Lock();
+            return true;
          }
       }
+
+      Unshare();
+
+      if (obj->content && TexContent.Find(obj->content) == obj)
+         TexContent.Erase(obj->content);
+
+      obj->content = key;
+      if (key)
+         TexContent.Insert(key, obj);
+
+      return false;
    }
 
-	/* true if : dirty or paletted texture and revs don't match */
-	bool NeedsUpdate()
-   { 
-      return (dirty) || (pal_table_rev!=0 && *pal_table_rev!=pal_local_rev);
+   /* get a texture object that can be uploaded to */
+   void Unshare()
+   {
+      if (obj && obj->refs == 1)
+         return;
+
+      tex_release(obj);
+
+      obj          = new TexObject();
+      obj->refs    = 1;
+      obj->content = 0;
+      glGenTextures(1, &obj->texID);
+      SetParams();
    }
-	
+
+   void SetParams()
+   {
+      /* Bind texture to set modes */
+      glBindTexture(GL_TEXTURE_2D, obj->texID);
+
+      /* Set texture repeat mode */
+      if (tsp.ClampU)
+         glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      else 
+         glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, tsp.FlipU ? GL_MIRRORED_REPEAT : GL_REPEAT);
+
+      if (tsp.ClampV)
+         glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      else 
+         glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, tsp.FlipV ? GL_MIRRORED_REPEAT : GL_REPEAT);
+
+#ifdef HAVE_OPENGLES
+      glHint(GL_GENERATE_MIPMAP_HINT, GL_NICEST);
+#endif
+
+      /* Set texture filter mode */
+      if (tsp.FilterMode == 0)
+      {
+         /* Disable filtering, mipmaps */
+         glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_NEAREST);
+         glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_NEAREST);
+      }
+      else
+      {
+         /* Bilinear filtering */
+         /* PowerVR supports also trilinear via two passes, but we ignore that for now */
+         glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,
+               (tcw.MipMapped && settings.rend.UseMipmaps)?GL_LINEAR_MIPMAP_NEAREST:GL_LINEAR);
+         glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
+      }
+   }
+
 	void Delete()
 	{
-      if (pData)
-#ifdef __SSE4_1__
-         _mm_free(pData);
-#else
-         memalign_free(pData);
-#endif
-      pData = 0;
-		if (texID)
-         glDeleteTextures(1, &texID);
-      texID = 0;
-		if (lock_block)
-			libCore_vramlock_Unlock_block(lock_block);
-		lock_block=0;
+      tex_release(obj);
+      obj = 0;
+      Unlock();
 	}
 };
 
@@ -1035,56 +1060,6 @@ static void DrawList(const List<PolyParam>& gply)
          GL_KEEP);
 }
 
-bool operator<(const PolyParam &left, const PolyParam &right)
-{
-   /* put any condition you want to sort on here */
-	return left.zvZ  < right.zvZ;
-#if 0
-	return left.zMin < right.zMax;
-#endif
-}
-
-//Sort based on min-z of each strip
-static void SortPParams(void)
-{
-   u16 *idx_base      = NULL;
-   Vertex *vtx_base   = NULL;
-   PolyParam *pp      = NULL;
-   PolyParam *pp_end  = NULL;
-
-   if (pvrrc.verts.used()==0 || pvrrc.global_param_tr.used()<=1)
-      return;
-
-   vtx_base          = pvrrc.verts.head();
-   idx_base          = pvrrc.idx.head();
-   pp                = pvrrc.global_param_tr.head();
-   pp_end            = pp + pvrrc.global_param_tr.used();
-
-   while(pp!=pp_end)
-   {
-      if (pp->count<2)
-         pp->zvZ=0;
-      else
-      {
-         u16*      idx   = idx_base+pp->first;
-         Vertex*   vtx   = vtx_base+idx[0];
-         Vertex* vtx_end = vtx_base + idx[pp->count-1]+1;
-         u32 zv          = 0xFFFFFFFF;
-
-         while(vtx!=vtx_end)
-         {
-            zv = min(zv,(u32&)vtx->z);
-            vtx++;
-         }
-
-         pp->zvZ=(f32&)zv;
-      }
-      pp++;
-   }
-
-   std::stable_sort(pvrrc.global_param_tr.head(),pvrrc.global_param_tr.head()+pvrrc.global_param_tr.used());
-}
-
 static inline float min3(float v0,float v1,float v2)
 {
 	return min(min(v0,v1),v2);
@@ -1778,8 +1753,8 @@ extern bool doCleanFrame;
 #define INDEX_GET(a) (a)
 #endif
 
-map<u64,TextureCacheData> TexCache;
-typedef map<u64,TextureCacheData>::iterator TexCacheIter;
+/* tcw:tsp -> cache entry, entries are heap allocated since vram locks point to them */
+static TexHashTable<TextureCacheData> TexCache;
 
 static void BindRTT(u32 addy, u32 fbw, u32 fbh, u32 channels, u32 fmt)
 {
@@ -2329,22 +2304,17 @@ static GLuint gl_GetTexture(TSP tsp, TCW tcw)
 	/* Lookup texture */
 	u64 key         = ((u64)tcw.full<<32) | tsp.full;
 
-	TexCacheIter tx = TexCache.find(key);
+	tf = TexCache.Find(key);
 
-	if (tx!=TexCache.end())
-		tf = &tx->second;
-	else
+	if (!tf)
 	{
       /* create if not existing */
-		TextureCacheData tfc={0};
-		TexCache[key]=tfc;
-
-		tx=TexCache.find(key);
-		tf=&tx->second;
+		tf = new TextureCacheData();
+		TexCache.Insert(key, tf);
 
 		tf->tsp=tsp;
 		tf->tcw=tcw;
-		tf->Create(true);
+		tf->Create();
 	}
 
 	/* Update if needed */
@@ -2355,29 +2325,7 @@ static GLuint gl_GetTexture(TSP tsp, TCW tcw)
 	tf->Lookups++;
 
 	/* Return texture */
-	return tf->texID;
-}
-
-static void CollectCleanup(void)
-{
-   vector<u64> list;
-
-   u32 TargetFrame = max((u32)120,FrameCount) - 120;
-
-   for (TexCacheIter i=TexCache.begin();i!=TexCache.end();i++)
-   {
-      if ( i->second.dirty &&  i->second.dirty < TargetFrame)
-         list.push_back(i->first);
-
-      if (list.size() > 5)
-         break;
-   }
-
-   for (size_t i=0; i<list.size(); i++)
-   {
-      TexCache[list[i]].Delete();
-      TexCache.erase(list[i]);
-   }
+	return tf->obj ? tf->obj->texID : 0;
 }
 
 struct glesrend : Renderer
@@ -2386,6 +2334,11 @@ struct glesrend : Renderer
    {
       libCore_vramlock_Init();
 
+      texcache_Init(perf_get_cpu_features_cb ? perf_get_cpu_features_cb() : 0);
+#ifndef TARGET_NO_THREADS
+      tex_decode_init();
+#endif
+
       glsm_ctl(GLSM_CTL_STATE_SETUP, NULL);
 
       if (!gl_create_resources())
@@ -2394,7 +2347,13 @@ struct glesrend : Renderer
       return true;
    }
 	void Resize(int w, int h) { gles_screen_width=w; gles_screen_height=h; }
-	void Term() { libCore_vramlock_Free(); }
+	void Term()
+   {
+#ifndef TARGET_NO_THREADS
+      tex_decode_term();
+#endif
+      libCore_vramlock_Free();
+   }
 
 	bool Process(TA_context* ctx)
    {
@@ -2416,13 +2375,19 @@ struct glesrend : Renderer
       if (!ta_parse_vdrc(ctx))
          return false;
 
-      CollectCleanup();
+      texcache_Collect(TexCache);
+
+      /* protect everything the textures of this frame locked */
+      libCore_vramlock_Flush();
 
       return true;
    }
 	bool Render()
    {
       glsm_ctl(GLSM_CTL_STATE_BIND, NULL);
+#ifndef TARGET_NO_THREADS
+      tex_decode_upload();
+#endif
       return RenderFrame();
    }
 
@@ -2460,17 +2425,6 @@ Compression
 
 void killtex(void)
 {
-	for (TexCacheIter i=TexCache.begin();i!=TexCache.end();i++)
-		i->second.Delete();
-
-	TexCache.clear();
-}
-
-void rend_text_invl(vram_block* bl)
-{
-	TextureCacheData* tcd = (TextureCacheData*)bl->userdata;
-	tcd->dirty=FrameCount;
-	tcd->lock_block=0;
-
-	libCore_vramlock_Unlock_block_wb(bl);
+	texcache_Clear(TexCache);
+	TexContent.Clear();
 }
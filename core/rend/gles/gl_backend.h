@@ -1,9 +1,4 @@
 #pragma once
 #include "rend/rend.h"
-
-struct text_info {
-	u16* pdata;
-	u32 width;
-	u32 height;
-	u32 textype; // 0 565, 1 1555, 2 4444
-};
+#include "rend/TexCache.h"
+#include "rend/sorter.h"
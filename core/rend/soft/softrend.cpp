@@ -1,26 +1,38 @@
-#include <omp.h>
 #include "hw/pvr/pvr.h"
 
 /*
-	SSE/MMX based softrend
+	SSE based softrend
 
 	Initial code by skmp and gigaherz
 
 	This is a rather weird very basic pvr softrend. 
-	Renders	in some kind of tile format (that I forget now),
-	and does depth and color, but no alpha, texture, or pixel
-	processing. All of the pipeline is based on quads.
+	Renders	in some kind of tile format (4x4 pixel blocks),
+	and does depth, color, texture, alpha test and blending, but no
+	modifier volumes, fog or offset color. All of the pipeline is
+	based on quads.
+
+	Triangles are binned into TILE_SIZE screen tiles first, then the
+	tiles are rasterized in parallel. Every tile only ever touches its
+	own pixels, so the workers don't need to sync with each other.
 */
 
-#include <mmintrin.h>
+#if HOST_CPU == CPU_X86 || HOST_CPU == CPU_X64
+
 #include <xmmintrin.h>
 #include <emmintrin.h>
-#ifdef __SSE4_1__
-#include <smmintrin.h>
-#endif
 #include <cmath>
 
-#include "rend/gles/gles.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <rthreads/rthreads.h>
+
+#include "rend/TexCache.h"
+#include "rend/sorter.h"
+#include "libretro/libretro.h"
 
 #define MAX_RENDER_WIDTH 640
 #define MAX_RENDER_HEIGHT 480
@@ -29,19 +41,19 @@
 #define STRIDE_PIXEL_OFFSET MAX_RENDER_WIDTH
 #define Z_BUFFER_PIXEL_OFFSET MAX_RENDER_PIXELS
 
+//must be a multiple of the 4x4 block size, and divide the screen
+#define TILE_SIZE 32
+#define TILES_X (MAX_RENDER_WIDTH / TILE_SIZE)
+#define TILES_Y (MAX_RENDER_HEIGHT / TILE_SIZE)
+#define TILE_COUNT (TILES_X * TILES_Y)
+
 DECL_ALIGN(32) u32 render_buffer[MAX_RENDER_PIXELS * 2]; //Color + depth
-DECL_ALIGN(32) u32 pixels[MAX_RENDER_PIXELS];
+DECL_ALIGN(32) u32 softrend_pixels[MAX_RENDER_PIXELS];   //Presented frame, xrgb8888
 
-#ifdef __SSE2__
-union m128i
+struct TileArea
 {
-	__m128i mm;
-	int8_t m128i_i8[16];
-	int16_t m128i_i16[8];
-	int32_t m128i_i32[4];
-	uint32_t m128i_u32[4];
+	int left, top, right, bottom;
 };
-#endif
 
 static __m128 _mm_load_scaled_float(float v, float s)
 {
@@ -51,11 +63,6 @@ static __m128 _mm_broadcast_float(float v)
 {
 	return _mm_setr_ps(v, v, v, v);
 }
-static __m128i _mm_broadcast_int(int v)
-{
-	__m128i rv = _mm_cvtsi32_si128(v);
-	return _mm_shuffle_epi32(rv, 0);
-}
 static __m128 _mm_load_ps_r(float a, float b, float c, float d)
 {
    DECL_ALIGN(128) float v[4];
@@ -240,12 +247,75 @@ struct IPs
 
 
 //<alpha_blend, pp_UseAlpha, pp_Texture, pp_IgnoreTexA, pp_ShadInstr, pp_Offset >
-typedef void(*RendtriangleFn)(PolyParam* pp, int vertex_offset, const Vertex &v1, const Vertex &v2, const Vertex &v3, u32* colorBuffer, RECT* area);
+typedef void(*RendtriangleFn)(PolyParam* pp, text_info* texture, int vertex_offset, const Vertex &v1, const Vertex &v2, const Vertex &v3, u32* colorBuffer, TileArea* area);
 RendtriangleFn RendtriangleFns[3][2][2][2][4][2];
 
 
 __m128i const_setAlpha;
-__m128i shuffle_alpha;
+
+//broadcasts the alpha of each pixel over its channels, on 16 bit unpacked pixels
+static __forceinline __m128i AlphaSplat(__m128i c16)
+{
+	return _mm_shufflehi_epi16(_mm_shufflelo_epi16(c16, 0xFF), 0xFF);
+}
+
+//a * b / 256, per channel
+static __forceinline __m128i MulColor(__m128i a, __m128i b)
+{
+	__m128i zero = _mm_setzero_si128();
+
+	__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+	__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+
+	return _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+}
+
+//a * w.alpha + b * (255 - w.alpha), per channel
+static __forceinline __m128i BlendColor(__m128i a, __m128i b, __m128i w)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i ff = _mm_set1_epi16(255);
+
+	__m128i lo_w = AlphaSplat(_mm_unpacklo_epi8(w, zero));
+	__m128i hi_w = AlphaSplat(_mm_unpackhi_epi8(w, zero));
+
+	__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), lo_w), _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), _mm_sub_epi16(ff, lo_w)));
+	__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), hi_w), _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), _mm_sub_epi16(ff, hi_w)));
+
+	return _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+}
+
+//floor, for the texel coordinates
+static __forceinline __m128i FloorInt(__m128 v)
+{
+	__m128i i = _mm_cvttps_epi32(v);
+	__m128 over = _mm_cmpgt_ps(_mm_cvtepi32_ps(i), v);
+
+	return _mm_add_epi32(i, _mm_castps_si128(over));
+}
+
+//Bilinear sample. The texture cache stores every texel as the 2x2 quad
+//{(u+1,v+1), (u,v+1), (u+1,v), (u,v)}, fu/fv are 0 ... 255
+static __forceinline u32 SampleTexel(const text_info* texture, int u, int v, int fu, int fv)
+{
+	u32 idx = (u & (texture->width - 1)) + (v & (texture->height - 1)) * texture->width;
+	__m128i px = ((__m128i*)texture->pdata)[idx];
+	__m128i zero = _mm_setzero_si128();
+
+	__m128i wu = _mm_setr_epi16(fu, fu, fu, fu, 256 - fu, 256 - fu, 256 - fu, 256 - fu);
+	__m128i wv = _mm_setr_epi16(256 - fv, 256 - fv, 256 - fv, 256 - fv, fv, fv, fv, fv);
+
+	__m128i row1 = _mm_mullo_epi16(_mm_unpacklo_epi8(px, zero), wu);
+	__m128i row0 = _mm_mullo_epi16(_mm_unpackhi_epi8(px, zero), wu);
+
+	row1 = _mm_srli_epi16(_mm_add_epi16(row1, _mm_unpackhi_epi64(row1, row1)), 8);
+	row0 = _mm_srli_epi16(_mm_add_epi16(row0, _mm_unpackhi_epi64(row0, row0)), 8);
+
+	__m128i col = _mm_mullo_epi16(_mm_unpacklo_epi64(row0, row1), wv);
+	col = _mm_srli_epi16(_mm_add_epi16(col, _mm_unpackhi_epi64(col, col)), 8);
+
+	return _mm_cvtsi128_si32(_mm_packus_epi16(col, col));
+}
 
 TPL_DECL_pixel
 static void PixelFlush(PolyParam* pp, text_info* texture, __m128 x, __m128 y, u8* cb, __m128 oldmask, IPs& ip)
@@ -284,8 +354,6 @@ static void PixelFlush(PolyParam* pp, text_info* texture, __m128 x, __m128 y, u8
 		__m128 c = ip.Col.InStep(b);
 		__m128 d = ip.Col.InStep(c);
 
-		//we need : 
-
 		__m128i ab = _mm_packs_epi32(_mm_cvttps_epi32(a), _mm_cvttps_epi32(b));
 		__m128i cd = _mm_packs_epi32(_mm_cvttps_epi32(c), _mm_cvttps_epi32(d));
 
@@ -296,306 +364,93 @@ static void PixelFlush(PolyParam* pp, text_info* texture, __m128 x, __m128 y, u8
 		}
 
 		if (pp_Texture) {
+			//texel centers are at .5
+			u = _mm_sub_ps(u, _mm_set1_ps(0.5f));
+			v = _mm_sub_ps(v, _mm_set1_ps(0.5f));
 
-			__m128i ui = _mm_cvttps_epi32(u);
-			__m128i vi = _mm_cvttps_epi32(v);
-
-			__m128 uf = _mm_sub_ps(u, _mm_cvtepi32_ps(ui));
-			__m128 vf = _mm_sub_ps(v, _mm_cvtepi32_ps(vi));
-
-			__m128i ufi = _mm_cvttps_epi32(_mm_mul_ps(uf, _mm_set1_ps(256)));
-			__m128i vfi = _mm_cvttps_epi32(_mm_mul_ps(vf, _mm_set1_ps(256)));
-
-			//(int)v<<x+(int)u
-         __m128i textadr;
-#ifdef __SSE4_1__
-			textadr.mm = _mm_add_epi32(_mm_slli_epi32(vi, 16), ui);//texture addresses ! 4x of em !
-#else
-			textadr    = _mm_add_epi32(_mm_slli_epi32(vi, 16), ui);//texture addresses ! 4x of em !
-#endif
-			__m128i textel;
-
-			for (int i = 0; i < 4; i++) {
-				u32 u = textadr.m128i_i16[i * 2 + 0];
-				u32 v = textadr.m128i_i16[i * 2 + 1];
-				
-				__m128i mufi_ = _mm_shuffle_epi32(ufi, _MM_SHUFFLE(0, 0, 0, 0));
-				__m128i mufi_n = _mm_sub_epi32(_mm_set1_epi32(255), mufi_);
-
-				__m128i mvfi_ = _mm_shuffle_epi32(vfi, _MM_SHUFFLE(0, 0, 0, 0));
-				__m128i mvfi_n = _mm_sub_epi32(_mm_set1_epi32(255), mvfi_);
-				
-				ufi = _mm_shuffle_epi32(ufi, _MM_SHUFFLE(0,3,2,1));
-				vfi = _mm_shuffle_epi32(vfi, _MM_SHUFFLE(0,3,2,1));
-
-				u32 pixel;
-				
-#if 0
-				u32 textel_size = 2;
-				
-				u32 pixel00 = decoded_colors[texture->textype][texture->pdata[((u + 1) % texture->width + (v + 1) % texture->height * texture->width)]];
-				u32 pixel01 = decoded_colors[texture->textype][texture->pdata[((u + 0) % texture->width + (v + 1) % texture->height * texture->width)]];
-				u32 pixel10 = decoded_colors[texture->textype][texture->pdata[((u + 1) % texture->width + (v + 0) % texture->height * texture->width)]];
-				u32 pixel11 = decoded_colors[texture->textype][texture->pdata[((u + 0) % texture->width + (v + 0) % texture->height * texture->width)]];
-
-				
-				for (int j = 0; j < 4; j++) {
-				((u8*)&pixel)[j] =
-				
-				(((u8*)&pixel00)[j] * uf.m128_f32[i] + ((u8*)&pixel01)[j] * (1 - uf.m128_f32[i])) * vf.m128_f32[i] + (((u8*)&pixel10)[j] * uf.m128_f32[i] + ((u8*)&pixel11)[j] * (1 - uf.m128_f32[i])) * (1 - vf.m128_f32[i]);
-				}
-#endif
-
-				__m128i px = ((__m128i*)texture->pdata)[((u + 0) % texture->width + (v + 0) % texture->height * texture->width)];
-
+			__m128i ui = FloorInt(u);
+			__m128i vi = FloorInt(v);
 
-				
-				__m128i tex_00 = _mm_cvtepu8_epi32(px);
-				__m128i tex_01 = _mm_cvtepu8_epi32(_mm_shuffle_epi32(px, _MM_SHUFFLE(0, 0, 0, 1)));
-				__m128i tex_10 = _mm_cvtepu8_epi32(_mm_shuffle_epi32(px, _MM_SHUFFLE(0, 0, 0, 2)));
-				__m128i tex_11 = _mm_cvtepu8_epi32(_mm_shuffle_epi32(px, _MM_SHUFFLE(0, 0, 0, 3)));
+			__m128i ufi = _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(u, _mm_cvtepi32_ps(ui)), _mm_set1_ps(256)));
+			__m128i vfi = _mm_cvttps_epi32(_mm_mul_ps(_mm_sub_ps(v, _mm_cvtepi32_ps(vi)), _mm_set1_ps(256)));
 
-				tex_00 = _mm_add_epi32(_mm_mullo_epi32(tex_00, mufi_), _mm_mullo_epi32(tex_01, mufi_n));
-				tex_10 = _mm_add_epi32(_mm_mullo_epi32(tex_10, mufi_), _mm_mullo_epi32(tex_10, mufi_n));
-				
-				tex_00 = _mm_add_epi32(_mm_mullo_epi32(tex_00, mvfi_), _mm_mullo_epi32(tex_10, mvfi_n));
-				tex_00 = _mm_srli_epi32(tex_00, 16);
+			DECL_ALIGN(16) s32 tu[4], tv[4], tfu[4], tfv[4];
+			DECL_ALIGN(16) u32 texels[4];
 
-				tex_00 = _mm_packus_epi32(tex_00, tex_00);
-				tex_00 = _mm_packus_epi16(tex_00, tex_00);
-				pixel = _mm_cvtsi128_si32(tex_00);
-#if 0
-				//top    = c0 * a + c1 * (1-a)
-				//bottom = c2 * a + c3 * (1-a)
+			_mm_store_si128((__m128i*)tu, ui);
+			_mm_store_si128((__m128i*)tv, vi);
+			_mm_store_si128((__m128i*)tfu, ufi);
+			_mm_store_si128((__m128i*)tfv, vfi);
 
-				//[c0 c2] [c1 c3]
-				//[c0 c2]*a + [c1 c3] * (1 - a) = [cx cy]
-				//[cx * d + cy * (1-d)]
-				//cf
-				_mm_unpacklo_epi8()
-				__m128i y = _mm_cvtps_epi32(x);    // Convert them to 32-bit ints
-				y = _mm_packus_epi32(y, y);        // Pack down to 16 bits
-				y = _mm_packus_epi16(y, y);        // Pack down to 8 bits
-				*(int*)out = _mm_cvtsi128_si32(y); // Store the lower 32 bits
+			for (int i = 0; i < 4; i++)
+				texels[i] = SampleTexel(texture, tu[i], tv[i], tfu[i] & 255, tfv[i] & 255);
 
-				// 0x000000FF * 0x00010001 = 0x00FF00FF
-				
-				
-
-
-				__m128i px = ((__m128i*)texture->pdata)[((u) & ( texture->width - 1) + (v) & (texture->height-1) * texture->width)];
-
-				__m128i lo_px = _mm_cvtepu8_epi16(px);
-				__m128i hi_px = _mm_cvtepu8_epi16(_mm_shuffle_epi32(px, _MM_SHUFFLE(1, 0, 3, 2)));
-#endif
-				textel.m128i_i32[i] = pixel;
-			}
+			__m128i textel = _mm_load_si128((__m128i*)texels);
 
 			if (pp_IgnoreTexA) {
-#ifdef __SSE4_1__
-            textel.mm = _mm_or_si128(textel.mm, const_setAlpha);
-#else
 				textel = _mm_or_si128(textel, const_setAlpha);
-#endif
 			}
 
-			if (pp_ShadInstr == 0){
-					//color.rgb = texcol.rgb;
-					//color.a = texcol.a;
-#ifdef __SSE4_1__
-            rv = textel.mm;
-#else
-            rv = textel;
-#endif
+			if (pp_ShadInstr == 0) {
+				//color.rgb = texcol.rgb;
+				//color.a = texcol.a;
+				rv = textel;
 			}
 			else if (pp_ShadInstr == 1) {
 				//color.rgb *= texcol.rgb;
 				//color.a = texcol.a;
-
-				//color.a = 1
-				rv = _mm_or_si128(rv, const_setAlpha);
-
-				//color *= texcol
-				__m128i lo_rv = _mm_cvtepu8_epi16(rv);
-				__m128i hi_rv = _mm_cvtepu8_epi16(_mm_shuffle_epi32(rv, _MM_SHUFFLE(1, 0, 3, 2)));
-
-#ifdef __SSE4_1__
-            __m128i lo_fb = _mm_cvtepu8_epi16(textel.mm);
-            __m128i hi_fb = _mm_cvtepu8_epi16(_mm_shuffle_epi32(textel.mm, _MM_SHUFFLE(1, 0, 3, 2)));
-#else
-				__m128i lo_fb = _mm_cvtepu8_epi16(textel);
-				__m128i hi_fb = _mm_cvtepu8_epi16(_mm_shuffle_epi32(textel, _MM_SHUFFLE(1, 0, 3, 2)));
-#endif
-
-
-				lo_rv = _mm_mullo_epi16(lo_rv, lo_fb);
-				hi_rv = _mm_mullo_epi16(hi_rv, hi_fb);
-
-				rv = _mm_packus_epi16(_mm_srli_epi16(lo_rv, 8), _mm_srli_epi16(hi_rv, 8));
+				rv = MulColor(rv, textel);
+				rv = _mm_or_si128(_mm_andnot_si128(const_setAlpha, rv), _mm_and_si128(const_setAlpha, textel));
 			}
 			else if (pp_ShadInstr == 2) {
 				//color.rgb=mix(color.rgb,texcol.rgb,texcol.a);
-
-				// a bit wrong atm, as it also mixes alphas
-				__m128i lo_rv = _mm_cvtepu8_epi16(rv);
-				__m128i hi_rv = _mm_cvtepu8_epi16(_mm_shuffle_epi32(rv, _MM_SHUFFLE(1, 0, 3, 2)));
-
-
-#ifdef __SSE4_1__
-				__m128i lo_fb = _mm_cvtepu8_epi16(textel.mm);
-				__m128i hi_fb = _mm_cvtepu8_epi16(_mm_shuffle_epi32(textel.mm, _MM_SHUFFLE(1, 0, 3, 2)));
-#else
-				__m128i lo_fb = _mm_cvtepu8_epi16(textel);
-				__m128i hi_fb = _mm_cvtepu8_epi16(_mm_shuffle_epi32(textel, _MM_SHUFFLE(1, 0, 3, 2)));
-#endif
-
-				__m128i lo_rv_alpha = _mm_shuffle_epi8(lo_fb, shuffle_alpha);
-				__m128i hi_rv_alpha = _mm_shuffle_epi8(hi_fb, shuffle_alpha);
-
-				__m128i lo_fb_alpha = _mm_sub_epi16(_mm_set1_epi16(255), lo_rv_alpha);
-				__m128i hi_fb_alpha = _mm_sub_epi16(_mm_set1_epi16(255), hi_rv_alpha);
-
-
-				lo_rv = _mm_mullo_epi16(lo_rv, lo_rv_alpha);
-				hi_rv = _mm_mullo_epi16(hi_rv, hi_rv_alpha);
-
-				lo_fb = _mm_mullo_epi16(lo_fb, lo_fb_alpha);
-				hi_fb = _mm_mullo_epi16(hi_fb, hi_fb_alpha);
-
-				rv = _mm_packus_epi16(_mm_srli_epi16(_mm_adds_epu16(lo_rv, lo_fb), 8), _mm_srli_epi16(_mm_adds_epu16(hi_rv, hi_fb), 8));
+				__m128i mixed = BlendColor(textel, rv, textel);
+				rv = _mm_or_si128(_mm_andnot_si128(const_setAlpha, mixed), _mm_and_si128(const_setAlpha, rv));
 			}
 			else if (pp_ShadInstr == 3) {
 				//color*=texcol
-				__m128i lo_rv = _mm_cvtepu8_epi16(rv);
-				__m128i hi_rv = _mm_cvtepu8_epi16(_mm_shuffle_epi32(rv, _MM_SHUFFLE(1, 0, 3, 2)));
-
-
-				__m128i lo_fb = _mm_cvtepu8_epi16(textel);
-				__m128i hi_fb = _mm_cvtepu8_epi16(_mm_shuffle_epi32(textel, _MM_SHUFFLE(1, 0, 3, 2)));
-
-
-				lo_rv = _mm_mullo_epi16(lo_rv, lo_fb);
-				hi_rv = _mm_mullo_epi16(hi_rv, hi_fb);
-
-				rv = _mm_packus_epi16(_mm_srli_epi16(lo_rv, 8), _mm_srli_epi16(hi_rv, 8));
+				rv = MulColor(rv, textel);
 			}
 
 			if (pp_Offset) {
 				//add offset
 			}
-			
-
-			//textadr = _mm_add_epi32(textadr, _mm_setr_epi32(tex_addr, tex_addr, tex_addr, tex_addr));
-#ifdef __SSE4_1__
-			//rv = textel.mm; // _mm_xor_si128(rv, textadr);
-#else
-			//rv = textel; // _mm_xor_si128(rv, textadr);
-#endif
 		}
 	}
 
-	//__m128i rv=ip.col;//_mm_xor_si128(_mm_cvtps_epi32(_mm_mul_ps(x,Z.c)),_mm_cvtps_epi32(y));
-
-	//Alpha test
+	//Alpha test, failing pixels are discarded
 	if (alpha_mode == 1) {
-		__m128i fb = *(__m128i*)cb;
-
-#if 1
-#ifdef __SSE4_1__
-      m128i mm_rv, mm_fb;
-      mm_rv.mm = rv;
-      mm_fb.mm = fb;
-#endif
-		//ALPHA_TEST
-		for (int i = 0; i < 4; i++)
-      {
-#ifdef __SSE4_1__
-			if (mm_rv.m128i_i8[i * 4 + 3] < PT_ALPHA_REF)
-				mm_rv.m128i_u32[i] = mm_fb.m128i_u32[i];
-#else
-			if (rv.m128i_i8[i * 4 + 3] < PT_ALPHA_REF)
-				rv.m128i_u32[i] = fb.m128i_u32[i];
-#endif
-		}
-
-#ifdef __SSE4_1__
-		rv = mm_rv.mm;
-#endif
-#else
-		__m128i ALPHA_TEST = _mm_set1_epi8(PT_ALPHA_REF);
-		__m128i mask = _mm_cmplt_epi8(_mm_subs_epu16(ALPHA_TEST, rv), _mm_setzero_si128());
-
-		mask = _mm_srai_epi32(mask, 31); //FF on the pixels we want to keep
+		__m128i ref = _mm_set1_epi32((s32)PT_ALPHA_REF - 1);
+		__m128i pass = _mm_cmpgt_epi32(_mm_srli_epi32(rv, 24), ref);
 
-		rv = _mm_or_si128(_mm_and_si128(rv, mask), _mm_andnot_si128(mask, cb));
-#endif
+		ZMask = _mm_and_ps(ZMask, _mm_castsi128_ps(pass));
+		msk = _mm_movemask_ps(ZMask);
 
+		if (msk == 0)
+			return;
 	}
 	else if (alpha_mode == 2) {
-		__m128i fb = *(__m128i*)cb;
-#if 0
-		for (int i = 0; i < 16; i += 4) {
-			u8 src_blend[4] = { rv.m128i_u8[i + 3], rv.m128i_u8[i + 3], rv.m128i_u8[i + 3], rv.m128i_u8[i + 3] };
-			u8 dst_blend[4] = { 255 - rv.m128i_u8[i + 3], 255 - rv.m128i_u8[i + 3], 255 - rv.m128i_u8[i + 3], 255 - rv.m128i_u8[i + 3] };
-			for (int j = 0; j < 4; j++) {
-				rv.m128i_u8[i + j] = (rv.m128i_u8[i + j] * src_blend[j]) / 256 + (fb.m128i_u8[i + j] * dst_blend[j]) / 256;
-			}
-		}
-#else
-
-
-		__m128i lo_rv = _mm_cvtepu8_epi16(rv);
-		__m128i hi_rv = _mm_cvtepu8_epi16(_mm_shuffle_epi32(rv, _MM_SHUFFLE(1, 0, 3, 2)));
-
-
-		__m128i lo_fb = _mm_cvtepu8_epi16(fb);
-		__m128i hi_fb = _mm_cvtepu8_epi16(_mm_shuffle_epi32(fb, _MM_SHUFFLE(1, 0, 3, 2)));
-
-		__m128i lo_rv_alpha = _mm_shuffle_epi8(lo_rv, shuffle_alpha);
-		__m128i hi_rv_alpha = _mm_shuffle_epi8(hi_rv, shuffle_alpha);
-
-		__m128i lo_fb_alpha = _mm_sub_epi16(_mm_set1_epi16(255), lo_rv_alpha);
-		__m128i hi_fb_alpha = _mm_sub_epi16(_mm_set1_epi16(255), hi_rv_alpha);
-
-
-		lo_rv = _mm_mullo_epi16(lo_rv, lo_rv_alpha);
-		hi_rv = _mm_mullo_epi16(hi_rv, hi_rv_alpha);
-
-		lo_fb = _mm_mullo_epi16(lo_fb, lo_fb_alpha);
-		hi_fb = _mm_mullo_epi16(hi_fb, hi_fb_alpha);
-
-		rv = _mm_packus_epi16(_mm_srli_epi16(_mm_adds_epu16(lo_rv, lo_fb), 8), _mm_srli_epi16(_mm_adds_epu16(hi_rv, hi_fb), 8));
-#endif
+		rv = BlendColor(rv, *(__m128i*)cb, rv);
 	}
 
 	if (msk != 0xF)
 	{
-		rv = _mm_and_si128(rv, *(__m128i*)&ZMask);
-		rv = _mm_or_si128(_mm_andnot_si128(*(__m128i*)&ZMask, *(__m128i*)cb), rv);
+		rv = _mm_and_si128(rv, _mm_castps_si128(ZMask));
+		rv = _mm_or_si128(_mm_andnot_si128(_mm_castps_si128(ZMask), *(__m128i*)cb), rv);
 
 		invW = _mm_and_ps(invW, ZMask);
 		invW = _mm_or_ps(_mm_andnot_ps(ZMask, *zb), invW);
-
 	}
-	*zb = invW;
+
+	if (!pp->isp.ZWriteDis)
+		*zb = invW;
 	*(__m128i*)cb = rv;
 }
 
 //u32 nok,fok;
 TPL_DECL_triangle
-static void Rendtriangle(PolyParam* pp, int vertex_offset, const Vertex &v1, const Vertex &v2, const Vertex &v3, u32* colorBuffer, RECT* area)
+static void Rendtriangle(PolyParam* pp, text_info* texture, int vertex_offset, const Vertex &v1, const Vertex &v2, const Vertex &v3, u32* colorBuffer, TileArea* area)
 {
-	text_info texture = { 0 };
-
-	if (pp_Texture) {
-
-		#pragma omp critical (texture_lookup)
-		{
-			texture = raw_GetTexture(pp->tsp, pp->tcw);
-		}
-			
-	}
-
 	const int stride_bytes = STRIDE_PIXEL_OFFSET * 4;
 	//Plane equation
 
@@ -719,7 +574,7 @@ static void Rendtriangle(PolyParam* pp, int vertex_offset, const Vertex &v1, con
 
    DECL_ALIGN(64) IPs ip;
 
-	ip.Setup(pp, &texture, v1, v2, v3, minx, miny, q);
+	ip.Setup(pp, texture, v1, v2, v3, minx, miny, q);
 	
 	
 	__m128 y_ps = _mm_broadcast_float(miny);
@@ -760,7 +615,7 @@ static void Rendtriangle(PolyParam* pp, int vertex_offset, const Vertex &v1, con
 				__m128 yl_ps = y_ps;
 				for (int iy = q; iy > 0; iy--)
 				{
-					PixelFlush TPL_PRMS_pixel(false) (pp, &texture, x_ps, yl_ps, cb_x, x_ps, ip);
+					PixelFlush TPL_PRMS_pixel(false) (pp, texture, x_ps, yl_ps, cb_x, x_ps, ip);
 					yl_ps = _mm_add_ps(yl_ps, *(__m128*)ones_ps);
 					cb_x += sizeof(__m128);
 				}
@@ -797,9 +652,9 @@ static void Rendtriangle(PolyParam* pp, int vertex_offset, const Vertex &v1, con
 					if (msk != 0)
 					{
 						if (msk != 0xF)
-							PixelFlush TPL_PRMS_pixel(true) (pp, &texture, x_ps, yl_ps, cb_x, *(__m128*)&a, ip);
+							PixelFlush TPL_PRMS_pixel(true) (pp, texture, x_ps, yl_ps, cb_x, *(__m128*)&a, ip);
 						else
-							PixelFlush TPL_PRMS_pixel(false) (pp, &texture, x_ps, yl_ps, cb_x, *(__m128*)&a, ip);
+							PixelFlush TPL_PRMS_pixel(false) (pp, texture, x_ps, yl_ps, cb_x, *(__m128*)&a, ip);
 					}
 
 					yl_ps = _mm_add_ps(yl_ps, *(__m128*)ones_ps);
@@ -823,7 +678,6 @@ static void Rendtriangle(PolyParam* pp, int vertex_offset, const Vertex &v1, con
 				}*/
 			}
 		}
-	next_y:
 		hs12 += FDqX12;
 		hs23 += FDqX23;
 		hs31 += FDqX31;
@@ -833,98 +687,298 @@ static void Rendtriangle(PolyParam* pp, int vertex_offset, const Vertex &v1, con
 }
 
 
-struct softrend : Renderer
+
+//Binning
+//
+struct SoftTriangle
 {
-	virtual bool Process(TA_context* ctx) {
-		//disable RTTs for now ..
-		if (ctx->rend.isRTT)
-			return false;
+	RendtriangleFn fn;
+	PolyParam* pp;
+	text_info* texture;
+	u32 vertex_offset;
+	u32 v1, v2, v3;
+};
 
-		ctx->rend_inuse.Lock();
-		ctx->MarkRend();
+static vector<text_info> textures;       //looked up while parsing, PolyParam::texid indexes it
+static vector<SoftTriangle> triangles;   //every triangle of the frame, in draw order
+static vector<u32> tile_bins[TILE_COUNT];//triangles touching each tile, in draw order
 
-		if (!ta_parse_vdrc(ctx))
-			return false;
+template <int alpha_mode>
+static void BinParamList(List<PolyParam>* param_list)
+{
+	Vertex* verts = pvrrc.verts.head();
+	u16* idx = pvrrc.idx.head();
 
-		return true;
+	PolyParam* params = param_list->head();
+	int param_count = param_list->used();
+
+	for (int i = 0; i < param_count; i++)
+	{
+		PolyParam* pp = &params[i];
+		int vertex_count = pp->count - 2;
+
+		text_info* texture = 0;
+		if (pp->pcw.Texture && pp->texid < textures.size() && textures[pp->texid].pdata)
+			texture = &textures[pp->texid];
+
+		////<alpha_blend, pp_UseAlpha, pp_Texture, pp_IgnoreTexA, pp_ShadInstr, pp_Offset >
+		RendtriangleFn fn = RendtriangleFns[alpha_mode][pp->tsp.UseAlpha][texture != 0][pp->tsp.IgnoreTexA][pp->tsp.ShadInstr][pp->pcw.Offset];
+
+		u16* poly_idx = &idx[pp->first];
+
+		for (int v = 0; v < vertex_count; v++) {
+			const Vertex& v1 = verts[poly_idx[v]];
+			const Vertex& v2 = verts[poly_idx[v + 1]];
+			const Vertex& v3 = verts[poly_idx[v + 2]];
+
+			float minx = min(v1.x, min(v2.x, v3.x));
+			float miny = min(v1.y, min(v2.y, v3.y));
+			float maxx = max(v1.x, max(v2.x, v3.x));
+			float maxy = max(v1.y, max(v2.y, v3.y));
+
+			//also rejects NaNs
+			if (!(maxx >= 0 && maxy >= 0 && minx < MAX_RENDER_WIDTH && miny < MAX_RENDER_HEIGHT))
+				continue;
+
+			int tx0 = (int)max(minx, 0.f) / TILE_SIZE;
+			int ty0 = (int)max(miny, 0.f) / TILE_SIZE;
+			int tx1 = (int)min(maxx, MAX_RENDER_WIDTH - 1.f) / TILE_SIZE;
+			int ty1 = (int)min(maxy, MAX_RENDER_HEIGHT - 1.f) / TILE_SIZE;
+
+			SoftTriangle tri = { fn, pp, texture, (u32)v, poly_idx[v], poly_idx[v + 1], poly_idx[v + 2] };
+			u32 tri_index = triangles.size();
+			triangles.push_back(tri);
+
+			for (int ty = ty0; ty <= ty1; ty++)
+				for (int tx = tx0; tx <= tx1; tx++)
+					tile_bins[ty * TILES_X + tx].push_back(tri_index);
+		}
 	}
+}
 
-	
+static void RenderTile(u32 tile)
+{
+	int tx = tile % TILES_X;
+	int ty = tile / TILES_X;
+	TileArea area = { tx * TILE_SIZE, ty * TILE_SIZE, (tx + 1) * TILE_SIZE, (ty + 1) * TILE_SIZE };
+
+	const int stride_bytes = STRIDE_PIXEL_OFFSET * 4;
+	const int row_bytes = TILE_SIZE * 4 * 4;
+
+	//clear color and depth, every 4 lines are a row of 4x4 blocks
+	for (int y = area.top; y < area.bottom; y += 4)
+	{
+		u8* blocks = (u8*)render_buffer + y * stride_bytes + area.left * 4 * 4;
+
+		memset(blocks, 0, row_bytes);
+		memset(blocks + Z_BUFFER_PIXEL_OFFSET * 4, 0, row_bytes);
+	}
+
+	Vertex* verts = pvrrc.verts.head();
+	vector<u32>& bin = tile_bins[tile];
 
-	template <int alpha_mode>
-	void RenderParamList(List<PolyParam>* param_list, RECT* area) {
-		
-		Vertex* verts = pvrrc.verts.head();
-		u16* idx = pvrrc.idx.head();
+	for (size_t i = 0; i < bin.size(); i++)
+	{
+		SoftTriangle& tri = triangles[bin[i]];
+
+		tri.fn(tri.pp, tri.texture, tri.vertex_offset, verts[tri.v1], verts[tri.v2], verts[tri.v3], render_buffer, &area);
+	}
 
-		PolyParam* params = param_list->head();
-		int param_count = param_list->used();
+	//untile to the presented frame
+	for (int y = area.top; y < area.bottom; y += 4)
+	{
+		__m128i* psrc = (__m128i*)((u8*)render_buffer + y * stride_bytes + area.left * 4 * 4);
 
-		for (int i = 0; i < param_count; i++)
+		for (int x = area.left; x < area.right; x += 4)
 		{
-			int vertex_count = params[i].count - 2;
+			for (int i = 0; i < 4; i++)
+				_mm_store_si128((__m128i*)&softrend_pixels[(y + i) * MAX_RENDER_WIDTH + x], *psrc++);
+		}
+	}
+}
 
-			u16* poly_idx = &idx[params[i].first];
+//Tile workers
+//
+#ifndef TARGET_NO_THREADS
+#define SOFT_MAX_THREADS 32
 
-			for (int v = 0; v < vertex_count; v++) {
-				////<alpha_blend, pp_UseAlpha, pp_Texture, pp_IgnoreTexA, pp_ShadInstr, pp_Offset >
-				RendtriangleFn fn = RendtriangleFns[alpha_mode][params[i].tsp.UseAlpha][params[i].pcw.Texture][params[i].tsp.IgnoreTexA][params[i].tsp.ShadInstr][params[i].pcw.Offset];
+static struct
+{
+	slock_t*   lock;
+	scond_t*   wake;        //workers: a frame was binned
+	scond_t*   done;        //rend thread: a tile was finished
+	sthread_t* threads[SOFT_MAX_THREADS];
+	u32        count;
+	bool       quit;
+
+	u32        next;        //next tile to rasterize
+	u32        finished;
+} soft_pool;
+
+static void soft_worker(void*)
+{
+	slock_lock(soft_pool.lock);
 
-				fn(&params[i], v, verts[poly_idx[v]], verts[poly_idx[v + 1]], verts[poly_idx[v + 2]], render_buffer, area);
-			}
+	for (;;)
+	{
+		while (!soft_pool.quit && soft_pool.next == TILE_COUNT)
+			scond_wait(soft_pool.wake, soft_pool.lock);
+
+		if (soft_pool.quit)
+			break;
+
+		u32 tile = soft_pool.next++;
+		slock_unlock(soft_pool.lock);
+
+		RenderTile(tile);
+
+		slock_lock(soft_pool.lock);
+		if (++soft_pool.finished == TILE_COUNT)
+			scond_signal(soft_pool.done);
+	}
+
+	slock_unlock(soft_pool.lock);
+}
+
+static u32 soft_cpu_count(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long rv = sysconf(_SC_NPROCESSORS_ONLN);
+	return rv > 0 ? rv : 1;
+#endif
+}
+
+static void soft_pool_init(void)
+{
+	//MaxThreads counts the rend thread too, it rasterizes as well
+	u32 threads = settings.pvr.MaxThreads ? settings.pvr.MaxThreads : soft_cpu_count() - 1;
+
+	soft_pool.lock     = slock_new();
+	soft_pool.wake     = scond_new();
+	soft_pool.done     = scond_new();
+	soft_pool.quit     = false;
+	soft_pool.next     = TILE_COUNT;
+	soft_pool.finished = TILE_COUNT;
+	soft_pool.count    = min(max(threads, 1u) - 1, (u32)SOFT_MAX_THREADS);
+
+	for (u32 i = 0; i < soft_pool.count; i++)
+		soft_pool.threads[i] = sthread_create(soft_worker, 0);
+}
+
+static void soft_pool_term(void)
+{
+	if (!soft_pool.lock)
+		return;
+
+	slock_lock(soft_pool.lock);
+	soft_pool.quit = true;
+	scond_broadcast(soft_pool.wake);
+	slock_unlock(soft_pool.lock);
+
+	for (u32 i = 0; i < soft_pool.count; i++)
+		sthread_join(soft_pool.threads[i]);
+
+	scond_free(soft_pool.done);
+	scond_free(soft_pool.wake);
+	slock_free(soft_pool.lock);
+	soft_pool.lock = 0;
+}
+#endif
+
+static void RenderTiles(void)
+{
+#ifndef TARGET_NO_THREADS
+	slock_lock(soft_pool.lock);
+	soft_pool.next = 0;
+	soft_pool.finished = 0;
+	scond_broadcast(soft_pool.wake);
+
+	//help out, then wait for the tiles still in flight
+	while (soft_pool.next < TILE_COUNT)
+	{
+		u32 tile = soft_pool.next++;
+		slock_unlock(soft_pool.lock);
+
+		RenderTile(tile);
+
+		slock_lock(soft_pool.lock);
+		soft_pool.finished++;
+	}
+
+	while (soft_pool.finished != TILE_COUNT)
+		scond_wait(soft_pool.done, soft_pool.lock);
+	slock_unlock(soft_pool.lock);
+#else
+	for (u32 tile = 0; tile < TILE_COUNT; tile++)
+		RenderTile(tile);
+#endif
+}
+
+void co_dc_yield(void);
+extern retro_get_cpu_features_t perf_get_cpu_features_cb;
+
+struct softrend : Renderer
+{
+	virtual bool Process(TA_context* ctx) {
+		//disable RTTs for now ..
+		if (ctx->rend.isRTT)
+			return false;
+
+#ifndef TARGET_NO_THREADS
+		slock_lock(ctx->rend_inuse);
+#endif
+		ctx->MarkRend();
+
+		if (KillTex)
+		{
+			raw_killtex();
+			printf("Texture cache cleared\n");
 		}
+
+		textures.clear();
+
+		if (!ta_parse_vdrc(ctx))
+			return false;
+
+		raw_CollectCleanup();
+
+		//protect everything the textures of this frame locked
+		libCore_vramlock_Flush();
+
+		return true;
 	}
+
 	virtual bool Render() {
 		bool is_rtt = pvrrc.isRTT;
 
-		memset(render_buffer, 0, sizeof(render_buffer));
-
-		if (pvrrc.verts.used()<3)
-			return false;
+		triangles.clear();
+		for (int i = 0; i < TILE_COUNT; i++)
+			tile_bins[i].clear();
 
 		if (pvrrc.isAutoSort)
 			SortPParams();
 
-		int tcount = omp_get_num_procs() - 1;
-		if (tcount == 0) tcount = 1;
-		if (tcount > settings.pvr.MaxThreads) tcount = settings.pvr.MaxThreads;
-#pragma omp parallel num_threads(tcount)
+		if (pvrrc.verts.used() >= 3)
 		{
-			int thd = omp_get_thread_num();
-			int y_offs = 480 % omp_get_num_threads();
-			int y_thd = 480 / omp_get_num_threads();
-			int y_start = (!!thd) * y_offs + y_thd * thd;
-			int y_end =  y_offs + y_thd * (thd + 1);
-
-			RECT area = { 0, y_start, 640, y_end };
-			RenderParamList<0>(&pvrrc.global_param_op, &area);
-			RenderParamList<1>(&pvrrc.global_param_pt, &area);
-			RenderParamList<2>(&pvrrc.global_param_tr, &area);
+			BinParamList<0>(&pvrrc.global_param_op);
+			BinParamList<1>(&pvrrc.global_param_pt);
+			BinParamList<2>(&pvrrc.global_param_tr);
 		}
 
-		
-		
-
-		/*
-		for (int y = 0; y < 480; y++) {
-			for (int x = 0; x < 640; x++) {
-				color_buffer[x + y * 640] = rand();
-			}
-		} */
+		RenderTiles();
 
 		return !is_rtt;
 	}
 
-	HWND hWnd;
-	HBITMAP hBMP = 0, holdBMP;
-	HDC hmem;
-	
-
-
 	virtual bool Init() {
+		libCore_vramlock_Init();
+		texcache_Init(perf_get_cpu_features_cb ? perf_get_cpu_features_cb() : 0);
+
 		const_setAlpha = _mm_set1_epi32(0xFF000000);
-		u8 ushuffle[] = { 0x0E, 0x80, 0x0E, 0x80, 0x0E, 0x80, 0x0E, 0x80, 0x06, 0x80, 0x06, 0x80, 0x06, 0x80, 0x06, 0x80};
-		memcpy(&shuffle_alpha, ushuffle, sizeof(shuffle_alpha));
 
 		#define REP_16(x) ((x)* 16 + (x))
 		#define REP_32(x) ((x)* 8 + (x)/4)
@@ -1136,6 +1190,10 @@ struct softrend : Renderer
 			RendtriangleFns[2][1][0][1][3][1] = &Rendtriangle<2, 1, 0, 1, 3, 1>;
 		}
 
+#ifndef TARGET_NO_THREADS
+		soft_pool_init();
+#endif
+
 		return true;
 	}
 
@@ -1144,46 +1202,25 @@ struct softrend : Renderer
 	}
 
 	virtual void Term() {
+#ifndef TARGET_NO_THREADS
+		soft_pool_term();
+#endif
+		libCore_vramlock_Free();
 	}
 
-	#define RR(x, a, b, c, d) (x + a), (x + b), (x + c), (x + d)
-	#define R(a, b, c, d) RR(12, a, b, c, d), RR(8, a, b, c, d), RR(4, a, b, c, d),  RR(0, a, b, c, d)
-
-	//R coefs should be adjusted to match pixel format
-	INLINE __m128 shuffle_pixel(__m128 v)
-   {
-		return (__m128)_mm_shuffle_epi8((__m128i)v, _mm_set_epi8(R(0x80,2,1, 0)));
- 	}
-
+	//the tiles are untiled to softrend_pixels as they finish
 	virtual void Present() {
+		co_dc_yield();
+	}
 
-		__m128* psrc = (__m128*)render_buffer;
-		__m128* pdst = (__m128*)pixels;
-
-		#define SHUFFL(v) v
-
-		#if HOST_OS == OS_WINDOWS
-			#define FLIP_Y 479 - 
-		#else
-			#define FLIP_Y
-		#endif
-
-		const int stride = STRIDE_PIXEL_OFFSET / 4;
-		for (int y = 0; y<MAX_RENDER_HEIGHT; y += 4)
-		{
-			for (int x = 0; x<MAX_RENDER_WIDTH; x += 4)
-			{
-				pdst[(FLIP_Y - (y + 0))*stride + x / 4] = SHUFFL(*psrc++);
-				pdst[(FLIP_Y - (y + 1))*stride + x / 4] = SHUFFL(*psrc++);
-				pdst[(FLIP_Y - (y + 2))*stride + x / 4] = SHUFFL(*psrc++);
-				pdst[(FLIP_Y - (y + 3))*stride + x / 4] = SHUFFL(*psrc++);
-			}
-		}
-
-      /* should do a video_cb call here */
+	virtual u32 GetTexture(TSP tsp, TCW tcw) {
+		textures.push_back(raw_GetTexture(tsp, tcw));
+		return textures.size() - 1;
 	}
 };
 
 Renderer* rend_softrend() {
 	return new(_mm_malloc(sizeof(softrend), 32)) softrend();
 }
+
+#endif
@@ -0,0 +1,53 @@
+#include <algorithm>
+
+#include "sorter.h"
+
+bool operator<(const PolyParam &left, const PolyParam &right)
+{
+   /* put any condition you want to sort on here */
+	return left.zvZ  < right.zvZ;
+#if 0
+	return left.zMin < right.zMax;
+#endif
+}
+
+//Sort based on min-z of each strip
+void SortPParams(void)
+{
+   u16 *idx_base      = NULL;
+   Vertex *vtx_base   = NULL;
+   PolyParam *pp      = NULL;
+   PolyParam *pp_end  = NULL;
+
+   if (pvrrc.verts.used()==0 || pvrrc.global_param_tr.used()<=1)
+      return;
+
+   vtx_base          = pvrrc.verts.head();
+   idx_base          = pvrrc.idx.head();
+   pp                = pvrrc.global_param_tr.head();
+   pp_end            = pp + pvrrc.global_param_tr.used();
+
+   while(pp!=pp_end)
+   {
+      if (pp->count<2)
+         pp->zvZ=0;
+      else
+      {
+         u16*      idx   = idx_base+pp->first;
+         Vertex*   vtx   = vtx_base+idx[0];
+         Vertex* vtx_end = vtx_base + idx[pp->count-1]+1;
+         u32 zv          = 0xFFFFFFFF;
+
+         while(vtx!=vtx_end)
+         {
+            zv = min(zv,(u32&)vtx->z);
+            vtx++;
+         }
+
+         pp->zvZ=(f32&)zv;
+      }
+      pp++;
+   }
+
+   std::stable_sort(pvrrc.global_param_tr.head(),pvrrc.global_param_tr.head()+pvrrc.global_param_tr.used());
+}
@@ -0,0 +1,5 @@
+#pragma once
+#include "rend/rend.h"
+
+//Sorts the translucent list by the min-z of each strip, for autosort
+void SortPParams(void);
@@ -0,0 +1,311 @@
+/*
+	Save states
+
+	Layout:
+		ser_Header
+		for each section:
+			ser_SectionHeader
+			capacity bytes, the section data then zeroes
+
+	Every section has a fixed capacity, so a state is always ser_Size bytes
+	and each section sits at the same offset in every state.
+
+	States are raw and complete on their own, no deltas and no packing.
+	libretro wants one buffer size for the whole run, and the frontend keeps
+	each buffer on its own and may load it in another process, where a delta
+	has no keyframe to apply to. Packing doesn't shrink a fixed size buffer
+	either, it only moves bytes around, which defeats the frontend's own
+	rewind deltas and compression. Stable offsets and zero padding are what
+	those work best on.
+*/
+
+#include "serialize.h"
+#include "hw/sh4/sh4_mem.h"
+#include "hw/pvr/pvr.h"
+#include "hw/pvr/ta.h"
+#include "hw/aica/aica.h"
+
+#define SER_MAGIC   0x54534352	//"RCST"
+#define SER_VERSION 2
+
+//Memory is compared and written back in pages on load
+#define SER_PAGE_SIZE (16*1024)
+
+#define SER_FOURCC(a,b,c,d) ((a) | ((b)<<8) | ((c)<<16) | ((d)<<24))
+
+//Hook capacities, with plenty of room over what the hooks write today
+#define SER_MAX_SMALL (64*1024)
+#define SER_MAX_HOLLY (256*1024)
+//the gdrom read chunk and the pio buffer
+#define SER_MAX_GDROM (512*1024)
+//the most mcfg_CreateDevices plugs is two vmus per controller
+#define SER_MAX_MAPLE (4*2*(132*1024))
+//the context the TA is filling and one waiting for STARTRENDER
+#define SER_TA_CONTEXTS 2
+#define SER_MAX_TA (SER_TA_CONTEXTS*(TA_DATA_SIZE+64)+64)
+
+struct ser_Header
+{
+	u32 magic;
+	u32 version;
+	u32 size;
+	u32 sections;
+};
+
+struct ser_SectionHeader
+{
+	u32 id;
+	u32 version;
+	u32 size;		//bytes used
+	u32 capacity;	//bytes that follow
+};
+
+typedef void ser_HookFP(ser_Stream& s);
+
+struct ser_Section
+{
+	u32 id;
+	u32 version;	//bump when the hook or memory layout changes
+	u32 capacity;
+
+	VArray2* mem;
+	ser_HookFP* hook;
+};
+
+//Restored in this order. The scheduler goes last, so the hooks before it
+//can't leave behind timers of their own
+static ser_Section sections[]=
+{
+	{ SER_FOURCC('R','A','M',' '), 1, RAM_SIZE,  &mem_b,    0 },
+	{ SER_FOURCC('V','R','A','M'), 1, VRAM_SIZE, &vram,     0 },
+	{ SER_FOURCC('A','R','A','M'), 1, ARAM_SIZE, &aica_ram, 0 },
+
+	{ SER_FOURCC('S','H','4',' '), 1, SER_MAX_SMALL, 0, sh4_Serialize },
+	{ SER_FOURCC('I','N','T','C'), 1, SER_MAX_SMALL, 0, interrupts_Serialize },
+	{ SER_FOURCC('M','M','R',' '), 1, SER_MAX_SMALL, 0, sh4_mmr_Serialize },
+	{ SER_FOURCC('M','M','U',' '), 1, SER_MAX_SMALL, 0, mmu_Serialize },
+	{ SER_FOURCC('T','M','U',' '), 1, SER_MAX_SMALL, 0, tmu_Serialize },
+	{ SER_FOURCC('H','O','L','Y'), 1, SER_MAX_HOLLY, 0, holly_Serialize },
+	{ SER_FOURCC('P','V','R',' '), 1, SER_MAX_SMALL, 0, pvr_Serialize },
+	{ SER_FOURCC('T','A',' ',' '), 1, SER_MAX_TA,    0, ta_Serialize },
+	{ SER_FOURCC('A','I','C','A'), 1, SER_MAX_SMALL, 0, aica_Serialize },
+	{ SER_FOURCC('A','R','M','7'), 1, SER_MAX_SMALL, 0, arm_Serialize },
+	{ SER_FOURCC('G','D','R','M'), 1, SER_MAX_GDROM, 0, gdrom_Serialize },
+	{ SER_FOURCC('M','A','P','L'), 1, SER_MAX_MAPLE, 0, maple_Serialize },
+	{ SER_FOURCC('S','C','H','D'), 1, SER_MAX_SMALL, 0, sh4_sched_Serialize },
+};
+
+#define SER_SECTIONS (sizeof(sections)/sizeof(sections[0]))
+
+/*
+	Stream
+*/
+
+void ser_Data(ser_Stream& s, void* ptr, u32 size)
+{
+	if (s.failed)
+		return;
+
+	if (s.mode!=SER_SIZE)
+	{
+		if (size>s.size-s.pos)
+		{
+			s.failed=true;
+			return;
+		}
+
+		if (s.mode==SER_SAVE)
+			memcpy(s.data+s.pos,ptr,size);
+		else
+			memcpy(ptr,s.data+s.pos,size);
+	}
+
+	s.pos+=size;
+}
+
+void ser_Regs(ser_Stream& s, RegisterStruct* regs, u32 count)
+{
+	for (u32 i=0;i<count;i++)
+	{
+		if (!(regs[i].flags & REG_RF))
+			SER(s,regs[i].data32);
+	}
+}
+
+/*
+	States
+*/
+
+u32 ser_Size(void)
+{
+	u32 total=sizeof(ser_Header);
+
+	for (u32 i=0;i<SER_SECTIONS;i++)
+		total+=sizeof(ser_SectionHeader)+sections[i].capacity;
+
+	return total;
+}
+
+bool ser_Save(void* data, u32 size)
+{
+	u32 total=ser_Size();
+
+	if (size<total)
+		return false;
+
+	u8* dst=(u8*)data;
+
+	ser_Header hdr;
+	hdr.magic=SER_MAGIC;
+	hdr.version=SER_VERSION;
+	hdr.size=total;
+	hdr.sections=SER_SECTIONS;
+
+	memcpy(dst,&hdr,sizeof(hdr));
+	dst+=sizeof(hdr);
+
+	for (u32 i=0;i<SER_SECTIONS;i++)
+	{
+		ser_Section& sect=sections[i];
+		u8* body=dst+sizeof(ser_SectionHeader);
+		u32 used;
+
+		if (sect.mem)
+		{
+			used=sect.mem->size;
+			memcpy(body,sect.mem->data,used);
+		}
+		else
+		{
+			ser_Stream s={SER_SAVE,body,0,sect.capacity,false};
+			sect.hook(s);
+
+			if (s.failed)
+			{
+				EMUERROR3("Save state: section %.4s is over its %d bytes",(char*)&sect.id,sect.capacity);
+				return false;
+			}
+
+			used=s.pos;
+		}
+
+		memset(body+used,0,sect.capacity-used);
+
+		ser_SectionHeader sh;
+		sh.id=sect.id;
+		sh.version=sect.version;
+		sh.size=used;
+		sh.capacity=sect.capacity;
+
+		memcpy(dst,&sh,sizeof(sh));
+		dst=body+sect.capacity;
+	}
+
+	memset(dst,0,size-total);
+
+	return true;
+}
+
+//Finds every section this build knows and checks it fits, nothing is touched
+static bool ser_Decode(const u8* src, u32 size, const u8** found, u32* used)
+{
+	ser_Header hdr;
+
+	if (size<sizeof(hdr))
+		return false;
+
+	memcpy(&hdr,src,sizeof(hdr));
+
+	if (hdr.magic!=SER_MAGIC || hdr.version!=SER_VERSION || hdr.size>size || hdr.size<sizeof(hdr))
+	{
+		EMUERROR("Save state: not a state, or an unsupported version");
+		return false;
+	}
+
+	ser_SectionHeader headers[SER_SECTIONS];
+
+	u32 pos=sizeof(hdr);
+	for (u32 n=0;n<hdr.sections;n++)
+	{
+		ser_SectionHeader sh;
+
+		if (hdr.size-pos<sizeof(sh))
+			return false;
+
+		memcpy(&sh,src+pos,sizeof(sh));
+		pos+=sizeof(sh);
+
+		if (sh.capacity>hdr.size-pos || sh.size>sh.capacity)
+			return false;
+
+		//sections this build doesn't know about are skipped
+		for (u32 i=0;i<SER_SECTIONS;i++)
+		{
+			if (sections[i].id==sh.id)
+			{
+				found[i]=src+pos;
+				headers[i]=sh;
+			}
+		}
+
+		pos+=sh.capacity;
+	}
+
+	for (u32 i=0;i<SER_SECTIONS;i++)
+	{
+		ser_Section& sect=sections[i];
+		ser_SectionHeader& sh=headers[i];
+
+		if (!found[i] || sh.version!=sect.version || (sect.mem && sh.size!=sect.mem->size))
+		{
+			EMUERROR2("Save state: section %.4s is missing or incompatible",(char*)&sect.id);
+			return false;
+		}
+
+		used[i]=sh.size;
+	}
+
+	return true;
+}
+
+bool ser_Load(const void* data, u32 size)
+{
+	const u8* found[SER_SECTIONS]={0};
+	u32 used[SER_SECTIONS];
+
+	if (!ser_Decode((const u8*)data,size,found,used))
+		return false;
+
+	bool rv=true;
+
+	for (u32 i=0;i<SER_SECTIONS;i++)
+	{
+		ser_Section& sect=sections[i];
+
+		if (sect.mem)
+		{
+			//only touch the pages that differ, writes to locked vram
+			//drop textures, writes to code drop blocks
+			for (u32 offset=0;offset<sect.mem->size;offset+=SER_PAGE_SIZE)
+			{
+				u32 len=min(sect.mem->size-offset,(u32)SER_PAGE_SIZE);
+
+				if (memcmp(sect.mem->data+offset,found[i]+offset,len)!=0)
+					memcpy(sect.mem->data+offset,found[i]+offset,len);
+			}
+		}
+		else
+		{
+			ser_Stream s={SER_LOAD,(u8*)found[i],0,used[i],false};
+			sect.hook(s);
+
+			if (s.failed || s.pos!=s.size)
+			{
+				EMUERROR2("Save state: failed to restore section %.4s",(char*)&sect.id);
+				rv=false;
+			}
+		}
+	}
+
+	return rv;
+}
@@ -0,0 +1,57 @@
+/*
+	Save states
+
+	The state is a list of versioned sections, one per module plus one per
+	memory area. Each module has a hook that walks its state with ser_Data,
+	field by field, the same code saving and restoring it.
+*/
+#pragma once
+#include "types.h"
+
+enum ser_Mode
+{
+	SER_SIZE,	//only counts the bytes
+	SER_SAVE,
+	SER_LOAD,
+};
+
+struct ser_Stream
+{
+	ser_Mode mode;
+
+	u8* data;	//output on save, input on load
+	u32 pos;
+	u32 size;	//bytes there are to read on load, or room for on save
+
+	bool failed;	//ran out of data, or the hook found a bad value
+
+	bool load() const { return mode==SER_LOAD; }
+};
+
+void ser_Data(ser_Stream& s, void* ptr, u32 size);
+
+#define SER(s,v) ser_Data(s,&(v),sizeof(v))
+
+//the data of the registers that don't have a read handler
+void ser_Regs(ser_Stream& s, RegisterStruct* regs, u32 count);
+
+//Module hooks, see the section list in serialize.cpp
+void sh4_Serialize(ser_Stream& s);
+void interrupts_Serialize(ser_Stream& s);
+void sh4_mmr_Serialize(ser_Stream& s);
+void mmu_Serialize(ser_Stream& s);
+void tmu_Serialize(ser_Stream& s);
+void holly_Serialize(ser_Stream& s);
+void pvr_Serialize(ser_Stream& s);
+void ta_Serialize(ser_Stream& s);
+void aica_Serialize(ser_Stream& s);
+void arm_Serialize(ser_Stream& s);
+void gdrom_Serialize(ser_Stream& s);
+void maple_Serialize(ser_Stream& s);
+void sh4_sched_Serialize(ser_Stream& s);
+
+//Size of a state, the same for the whole run
+u32 ser_Size(void);
+//Saves the current state, anything past ser_Size is zeroed
+bool ser_Save(void* data, u32 size);
+bool ser_Load(const void* data, u32 size);
@@ -436,8 +436,8 @@ using namespace std;
 #include "stdclass.h"
 
 #define EMUERROR(x)( printf("Error in %s:" "%s" ":%d  -> " x "\n", __FILE__,__FUNCTION__ ,__LINE__ ))
-#define EMUERROR2(x,a)(printf("Error in %s:" "%s" ":%d  -> " x "\n)",__FILE__,__FUNCTION__,__LINE__,a))
-#define EMUERROR3(x,a,b)(printf("Error in %s:" "%s" ":%d  -> " x "\n)",__FILE__,__FUNCTION__,__LINE__,a,b))
+#define EMUERROR2(x,a)(printf("Error in %s:" "%s" ":%d  -> " x "\n",__FILE__,__FUNCTION__,__LINE__,a))
+#define EMUERROR3(x,a,b)(printf("Error in %s:" "%s" ":%d  -> " x "\n",__FILE__,__FUNCTION__,__LINE__,a,b))
 #define EMUERROR4(x,a,b,c)(printf("Error in %s:" "%s" ":%d  -> " x "\n",__FILE__,__FUNCTION__,__LINE__,a,b,c))
 
 #define EMUWARN(x)(printf(      "Warning in %s:" "%s" ":%d  -> " x "\n"),__FILE__,__FUNCTION__,__LINE__))
@@ -572,6 +572,7 @@ struct settings_t
 		bool idleskip;
 		bool unstable_opt;
 		bool disable_nvmem;
+		bool BlockCache;
 	} dynarec;
 	
 	struct
@@ -601,6 +602,7 @@ struct settings_t
       u32 NoSound;        //0 ->sound, 1 -> no sound
       bool InterruptHack;
       bool AegStepHack;
+      bool ArmRec;        //run the ARM7 on the recompiler, where there is one
    } aica;
 
 	struct
@@ -609,6 +611,7 @@ struct settings_t
 		bool LoadDefaultImage;
 		char DefaultImage[512];
 		char LastImage[512];
+		u32 ChdCacheHunks;		//decompressed chd hunks kept in memory
 	} imgread;
 
 	struct
@@ -645,10 +648,11 @@ struct settings_t
 		} OSD;
 
 		u32 ta_skip;
+		u32 ta_incremental;	//decode lists as they close, 0 -> when rendering
 		u32 subdivide_transp;
-		u32 rend;
+		u32 rend;			//0 -> gles, 1 -> software
 		
-		u32 MaxThreads;
+		u32 MaxThreads;		//software renderer threads, 0 -> one per core
 		u32 SynchronousRendering;
 	} pvr;
 
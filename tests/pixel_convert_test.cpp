@@ -0,0 +1,192 @@
+/*
+	Golden check for the SIMD texture decoders in pixel_convert.h.
+
+	Every SIMD path is run against the generic scalar template on random vram,
+	for every twiddled size, and the outputs are compared byte for byte.
+	Build and run with "make test".
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+using std::min;
+using std::max;
+
+#include "types.h"
+#include "libretro/libretro.h"
+#include "hw/pvr/tr.h"
+#include "hw/pvr/pixel_convert.h"
+
+u32 palette_ram[1024];
+u32 detwiddle[2][8][1024];
+
+//same as tr.cpp
+static u32 twiddle_slow(u32 x,u32 y,u32 x_sz,u32 y_sz)
+{
+	u32 sh=0;
+	u32 rv=0;
+
+	x_sz>>=1;
+	y_sz>>=1;
+	while(x_sz!=0 || y_sz!=0)
+	{
+		if (y_sz)
+		{
+			rv|=(y&1)<<sh;
+			y_sz>>=1;
+			y>>=1;
+			sh++;
+		}
+		if (x_sz)
+		{
+			rv|=(x&1)<<sh;
+			x_sz>>=1;
+			x>>=1;
+			sh++;
+		}
+	}
+	return rv;
+}
+
+static void BuildTwiddleTables(void)
+{
+	for (u32 s=0;s<8;s++)
+	{
+		u32 x_sz=1024;
+		u32 y_sz=8<<s;
+		for (u32 i=0;i<x_sz;i++)
+		{
+			detwiddle[0][s][i]=twiddle_slow(i,0,x_sz,y_sz);
+			detwiddle[1][s][i]=twiddle_slow(0,i,y_sz,x_sz);
+		}
+	}
+}
+
+#ifdef TEX_SIMD
+//derived convertors don't match the specializations, so these get the scalar templates
+struct ref565_TW : conv565_TW { };
+struct ref1555_TW : conv1555_TW { };
+struct ref4444_TW : conv4444_TW { };
+struct refPAL4_TW : convPAL4_TW { };
+struct refPAL8_TW : convPAL8_TW { };
+
+typedef void TexConvFP(PixelBuffer* pb,u8* p_in,u32 Width,u32 Height);
+
+//room for a 1024x1024 8bpp texture plus the vq codebook, with some to spare
+#define TEST_VRAM_SIZE (2*1024*1024)
+//a row pad so the stride differs from the width
+#define TEST_PAD 8
+
+static u8* vram_in;
+static u16* out_ref;
+static u16* out_simd;
+static u32 failures;
+
+static void fill_random(void)
+{
+	for (u32 i=0;i<TEST_VRAM_SIZE;i++)
+		vram_in[i]=rand();
+	for (u32 i=0;i<1024;i++)
+		palette_ram[i]=rand()&0xFFFF;
+}
+
+static void decode(TexConvFP* conv,u16* out,u32 w,u32 h,u32 stride,u32 pal)
+{
+	PixelBuffer pb;
+	pb.p_buffer_start=out;
+	pb.p_current_line=out;
+	pb.p_current_pixel=out;
+	pb.pixels_per_line=stride;
+	pb.palette_index=pal;
+	pb.vq_codebook=vram_in;
+
+	conv(&pb,vram_in,w,h);
+}
+
+//pal_bpp: 0 for the 16 bit formats, else the bits per index, which sets the palette bank size
+static void compare(const char* name,TexConvFP* ref,TexConvFP* simd,u32 pal_bpp)
+{
+	u32 tests=0;
+
+	for (u32 sx=3;sx<=10;sx++)
+	{
+		for (u32 sy=3;sy<=10;sy++)
+		{
+			u32 w=1<<sx;
+			u32 h=1<<sy;
+
+			for (u32 pad=0;pad<=TEST_PAD;pad+=TEST_PAD)
+			{
+				u32 stride=w+pad;
+				u32 bytes=stride*h*2;
+				u32 pal_index=pal_bpp ? (rand()%(1024>>pal_bpp))<<pal_bpp : 0;
+
+				fill_random();
+				memset(out_ref,0xCD,bytes);
+				memset(out_simd,0xCD,bytes);
+
+				decode(ref,out_ref,w,h,stride,pal_index);
+				decode(simd,out_simd,w,h,stride,pal_index);
+
+				if (memcmp(out_ref,out_simd,bytes)!=0)
+				{
+					printf("%s: mismatch at %dx%d stride %d\n",name,w,h,stride);
+					failures++;
+				}
+				tests++;
+			}
+		}
+	}
+
+	printf("%s: %d sizes\n",name,tests);
+}
+
+static void texture_PAL4_simd(PixelBuffer* pb,u8* p_in,u32 Width,u32 Height) { texture_PAL<4>(pb,p_in,Width,Height); }
+static void texture_PAL8_simd(PixelBuffer* pb,u8* p_in,u32 Width,u32 Height) { texture_PAL<8>(pb,p_in,Width,Height); }
+
+int main(int argc,char* argv[])
+{
+	BuildTwiddleTables();
+	srand(1);
+
+	vram_in=(u8*)malloc(TEST_VRAM_SIZE);
+	out_ref=(u16*)malloc((1024+TEST_PAD)*1024*2);
+	out_simd=(u16*)malloc((1024+TEST_PAD)*1024*2);
+
+	compare("TW16 565",&texture_TW<ref565_TW>,&texture_TW16<0>,0);
+	compare("TW16 1555",&texture_TW<ref1555_TW>,&texture_TW16<1>,0);
+	compare("TW16 4444",&texture_TW<ref4444_TW>,&texture_TW16<4>,0);
+
+	compare("VQ16 565",&texture_VQ<ref565_TW>,&texture_VQ16<0>,0);
+	compare("VQ16 1555",&texture_VQ<ref1555_TW>,&texture_VQ16<1>,0);
+	compare("VQ16 4444",&texture_VQ<ref4444_TW>,&texture_VQ16<4>,0);
+
+	compare("PAL 4bpp",&texture_TW<refPAL4_TW>,&texture_PAL4_simd,4);
+	compare("PAL 8bpp",&texture_TW<refPAL8_TW>,&texture_PAL8_simd,8);
+
+#if !defined(__aarch64__)
+	if (__builtin_cpu_supports("ssse3"))
+#endif
+		compare("PAL4 tbl",&texture_TW<refPAL4_TW>,&texture_PAL4_tbl,4);
+
+	free(vram_in);
+	free(out_ref);
+	free(out_simd);
+
+	if (failures)
+	{
+		printf("%d failures\n",failures);
+		return 1;
+	}
+
+	printf("all SIMD decoders match the scalar ones\n");
+	return 0;
+}
+#else
+int main(int argc,char* argv[])
+{
+	printf("no SIMD texture decoders on this target\n");
+	return 0;
+}
+#endif